@@ -0,0 +1,86 @@
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "intersect.h"
+
+// Time per intersection and union of every kernel, for a long posting list against shorter ones of
+// several length ratios. The marked kernel is the one choose_intersect_kernel and choose_unite_kernel
+// pick. Build with optimizations (-DCMAKE_BUILD_TYPE=Release), the numbers of a debug build mean
+// nothing.
+
+// count sorted, distinct ids below universe. A clustered list comes in runs of nearby ids, the way
+// the lines of one word bunch up in a few files.
+std::vector<uint32_t> make_ids(size_t count, uint32_t universe, bool clustered, std::mt19937& random) {
+  std::vector<uint32_t> ids;
+  std::uniform_int_distribution<uint32_t> any(0, universe - 1);
+  std::geometric_distribution<uint32_t> gap(0.5);
+  while (ids.size() < count * 2) {
+    uint32_t id = any(random);
+    for (size_t run = clustered ? 32 : 1; run > 0 && id < universe; run--) {
+      ids.push_back(id);
+      id += 1 + gap(random);
+    }
+  }
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  std::shuffle(ids.begin(), ids.end(), random);
+  ids.resize(std::min(count, ids.size()));
+  std::sort(ids.begin(), ids.end());
+  return ids;
+}
+
+// microseconds per call
+template <typename Kernel>
+double time_kernel(Kernel kernel, size_t* result) {
+  size_t rounds = 0;
+  auto start    = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed;
+  do {
+    *result = kernel();
+    rounds++;
+    elapsed = std::chrono::steady_clock::now() - start;
+  } while (elapsed.count() < 0.2);
+  return elapsed.count() / rounds * 1e6;
+}
+
+int main() {
+  const size_t long_count  = 1 << 20;
+  const uint32_t universe  = 1 << 24;
+  const char* const NAMES[] = {"merge", "simd", "hash", "gallop"};
+  std::mt19937 random(42);
+
+  for (bool clustered : {false, true}) {
+    std::printf("%s ids, %zu against 1/ratio as many, microseconds per call (* = chosen)\n", clustered ? "clustered" : "uniform", long_count);
+    std::printf("%-8s %12s %12s %12s %12s   %12s %12s\n", "ratio", "merge", "simd", "hash", "gallop", "union merge", "union gallop");
+
+    std::vector<uint32_t> large = make_ids(long_count, universe, clustered, random);
+    for (size_t ratio : {1, 2, 4, 8, 16, 32, 64, 256, 4096, 65536}) {
+      std::vector<uint32_t> small = make_ids(long_count / ratio, universe, clustered, random);
+      std::vector<uint32_t> out(small.size() + large.size());
+
+      std::printf("%-8zu", ratio);
+      size_t expected = 0;
+      SetKernel chosen = choose_intersect_kernel(small.size(), large.size());
+      for (SetKernel kernel : {SetKernel::MERGE, SetKernel::SIMD, SetKernel::HASH, SetKernel::GALLOP}) {
+        size_t count;
+        double micros = time_kernel([&] { return intersect(small.data(), small.size(), large.data(), large.size(), out.data(), kernel); }, &count);
+        if (kernel == SetKernel::MERGE) expected = count;
+        if (count != expected) std::printf("\n%s intersection is wrong\n", NAMES[(int)kernel]);
+        std::printf(" %11.1f%c", micros, kernel == chosen ? '*' : ' ');
+      }
+
+      std::printf("  ");
+      chosen = choose_unite_kernel(small.size(), large.size());
+      for (SetKernel kernel : {SetKernel::MERGE, SetKernel::GALLOP}) {
+        size_t count;
+        double micros = time_kernel([&] { return unite(small.data(), small.size(), large.data(), large.size(), out.data(), kernel); }, &count);
+        if (count != small.size() + large.size() - expected) std::printf("\n%s union is wrong\n", NAMES[(int)kernel]);
+        std::printf(" %11.1f%c", micros, kernel == chosen ? '*' : ' ');
+      }
+      std::printf("\n");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,59 @@
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "postings.h"
+
+// Decode speed of posting lists, in billions of ids per second. Build with optimizations
+// (-DCMAKE_BUILD_TYPE=Release), the numbers of a debug build mean nothing.
+
+// sorted ids whose gaps are uniform in [1, max_gap]
+std::vector<uint32_t> make_ids(size_t count, uint32_t max_gap, std::mt19937& random) {
+  std::uniform_int_distribution<uint32_t> gap(1, max_gap);
+  std::vector<uint32_t> ids;
+  uint32_t id = 0;
+  for (size_t i = 0; i < count; i++) {
+    id += gap(random);
+    ids.push_back(id);
+  }
+  return ids;
+}
+
+double decode_rate(const PostingList& list, bool simd, std::vector<uint32_t>& out) {
+  size_t rounds = 0;
+  size_t total  = 0;
+  auto start    = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed;
+  do {
+    for (size_t block = 0; block < list.block_count(); block++) {
+      total += list.decode_block(block, out.data() + block * POSTINGS_BLOCK_SIZE, simd);
+    }
+    rounds++;
+    elapsed = std::chrono::steady_clock::now() - start;
+  } while (elapsed.count() < 0.5);
+  return total / elapsed.count() / 1e9;
+}
+
+int main() {
+  const size_t count = 1 << 20;
+  std::mt19937 random(42);
+
+  std::printf("%-12s %12s %14s %14s\n", "max gap", "bytes/id", "scalar Gid/s", "simd Gid/s");
+  for (uint32_t max_gap : {4u, 64u, 1024u, 65536u, 1u << 22}) {
+    std::vector<uint32_t> ids = make_ids(count, max_gap, random);
+    std::string encoded;
+    encode_postings(ids, encoded);
+    PostingList list(encoded.data(), ids.size());
+
+    std::vector<uint32_t> out(ids.size());
+    double scalar = decode_rate(list, false, out);
+    if (out != ids) std::printf("scalar decode is wrong\n");
+    double simd = postings_simd_supported() ? decode_rate(list, true, out) : 0;
+    if (postings_simd_supported() && out != ids) std::printf("simd decode is wrong\n");
+
+    std::printf("%-12u %12.2f %14.2f %14.2f\n", max_gap, (double)encoded.size() / ids.size(), scalar, simd);
+  }
+  return 0;
+}
@@ -0,0 +1,485 @@
+#ifndef _BITMAP_H_
+#define _BITMAP_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+// an array container holds at most this many values, more take less room as a bitset
+#define BITMAP_ARRAY_LIMIT 4096
+// 64 bit words of a bitset container, one bit for each of the 65536 values of a chunk
+#define BITMAP_WORDS 1024
+
+// A set of 32 bit ids in the style of roaring bitmaps. Ids are split into chunks of 65536 by their
+// high 16 bits, every chunk that has ids gets a container for the low 16 bits in whichever of three
+// forms is smallest:
+//
+//   array:  the sorted values, for sparse chunks
+//   bitset: one bit per value, for dense chunks
+//   run:    [first, last] ranges, for chunks of long runs, like every line of a file
+//
+// Operations work chunk by chunk and pick an algorithm by the forms of the two containers: a sparse
+// array is filtered through the other container, bitsets are combined word by word and runs range by
+// range. That keeps "not" cheap: the complement of a sparse set is a few runs.
+class Bitmap {
+public:
+  Bitmap() = default;
+  // the bitmap of sorted, distinct ids
+  Bitmap(const uint32_t* ids, size_t count);
+  // every id from begin up to, not including, end
+  static Bitmap range(uint32_t begin, uint32_t end);
+  // the ids whose bits are set, bit i of words[i / 64] is the id i
+  static Bitmap from_bits(const std::vector<uint64_t>& bits);
+
+  bool empty() const { return containers.empty(); }
+  uint64_t cardinality() const;
+  bool contains(uint32_t id) const;
+  // the smallest id not less than from, false if there is none
+  bool next(uint32_t from, uint32_t* id) const;
+  // the ids from begin up to, not including, end
+  std::vector<uint32_t> ids(uint32_t begin, uint32_t end) const;
+
+  Bitmap operator&(const Bitmap& other) const;
+  Bitmap operator|(const Bitmap& other) const;
+  // the ids of this bitmap that are not in other
+  Bitmap operator-(const Bitmap& other) const;
+  Bitmap& operator|=(const Bitmap& other);
+  // the ids below universe that are not in this bitmap
+  Bitmap flip(uint32_t universe) const;
+
+private:
+  struct Run {
+    uint16_t first;
+    uint16_t last;
+  };
+
+  struct Container {
+    enum class Kind : uint8_t {
+      ARRAY,
+      BITSET,
+      RUN,
+    };
+
+    Kind kind = Kind::ARRAY;
+    std::vector<uint16_t> values;
+    std::vector<uint64_t> words;
+    std::vector<Run> runs;
+    uint32_t cardinality = 0;
+
+    bool contains(uint16_t value) const;
+    std::vector<uint64_t> to_words() const;
+    std::vector<Run> to_runs() const;
+  };
+
+  enum class Op {
+    AND,
+    OR,
+    AND_NOT,
+  };
+
+  static Container from_values(std::vector<uint16_t> values);
+  static Container from_words(std::vector<uint64_t> words);
+  static Container from_runs(std::vector<Run> runs);
+  static Container combine(const Container& a, const Container& b, Op op);
+  static std::vector<Run> combine_runs(const std::vector<Run>& a, const std::vector<Run>& b, Op op);
+  static Container complement(const Container& container, uint16_t last);
+  static Bitmap merge(const Bitmap& a, const Bitmap& b, Op op);
+
+  // the high 16 bits of the ids of every container, sorted
+  std::vector<uint16_t> keys;
+  std::vector<Container> containers;
+};
+
+Bitmap::Bitmap(const uint32_t* ids, size_t count) {
+  size_t i = 0;
+  while (i < count) {
+    uint16_t key = ids[i] >> 16;
+    std::vector<uint16_t> values;
+    for (; i < count && ids[i] >> 16 == key; i++) {
+      values.push_back(ids[i] & 0xffff);
+    }
+    keys.push_back(key);
+    containers.push_back(from_values(std::move(values)));
+  }
+}
+
+Bitmap Bitmap::range(uint32_t begin, uint32_t end) {
+  Bitmap bitmap;
+  while (begin < end) {
+    uint16_t key   = begin >> 16;
+    uint32_t limit = std::min<uint64_t>(end, ((uint64_t)key + 1) << 16);
+    bitmap.keys.push_back(key);
+    bitmap.containers.push_back(from_runs({{(uint16_t)(begin & 0xffff), (uint16_t)((limit - 1) & 0xffff)}}));
+    begin = limit;
+  }
+  return bitmap;
+}
+
+Bitmap Bitmap::from_bits(const std::vector<uint64_t>& bits) {
+  Bitmap bitmap;
+  for (size_t start = 0; start < bits.size(); start += BITMAP_WORDS) {
+    std::vector<uint64_t> words(BITMAP_WORDS, 0);
+    std::copy(bits.begin() + start, bits.begin() + std::min(bits.size(), start + BITMAP_WORDS), words.begin());
+    Container container = from_words(std::move(words));
+    if (container.cardinality == 0) continue;
+    bitmap.keys.push_back(start / BITMAP_WORDS);
+    bitmap.containers.push_back(std::move(container));
+  }
+  return bitmap;
+}
+
+uint64_t Bitmap::cardinality() const {
+  uint64_t total = 0;
+  for (const Container& container : containers) {
+    total += container.cardinality;
+  }
+  return total;
+}
+
+bool Bitmap::contains(uint32_t id) const {
+  auto it = std::lower_bound(keys.begin(), keys.end(), (uint16_t)(id >> 16));
+  return it != keys.end() && *it == id >> 16 && containers[it - keys.begin()].contains(id & 0xffff);
+}
+
+bool Bitmap::next(uint32_t from, uint32_t* id) const {
+  for (size_t i = std::lower_bound(keys.begin(), keys.end(), (uint16_t)(from >> 16)) - keys.begin(); i < keys.size(); i++) {
+    const Container& container = containers[i];
+    uint32_t base              = (uint32_t)keys[i] << 16;
+    // within the chunk of from only values from its low bits on count
+    uint32_t low = keys[i] == from >> 16 ? from & 0xffff : 0;
+
+    if (container.kind == Container::Kind::ARRAY) {
+      auto it = std::lower_bound(container.values.begin(), container.values.end(), low);
+      if (it != container.values.end()) {
+        *id = base | *it;
+        return true;
+      }
+    } else if (container.kind == Container::Kind::RUN) {
+      for (const Run& run : container.runs) {
+        if (run.last >= low) {
+          *id = base | std::max<uint32_t>(run.first, low);
+          return true;
+        }
+      }
+    } else {
+      for (uint32_t word = low / 64; word < BITMAP_WORDS; word++) {
+        uint64_t bits = container.words[word];
+        if (word == low / 64) bits &= ~0ull << (low % 64);
+        if (bits) {
+          *id = base | (word * 64 + __builtin_ctzll(bits));
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+std::vector<uint32_t> Bitmap::ids(uint32_t begin, uint32_t end) const {
+  std::vector<uint32_t> result;
+  uint32_t id;
+  uint32_t from = begin;
+  while (from < end && next(from, &id) && id < end) {
+    result.push_back(id);
+    if (id == UINT32_MAX) break;
+    from = id + 1;
+  }
+  return result;
+}
+
+Bitmap Bitmap::operator&(const Bitmap& other) const {
+  return merge(*this, other, Op::AND);
+}
+
+Bitmap Bitmap::operator|(const Bitmap& other) const {
+  return merge(*this, other, Op::OR);
+}
+
+Bitmap Bitmap::operator-(const Bitmap& other) const {
+  return merge(*this, other, Op::AND_NOT);
+}
+
+// in place, so adding many small bitmaps to a big one doesn't copy the big one every time
+Bitmap& Bitmap::operator|=(const Bitmap& other) {
+  size_t i = 0;
+  for (size_t j = 0; j < other.keys.size(); j++, i++) {
+    while (i < keys.size() && keys[i] < other.keys[j]) i++;
+    if (i < keys.size() && keys[i] == other.keys[j]) {
+      containers[i] = combine(containers[i], other.containers[j], Op::OR);
+    } else {
+      keys.insert(keys.begin() + i, other.keys[j]);
+      containers.insert(containers.begin() + i, other.containers[j]);
+    }
+  }
+  return *this;
+}
+
+Bitmap Bitmap::flip(uint32_t universe) const {
+  Bitmap result;
+  size_t i = 0;
+  for (uint64_t key = 0; key << 16 < universe; key++) {
+    uint16_t last = std::min<uint64_t>(universe - (key << 16), 1 << 16) - 1;
+    while (i < keys.size() && keys[i] < key) i++;
+
+    Container container;
+    if (i < keys.size() && keys[i] == key) {
+      container = complement(containers[i], last);
+    } else {
+      container = from_runs({{0, last}});
+    }
+    if (container.cardinality == 0) continue;
+    result.keys.push_back(key);
+    result.containers.push_back(std::move(container));
+  }
+  return result;
+}
+
+// chunks only one side has are kept for OR and AND_NOT of the left side, dropped otherwise
+Bitmap Bitmap::merge(const Bitmap& a, const Bitmap& b, Op op) {
+  Bitmap result;
+  size_t i = 0;
+  size_t j = 0;
+  while (i < a.keys.size() || j < b.keys.size()) {
+    if (j == b.keys.size() || (i < a.keys.size() && a.keys[i] < b.keys[j])) {
+      if (op != Op::AND) {
+        result.keys.push_back(a.keys[i]);
+        result.containers.push_back(a.containers[i]);
+      }
+      i++;
+    } else if (i == a.keys.size() || b.keys[j] < a.keys[i]) {
+      if (op == Op::OR) {
+        result.keys.push_back(b.keys[j]);
+        result.containers.push_back(b.containers[j]);
+      }
+      j++;
+    } else {
+      Container container = combine(a.containers[i], b.containers[j], op);
+      if (container.cardinality > 0) {
+        result.keys.push_back(a.keys[i]);
+        result.containers.push_back(std::move(container));
+      }
+      i++;
+      j++;
+    }
+  }
+  return result;
+}
+
+Bitmap::Container Bitmap::combine(const Container& a, const Container& b, Op op) {
+  using Kind = Container::Kind;
+
+  // a sparse array is cheapest to check value by value against the other side
+  if (a.kind == Kind::ARRAY && op != Op::OR) {
+    std::vector<uint16_t> values;
+    for (uint16_t value : a.values) {
+      if (b.contains(value) == (op == Op::AND)) values.push_back(value);
+    }
+    return from_values(std::move(values));
+  }
+  if (b.kind == Kind::ARRAY && op == Op::AND) return combine(b, a, op);
+
+  if (a.kind == Kind::ARRAY && b.kind == Kind::ARRAY) {
+    std::vector<uint16_t> values;
+    std::set_union(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(), std::back_inserter(values));
+    return from_values(std::move(values));
+  }
+
+  if (a.kind == Kind::RUN && b.kind == Kind::RUN) return from_runs(combine_runs(a.runs, b.runs, op));
+
+  std::vector<uint64_t> words = a.to_words();
+  std::vector<uint64_t> other = b.to_words();
+  for (size_t w = 0; w < BITMAP_WORDS; w++) {
+    if (op == Op::AND) {
+      words[w] &= other[w];
+    } else if (op == Op::OR) {
+      words[w] |= other[w];
+    } else {
+      words[w] &= ~other[w];
+    }
+  }
+  return from_words(std::move(words));
+}
+
+// walks the boundaries of both run lists and keeps the stretches where the op holds
+std::vector<Bitmap::Run> Bitmap::combine_runs(const std::vector<Run>& a, const std::vector<Run>& b, Op op) {
+  std::vector<std::pair<uint32_t, int>> edges;
+  for (const Run& run : a) {
+    edges.emplace_back(run.first, 1);
+    edges.emplace_back(run.last + 1, -1);
+  }
+  for (const Run& run : b) {
+    edges.emplace_back(run.first, 2);
+    edges.emplace_back(run.last + 1, -2);
+  }
+  std::sort(edges.begin(), edges.end());
+
+  std::vector<Run> result;
+  int in_a       = 0;
+  int in_b       = 0;
+  bool inside    = false;
+  uint32_t start = 0;
+  for (size_t i = 0; i < edges.size();) {
+    uint32_t position = edges[i].first;
+    for (; i < edges.size() && edges[i].first == position; i++) {
+      int edge = edges[i].second;
+      if (edge == 1 || edge == -1) {
+        in_a += edge;
+      } else {
+        in_b += edge / 2;
+      }
+    }
+
+    bool now = op == Op::AND ? in_a && in_b : op == Op::OR ? in_a || in_b : in_a && !in_b;
+    if (now && !inside) start = position;
+    if (!now && inside) result.push_back({(uint16_t)start, (uint16_t)(position - 1)});
+    inside = now;
+  }
+  return result;
+}
+
+Bitmap::Container Bitmap::complement(const Container& container, uint16_t last) {
+  if (container.kind == Container::Kind::RUN) {
+    std::vector<Run> gaps;
+    uint32_t start = 0;
+    for (const Run& run : container.runs) {
+      if (run.first > last) break;
+      if (run.first > start) gaps.push_back({(uint16_t)start, (uint16_t)(run.first - 1)});
+      start = run.last + 1;
+    }
+    if (start <= last) gaps.push_back({(uint16_t)start, last});
+    return from_runs(std::move(gaps));
+  }
+
+  std::vector<uint64_t> words = container.to_words();
+  for (size_t w = 0; w < BITMAP_WORDS; w++) {
+    uint32_t first = w * 64;
+    if (first > last) {
+      words[w] = 0;
+    } else {
+      words[w] = ~words[w];
+      if (last - first < 63) words[w] &= (2ull << (last - first)) - 1;
+    }
+  }
+  return from_words(std::move(words));
+}
+
+bool Bitmap::Container::contains(uint16_t value) const {
+  if (kind == Kind::ARRAY) return std::binary_search(values.begin(), values.end(), value);
+  if (kind == Kind::BITSET) return words[value / 64] >> (value % 64) & 1;
+
+  auto it = std::upper_bound(runs.begin(), runs.end(), value, [](uint16_t v, const Run& run) { return v < run.first; });
+  return it != runs.begin() && std::prev(it)->last >= value;
+}
+
+std::vector<uint64_t> Bitmap::Container::to_words() const {
+  if (kind == Kind::BITSET) return words;
+
+  std::vector<uint64_t> result(BITMAP_WORDS, 0);
+  if (kind == Kind::ARRAY) {
+    for (uint16_t value : values) {
+      result[value / 64] |= 1ull << (value % 64);
+    }
+    return result;
+  }
+  for (const Run& run : runs) {
+    for (uint32_t value = run.first; value <= run.last;) {
+      // whole words at once where the run covers them
+      if (value % 64 == 0 && value + 63 <= run.last) {
+        result[value / 64] = ~0ull;
+        value += 64;
+      } else {
+        result[value / 64] |= 1ull << (value % 64);
+        value++;
+      }
+    }
+  }
+  return result;
+}
+
+std::vector<Bitmap::Run> Bitmap::Container::to_runs() const {
+  if (kind == Kind::RUN) return runs;
+
+  std::vector<Run> result;
+  std::vector<uint64_t> bits = to_words();
+  for (uint32_t value = 0; value < 1 << 16;) {
+    uint64_t word = bits[value / 64] >> (value % 64);
+    if (word == 0) {
+      value = (value / 64 + 1) * 64;
+      continue;
+    }
+    value += __builtin_ctzll(word);
+    uint32_t start = value;
+    while (value < 1 << 16 && (bits[value / 64] >> (value % 64) & 1)) value++;
+    result.push_back({(uint16_t)start, (uint16_t)(value - 1)});
+  }
+  return result;
+}
+
+Bitmap::Container Bitmap::from_values(std::vector<uint16_t> values) {
+  if (values.size() > BITMAP_ARRAY_LIMIT) {
+    Container array;
+    array.values = std::move(values);
+    return from_words(array.to_words());
+  }
+
+  Container container;
+  container.cardinality = values.size();
+  container.values      = std::move(values);
+  return container;
+}
+
+// picks the smallest form: 2 bytes per value, 4 per run or 8 KiB for a bitset
+Bitmap::Container Bitmap::from_words(std::vector<uint64_t> words) {
+  uint32_t cardinality = 0;
+  uint32_t run_count   = 0;
+  uint64_t previous    = 0;
+  for (uint64_t word : words) {
+    cardinality += __builtin_popcountll(word);
+    // a run starts at every set bit whose lower neighbour is clear
+    run_count += __builtin_popcountll(word & ~(word << 1 | previous >> 63));
+    previous = word;
+  }
+
+  Container container;
+  container.cardinality = cardinality;
+  if (run_count * 4 < std::min<uint32_t>(cardinality * 2, BITMAP_WORDS * 8)) {
+    Container bitset;
+    bitset.kind    = Container::Kind::BITSET;
+    bitset.words   = std::move(words);
+    container.kind = Container::Kind::RUN;
+    container.runs = bitset.to_runs();
+  } else if (cardinality <= BITMAP_ARRAY_LIMIT) {
+    for (uint32_t w = 0; w < BITMAP_WORDS; w++) {
+      for (uint64_t word = words[w]; word; word &= word - 1) {
+        container.values.push_back(w * 64 + __builtin_ctzll(word));
+      }
+    }
+  } else {
+    container.kind  = Container::Kind::BITSET;
+    container.words = std::move(words);
+  }
+  return container;
+}
+
+Bitmap::Container Bitmap::from_runs(std::vector<Run> runs) {
+  uint32_t cardinality = 0;
+  for (const Run& run : runs) {
+    cardinality += run.last - run.first + 1;
+  }
+  if (runs.size() * 4 < std::min<uint32_t>(cardinality * 2, BITMAP_WORDS * 8)) {
+    Container container;
+    container.kind        = Container::Kind::RUN;
+    container.runs        = std::move(runs);
+    container.cardinality = cardinality;
+    return container;
+  }
+
+  Container container;
+  container.kind = Container::Kind::RUN;
+  container.runs = std::move(runs);
+  return from_words(container.to_words());
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef _BLOOM_CACHE_H_
+#define _BLOOM_CACHE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "index.h"
+#include "mapped_file.h"
+#include "query.h"
+
+#define BLOOM_CACHE_MAGIC "BSBLOOM1"
+#define BLOOM_CACHE_VERSION 1
+// bits of a filter per distinct trigram of its file, and how many of them every trigram sets; about
+// 2% of the trigrams a file doesn't have pass
+#define BLOOM_BITS_PER_TRIGRAM 10
+#define BLOOM_PROBES 4
+// bigger files, and files with more distinct trigrams, get an entry without a filter and are always
+// searched
+#define BLOOM_MAX_FILE_SIZE (16 << 20)
+#define BLOOM_MAX_TRIGRAMS (1 << 18)
+
+// The cache file is a header, the entries sorted by path, the paths and the filters as 64 bit words,
+// laid out so it can be mapped and used in place like a segment of the index.
+struct BloomCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t entry_count;
+  uint64_t path_bytes;
+  uint64_t filter_words;
+};
+
+// filter_offset counts words from the first filter on, a file without a filter has no words
+struct BloomCacheEntry {
+  uint64_t path_offset;
+  uint32_t path_length;
+  uint32_t word_count;
+  int64_t mtime;
+  uint64_t size;
+  uint64_t filter_offset;
+};
+
+// A Bloom filter of the trigrams of every file a search scanned, by path, for trees without an index.
+// A file whose filter lacks a trigram of every identifier the query needs can't have a matching line
+// and is skipped without being opened. The filter of a file is only trusted while its mtime and size
+// are what they were when it was built; a file that changed is scanned and gets a new filter, which
+// is written out with the others when the search is done.
+class BloomCache {
+public:
+  // a missing or damaged cache file is an empty cache
+  void open(const std::string& path);
+
+  // whether the entry of the file is up to date
+  bool fresh(const std::string& path, int64_t mtime, uint64_t size) const;
+  // false only if the file as it was when its filter was built can't have a line that matches
+  bool may_match(const std::string& path, int64_t mtime, uint64_t size, const Query& query) const;
+  // builds the filter of a file that was scanned because its entry was missing or stale
+  void update(const std::string& path, int64_t mtime, uint64_t size, std::string_view contents);
+  // records a file without a filter, one that is searched whatever the query, like a binary file
+  void update_unfiltered(const std::string& path, int64_t mtime, uint64_t size);
+  // writes the cache with the updated entries, if there are any
+  bool save() const;
+
+private:
+  struct Record {
+    int64_t mtime;
+    uint64_t size;
+    std::vector<uint64_t> words;
+  };
+
+  const BloomCacheEntry* find(std::string_view path) const;
+  std::string_view entry_path(const BloomCacheEntry& entry) const { return std::string_view(paths + entry.path_offset, entry.path_length); }
+  bool may_match_node(const uint64_t* words, uint32_t word_count, const Query& query, uint32_t index) const;
+
+  std::string path;
+  MappedFile mapped;
+  const BloomCacheEntry* entries = nullptr;
+  size_t entry_count             = 0;
+  const char* paths              = nullptr;
+  const uint64_t* filters        = nullptr;
+
+  std::mutex lock;
+  std::map<std::string, Record> updated;
+};
+
+// the bits a trigram sets in a filter of word_count words, a power of two
+template <typename Visit>
+void bloom_bits(uint32_t trigram, uint32_t word_count, Visit visit) {
+  uint64_t hash = (trigram + 1) * 0x9e3779b97f4a7c15ull;
+  uint64_t step = (hash >> 32) | 1;
+  uint64_t mask = (uint64_t)word_count * 64 - 1;
+  for (int i = 0; i < BLOOM_PROBES; i++) {
+    visit(hash & mask);
+    hash += step;
+  }
+}
+
+void BloomCache::open(const std::string& cache_path) {
+  path = cache_path;
+  if (!mapped.open(path.c_str())) return;
+
+  std::string_view contents = mapped.view();
+  if (contents.size() < sizeof(BloomCacheHeader)) return;
+  const BloomCacheHeader* header = reinterpret_cast<const BloomCacheHeader*>(contents.data());
+  if (std::memcmp(header->magic, BLOOM_CACHE_MAGIC, sizeof(header->magic)) != 0 || header->version != BLOOM_CACHE_VERSION) return;
+
+  if (header->entry_count > contents.size() / sizeof(BloomCacheEntry) || header->path_bytes > contents.size()) return;
+  uint64_t path_start   = sizeof(BloomCacheHeader) + header->entry_count * sizeof(BloomCacheEntry);
+  uint64_t filter_start = (path_start + header->path_bytes + 7) & ~(uint64_t)7;
+  if (filter_start > contents.size() || header->filter_words > (contents.size() - filter_start) / sizeof(uint64_t)) return;
+
+  const BloomCacheEntry* table = reinterpret_cast<const BloomCacheEntry*>(header + 1);
+  for (uint64_t i = 0; i < header->entry_count; i++) {
+    if (table[i].path_offset + table[i].path_length > header->path_bytes || table[i].filter_offset + table[i].word_count > header->filter_words) return;
+  }
+  entries     = table;
+  entry_count = header->entry_count;
+  paths       = contents.data() + path_start;
+  filters     = reinterpret_cast<const uint64_t*>(contents.data() + filter_start);
+}
+
+const BloomCacheEntry* BloomCache::find(std::string_view file_path) const {
+  const BloomCacheEntry* end = entries + entry_count;
+  const BloomCacheEntry* it  = std::lower_bound(entries, end, file_path, [this](const BloomCacheEntry& entry, std::string_view value) { return entry_path(entry) < value; });
+  return it != end && entry_path(*it) == file_path ? it : nullptr;
+}
+
+bool BloomCache::fresh(const std::string& file_path, int64_t mtime, uint64_t size) const {
+  const BloomCacheEntry* entry = find(file_path);
+  return entry && entry->mtime == mtime && entry->size == size;
+}
+
+bool BloomCache::may_match(const std::string& file_path, int64_t mtime, uint64_t size, const Query& query) const {
+  const BloomCacheEntry* entry = find(file_path);
+  if (!entry || entry->mtime != mtime || entry->size != size || entry->word_count == 0) return true;
+  return may_match_node(filters + entry->filter_offset, entry->word_count, query, query.get_root());
+}
+
+// Like candidate_files of the index: a line can only contain an identifier if the file has every
+// trigram of it, identifiers shorter than three bytes and anything under a "not" rule nothing out.
+bool BloomCache::may_match_node(const uint64_t* words, uint32_t word_count, const Query& query, uint32_t index) const {
+  const QueryNode& node = query.get_nodes()[index];
+  switch (node.op) {
+    case QueryOp::ID: {
+      const std::string& id = query.get_ids()[node.left];
+      for (size_t i = 0; i + 2 < id.size(); i++) {
+        bool present = true;
+        bloom_bits(make_trigram(id.data() + i), word_count, [&](uint64_t bit) { present &= (words[bit / 64] >> (bit % 64)) & 1; });
+        if (!present) return false;
+      }
+      return true;
+    }
+    case QueryOp::NOT:
+      return true;
+    case QueryOp::AND:
+      return may_match_node(words, word_count, query, node.left) && may_match_node(words, word_count, query, node.right);
+    case QueryOp::OR:
+      return may_match_node(words, word_count, query, node.left) || may_match_node(words, word_count, query, node.right);
+  }
+  return true;
+}
+
+// trigrams across a newline are left out like in the index, no identifier has one
+void BloomCache::update(const std::string& file_path, int64_t mtime, uint64_t size, std::string_view contents) {
+  std::vector<uint32_t> trigrams;
+  for (size_t i = 0; i + 2 < contents.size() && contents.size() <= BLOOM_MAX_FILE_SIZE; i++) {
+    if (contents[i] == '\n' || contents[i + 1] == '\n' || contents[i + 2] == '\n') continue;
+    trigrams.push_back(make_trigram(contents.data() + i));
+  }
+  std::sort(trigrams.begin(), trigrams.end());
+  trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+  Record record{mtime, size, {}};
+  if (contents.size() <= BLOOM_MAX_FILE_SIZE && trigrams.size() <= BLOOM_MAX_TRIGRAMS) {
+    uint32_t word_count = 1;
+    while ((uint64_t)word_count * 64 < trigrams.size() * BLOOM_BITS_PER_TRIGRAM) word_count *= 2;
+    record.words.assign(word_count, 0);
+    for (uint32_t trigram : trigrams) {
+      bloom_bits(trigram, word_count, [&record](uint64_t bit) { record.words[bit / 64] |= (uint64_t)1 << (bit % 64); });
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  updated[file_path] = std::move(record);
+}
+
+void BloomCache::update_unfiltered(const std::string& file_path, int64_t mtime, uint64_t size) {
+  std::lock_guard<std::mutex> guard(lock);
+  updated[file_path] = Record{mtime, size, {}};
+}
+
+// The entries that weren't updated are carried over from the old file. It is written to a temporary
+// file and renamed, a search reading the cache meanwhile keeps the old one.
+bool BloomCache::save() const {
+  if (updated.empty()) return true;
+
+  std::vector<BloomCacheEntry> out_entries;
+  std::string path_text;
+  std::vector<uint64_t> words;
+  auto add = [&](std::string_view file_path, int64_t mtime, uint64_t size, const uint64_t* filter, uint32_t word_count) {
+    out_entries.push_back({path_text.size(), (uint32_t)file_path.size(), word_count, mtime, size, words.size()});
+    path_text.append(file_path);
+    words.insert(words.end(), filter, filter + word_count);
+  };
+
+  // both are sorted by path, an updated record replaces the old entry of its path
+  size_t i = 0;
+  auto it  = updated.begin();
+  while (i < entry_count || it != updated.end()) {
+    if (it != updated.end() && (i == entry_count || it->first <= entry_path(entries[i]))) {
+      if (i < entry_count && it->first == entry_path(entries[i])) i++;
+      add(it->first, it->second.mtime, it->second.size, it->second.words.data(), it->second.words.size());
+      ++it;
+    } else {
+      add(entry_path(entries[i]), entries[i].mtime, entries[i].size, filters + entries[i].filter_offset, entries[i].word_count);
+      i++;
+    }
+  }
+
+  BloomCacheHeader header{};
+  std::memcpy(header.magic, BLOOM_CACHE_MAGIC, sizeof(header.magic));
+  header.version      = BLOOM_CACHE_VERSION;
+  header.entry_count  = out_entries.size();
+  header.path_bytes   = path_text.size();
+  header.filter_words = words.size();
+
+  std::string temporary = path + ".tmp";
+  std::ofstream stream(temporary, std::ios::binary | std::ios::trunc);
+  if (!stream) return false;
+  stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  stream.write(reinterpret_cast<const char*>(out_entries.data()), out_entries.size() * sizeof(BloomCacheEntry));
+  stream.write(path_text.data(), path_text.size());
+  static const char zeros[8] = {};
+  stream.write(zeros, (8 - path_text.size() % 8) % 8);
+  stream.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(uint64_t));
+
+  stream.close();
+  if (!stream || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef _CHUNKS_H_
+#define _CHUNKS_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Splits contents into pieces of about chunk_size bytes that end right after a newline, so no line is
+// shared between two chunks. A line longer than chunk_size ends up in a single bigger chunk.
+std::vector<std::string_view> split_chunks(std::string_view contents, size_t chunk_size) {
+  std::vector<std::string_view> chunks;
+  while (!contents.empty()) {
+    size_t end = contents.size();
+    if (end > chunk_size) {
+      size_t newline = contents.find('\n', chunk_size - 1);
+      if (newline != std::string_view::npos) end = newline + 1;
+    }
+    chunks.push_back(contents.substr(0, end));
+    contents.remove_prefix(end);
+  }
+  return chunks;
+}
+
+// Coordinates the chunks of one file that are searched by several threads.
+//
+// Line numbers: every chunk counts its own newlines in parallel, then learns its first line number
+// from the running sum of the chunks before it. Only that addition is serialized, and a chunk is read
+// right before it is searched, so it is still cached when the search starts.
+//
+// Output: a chunk only writes once every chunk before it has written everything, which keeps the
+// output of the file in order.
+class ChunkOrder {
+public:
+  ChunkOrder(size_t count) : first_lines(count + 1, 0) { first_lines[0] = 1; }
+
+  // publishes the number of newlines in chunk index and returns the number of its first line
+  size_t first_line(size_t index, size_t newlines);
+  // blocks until every chunk before index finished writing
+  void wait_turn(size_t index);
+  // marks chunk index as fully written
+  void finish(size_t index);
+
+private:
+  std::mutex lock;
+  std::condition_variable changed;
+  // first_lines[i] is known once published > i
+  std::vector<size_t> first_lines;
+  size_t published = 1;
+  size_t finished  = 0;
+};
+
+size_t ChunkOrder::first_line(size_t index, size_t newlines) {
+  std::unique_lock<std::mutex> guard(lock);
+  changed.wait(guard, [&] { return published > index; });
+
+  first_lines[index + 1] = first_lines[index] + newlines;
+  published              = index + 2;
+  changed.notify_all();
+  return first_lines[index];
+}
+
+void ChunkOrder::wait_turn(size_t index) {
+  std::unique_lock<std::mutex> guard(lock);
+  changed.wait(guard, [&] { return finished >= index; });
+}
+
+void ChunkOrder::finish(size_t index) {
+  std::lock_guard<std::mutex> guard(lock);
+  finished = index + 1;
+  changed.notify_all();
+}
+
+// Threads that help the search threads with the chunks of big files, started once for the whole
+// search. A task is only handed to a helper that is idle right now, so a search thread never waits
+// for a helper that is busy with the chunks of another file; it searches the chunks no helper took
+// itself. However many big files there are, no more than the search threads and the helpers run.
+class ChunkPool {
+public:
+  ChunkPool(size_t threads);
+  ~ChunkPool();
+
+  // runs task on an idle helper, false if there is none
+  bool try_run(std::function<void()> task);
+
+private:
+  void help();
+
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<std::function<void()>> tasks;
+  // helpers waiting for a task, every queued task has one of them
+  size_t idle   = 0;
+  bool stopping = false;
+  std::vector<std::thread> helpers;
+};
+
+ChunkPool::ChunkPool(size_t threads) {
+  for (size_t i = 0; i < threads; i++) {
+    helpers.emplace_back(&ChunkPool::help, this);
+  }
+}
+
+ChunkPool::~ChunkPool() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  changed.notify_all();
+  for (std::thread& helper : helpers) {
+    helper.join();
+  }
+}
+
+bool ChunkPool::try_run(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (tasks.size() >= idle) return false;
+    tasks.push_back(std::move(task));
+  }
+  changed.notify_one();
+  return true;
+}
+
+void ChunkPool::help() {
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    idle++;
+    changed.wait(guard, [this] { return stopping || !tasks.empty(); });
+    idle--;
+    if (tasks.empty()) return;
+
+    std::function<void()> task = std::move(tasks.front());
+    tasks.pop_front();
+    guard.unlock();
+    task();
+    guard.lock();
+  }
+}
+
+#endif
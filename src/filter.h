@@ -0,0 +1,298 @@
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// the automaton stops growing at this many states, names are then matched by simulating the globs
+#define FILTER_MAX_STATES 4096
+
+// globs of the file types --type knows
+struct FileType {
+  const char* name;
+  std::vector<const char*> globs;
+};
+
+const std::vector<FileType> FILE_TYPES = {
+  {"c", {"*.c", "*.h"}},
+  {"cpp", {"*.cpp", "*.cc", "*.cxx", "*.c++", "*.hpp", "*.hh", "*.hxx", "*.h++", "*.h", "*.inl"}},
+  {"cmake", {"CMakeLists.txt", "*.cmake"}},
+  {"go", {"*.go"}},
+  {"java", {"*.java"}},
+  {"js", {"*.js", "*.mjs", "*.cjs", "*.jsx"}},
+  {"json", {"*.json"}},
+  {"log", {"*.log"}},
+  {"make", {"Makefile", "makefile", "GNUmakefile", "*.mk"}},
+  {"md", {"*.md", "*.markdown"}},
+  {"py", {"*.py", "*.pyi"}},
+  {"rust", {"*.rs"}},
+  {"sh", {"*.sh", "*.bash", "*.zsh"}},
+  {"ts", {"*.ts", "*.tsx"}},
+  {"txt", {"*.txt"}},
+  {"xml", {"*.xml"}},
+  {"yaml", {"*.yaml", "*.yml"}},
+};
+
+// Decides from the name alone whether a file of a recursive walk is searched: it has to match one of
+// the include globs, if there are any, and none of the exclude globs.
+//
+// All globs are compiled into a single DFA over byte classes, so a name is matched in one pass no
+// matter how many globs there are. Globs use the same syntax as ignore files: "*", "?", "[...]" and
+// "\" escapes; they are matched against the name only, so "*" and "**" are the same.
+class NameFilter {
+public:
+  enum : uint8_t {
+    INCLUDE = 1,
+    EXCLUDE = 2,
+  };
+
+  void add(std::string_view glob, uint8_t flag);
+  // adds the globs of a --type, false if there is no such type
+  bool add_type(std::string_view type);
+  // builds the automaton, called once after everything was added and before accepts
+  void compile();
+
+  bool empty() const { return globs.empty(); }
+  bool accepts(std::string_view name) const;
+
+private:
+  // one step of a glob: a byte from `bytes`, or any number of bytes for a star
+  struct Element {
+    std::bitset<256> bytes;
+    bool star;
+  };
+
+  struct Glob {
+    std::vector<Element> elements;
+    uint8_t flag;
+  };
+
+  // NFA state sets are bit sets over the positions of all globs: every element has a position and
+  // every glob one more behind its last element that means it matched
+  using Bits = std::vector<uint64_t>;
+
+  Bits step(const Bits& states, uint8_t byte_class) const;
+  void closure(Bits& states) const;
+  uint8_t flags(const Bits& states) const;
+  bool decide(uint8_t matched) const;
+
+  std::vector<Glob> globs;
+  uint8_t seen = 0;
+
+  // byte -> byte class, bytes of a class behave the same in every glob
+  std::array<uint8_t, 256> classes{};
+  size_t class_count = 0;
+  // positions of elements that accept a byte of the class, one set per class
+  std::vector<Bits> class_masks;
+  Bits star_mask;
+  // end positions of the include and exclude globs
+  Bits include_mask;
+  Bits exclude_mask;
+  Bits start;
+
+  // transitions[state * class_count + class], the state 0 is the dead state
+  std::vector<uint32_t> transitions;
+  std::vector<uint8_t> accepting;
+};
+
+void NameFilter::add(std::string_view glob, uint8_t flag) {
+  Glob compiled_glob;
+  compiled_glob.flag = flag;
+
+  for (size_t i = 0; i < glob.size(); i++) {
+    Element element{{}, false};
+    char c = glob[i];
+
+    if (c == '*') {
+      while (i + 1 < glob.size() && glob[i + 1] == '*') i++;
+      element.star = true;
+    } else if (c == '?') {
+      element.bytes.set();
+    } else if (c == '[') {
+      size_t j     = i + 1;
+      bool negated = j < glob.size() && (glob[j] == '!' || glob[j] == '^');
+      if (negated) j++;
+
+      bool first = true;
+      while (j < glob.size() && (first || glob[j] != ']')) {
+        unsigned char low  = glob[j];
+        unsigned char high = low;
+        if (j + 2 < glob.size() && glob[j + 1] == '-' && glob[j + 2] != ']') {
+          high = glob[j + 2];
+          j += 2;
+        }
+        for (unsigned b = low; b <= high; b++) element.bytes.set(b);
+        first = false;
+        j++;
+      }
+      if (j == glob.size()) {
+        // an unterminated class is taken literally
+        element.bytes.reset();
+        element.bytes.set('[');
+      } else {
+        if (negated) element.bytes.flip();
+        i = j;
+      }
+    } else {
+      if (c == '\\' && i + 1 < glob.size()) c = glob[++i];
+      element.bytes.set((unsigned char)c);
+    }
+    compiled_glob.elements.push_back(element);
+  }
+
+  seen |= flag;
+  globs.push_back(std::move(compiled_glob));
+}
+
+bool NameFilter::add_type(std::string_view type) {
+  for (const FileType& file_type : FILE_TYPES) {
+    if (type != file_type.name) continue;
+    for (const char* glob : file_type.globs) {
+      add(glob, INCLUDE);
+    }
+    return true;
+  }
+  return false;
+}
+
+// a star may match nothing, so the position after it is reachable as soon as the star is
+void NameFilter::closure(Bits& states) const {
+  uint64_t carry = 0;
+  for (size_t i = 0; i < states.size(); i++) {
+    uint64_t stars = states[i] & star_mask[i];
+    uint64_t next  = stars >> 63;
+    states[i] |= (stars << 1) | carry;
+    carry = next;
+  }
+}
+
+NameFilter::Bits NameFilter::step(const Bits& states, uint8_t byte_class) const {
+  const Bits& mask = class_masks[byte_class];
+  Bits next(states.size());
+
+  // Shift-And: positions whose element accepts the byte move one ahead, stars stay where they are
+  uint64_t carry = 0;
+  for (size_t i = 0; i < states.size(); i++) {
+    uint64_t moved = states[i] & mask[i];
+    next[i]        = (moved << 1) | carry | (states[i] & star_mask[i]);
+    carry          = moved >> 63;
+  }
+  closure(next);
+  return next;
+}
+
+uint8_t NameFilter::flags(const Bits& states) const {
+  uint8_t matched = 0;
+  for (size_t i = 0; i < states.size(); i++) {
+    if (states[i] & include_mask[i]) matched |= INCLUDE;
+    if (states[i] & exclude_mask[i]) matched |= EXCLUDE;
+  }
+  return matched;
+}
+
+bool NameFilter::decide(uint8_t matched) const {
+  if (matched & EXCLUDE) return false;
+  return !(seen & INCLUDE) || (matched & INCLUDE);
+}
+
+void NameFilter::compile() {
+  size_t positions = 0;
+  for (const Glob& glob : globs) {
+    positions += glob.elements.size() + 1;
+  }
+  size_t words = (positions + 63) / 64;
+
+  // bytes that every element treats alike share a class, which keeps the transition table small
+  std::map<std::vector<bool>, uint8_t> signatures;
+  for (unsigned b = 0; b < 256; b++) {
+    std::vector<bool> signature;
+    for (const Glob& glob : globs) {
+      for (const Element& element : glob.elements) {
+        if (!element.star) signature.push_back(element.bytes.test(b));
+      }
+    }
+    auto it    = signatures.emplace(std::move(signature), signatures.size()).first;
+    classes[b] = it->second;
+  }
+  class_count = signatures.size();
+
+  class_masks.assign(class_count, Bits(words));
+  star_mask.assign(words, 0);
+  include_mask.assign(words, 0);
+  exclude_mask.assign(words, 0);
+  start.assign(words, 0);
+
+  size_t position = 0;
+  for (const Glob& glob : globs) {
+    start[position / 64] |= 1ull << (position % 64);
+    for (const Element& element : glob.elements) {
+      uint64_t bit = 1ull << (position % 64);
+      if (element.star) {
+        star_mask[position / 64] |= bit;
+      } else {
+        for (unsigned b = 0; b < 256; b++) {
+          if (element.bytes.test(b)) class_masks[classes[b]][position / 64] |= bit;
+        }
+      }
+      position++;
+    }
+    (glob.flag == INCLUDE ? include_mask : exclude_mask)[position / 64] |= 1ull << (position % 64);
+    position++;
+  }
+  closure(start);
+
+  // subset construction, state 0 is the dead state and state 1 the start
+  std::map<Bits, uint32_t> ids;
+  std::vector<Bits> sets{Bits(words), start};
+  ids.emplace(start, 1);
+  accepting   = {0, flags(start)};
+  transitions.assign(2 * class_count, 0);
+
+  for (uint32_t id = 1; id < sets.size(); id++) {
+    for (size_t c = 0; c < class_count; c++) {
+      Bits next = step(sets[id], c);
+      if (std::all_of(next.begin(), next.end(), [](uint64_t word) { return word == 0; })) continue;
+
+      auto it = ids.find(next);
+      if (it == ids.end()) {
+        if (sets.size() == FILTER_MAX_STATES) {
+          // too big, accepts runs the bit parallel NFA instead
+          transitions.clear();
+          return;
+        }
+        it = ids.emplace(next, sets.size()).first;
+        accepting.push_back(flags(next));
+        sets.push_back(std::move(next));
+        transitions.resize(sets.size() * class_count, 0);
+      }
+      transitions[id * class_count + c] = it->second;
+    }
+  }
+}
+
+bool NameFilter::accepts(std::string_view name) const {
+  if (globs.empty()) return true;
+
+  if (transitions.empty()) {
+    Bits states = start;
+    for (unsigned char byte : name) {
+      states = step(states, classes[byte]);
+    }
+    return decide(flags(states));
+  }
+
+  uint32_t state = 1;
+  for (unsigned char byte : name) {
+    state = transitions[state * class_count + classes[byte]];
+    if (state == 0) break;
+  }
+  return decide(accepting[state]);
+}
+
+#endif
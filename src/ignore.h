@@ -0,0 +1,260 @@
+#ifndef _IGNORE_H_
+#define _IGNORE_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// ignore files are read in this order, patterns of a later one win over an earlier one
+#define IGNORE_FILE_NAMES {".gitignore", ".ignore"}
+
+// Matches text against a gitignore glob: "*" and "?" don't match "/", "**" matches any number of
+// path components, "[...]" is a character class and "\" escapes the next character.
+bool glob_match(std::string_view pattern, std::string_view text);
+
+// one line of an ignore file
+struct IgnoreRule {
+  enum class Kind : uint8_t {
+    // the whole glob is a plain name or path
+    LITERAL,
+    // "*" followed by plain text, like "*.o"
+    SUFFIX,
+    GLOB,
+  };
+
+  // the pattern without "!", the leading "/" and the trailing "/"
+  std::string glob;
+  Kind kind;
+  // "!pattern" re-includes what an earlier pattern excluded
+  bool negate;
+  // "pattern/" only matches directories
+  bool directory_only;
+  // patterns with a "/" match the path relative to the ignore file, others only the name
+  bool anchored;
+};
+
+// The rules of the ignore files of one directory, linked to the rules of its parent. Subdirectories
+// share the list of the closest directory that has ignore files, so rules are parsed once per file
+// and inherited for free.
+//
+// Each level is compiled for lookups: plain names and anchored paths go into hash maps, "*.ext"
+// style patterns are suffix compares, only the rest goes through glob_match. Like git, the last
+// matching rule of the deepest level that has one decides.
+class IgnoreList {
+public:
+  // the rules of the directory open as dir_fd, or parent itself if it has no ignore files
+  static std::shared_ptr<const IgnoreList> load(int dir_fd, const std::string& dir_path, std::shared_ptr<const IgnoreList> parent);
+
+  // path is the printed path of an entry below the directory of this list, name its last component
+  bool ignored(std::string_view path, std::string_view name, bool directory) const;
+
+private:
+  enum class Verdict {
+    NONE,
+    IGNORE,
+    KEEP,
+  };
+
+  void add_line(std::string_view line);
+  Verdict match(std::string_view relative, std::string_view name, bool directory) const;
+
+  std::shared_ptr<const IgnoreList> parent;
+  // path.substr(base_length) is relative to the directory of this list
+  size_t base_length = 0;
+  std::vector<IgnoreRule> rules;
+  // rule indexes of literal rules, by name for unanchored ones and by relative path for anchored ones
+  std::unordered_map<std::string, std::vector<uint32_t>> names;
+  std::unordered_map<std::string, std::vector<uint32_t>> paths;
+  std::vector<uint32_t> suffixes;
+  std::vector<uint32_t> globs;
+};
+
+bool glob_match(std::string_view pattern, std::string_view text) {
+  size_t pi = 0;
+  size_t ti = 0;
+  while (pi < pattern.size()) {
+    char c = pattern[pi];
+
+    if (c == '*') {
+      if (pi + 1 < pattern.size() && pattern[pi + 1] == '*') {
+        std::string_view rest = pattern.substr(pi + 2);
+        // "**/" also matches no directory at all
+        if (!rest.empty() && rest[0] == '/' && glob_match(rest.substr(1), text.substr(ti))) return true;
+        for (size_t k = ti; k <= text.size(); k++) {
+          if (glob_match(rest, text.substr(k))) return true;
+        }
+        return false;
+      }
+
+      std::string_view rest = pattern.substr(pi + 1);
+      for (size_t k = ti;; k++) {
+        if (glob_match(rest, text.substr(k))) return true;
+        if (k == text.size() || text[k] == '/') return false;
+      }
+    }
+
+    if (ti == text.size()) return false;
+    char t = text[ti];
+
+    if (c == '?') {
+      if (t == '/') return false;
+    } else if (c == '[') {
+      size_t i     = pi + 1;
+      bool negated = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+      if (negated) i++;
+
+      bool matched = false;
+      bool first   = true;
+      while (i < pattern.size() && (first || pattern[i] != ']')) {
+        char low  = pattern[i];
+        char high = low;
+        if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+          high = pattern[i + 2];
+          i += 2;
+        }
+        if (t >= low && t <= high) matched = true;
+        first = false;
+        i++;
+      }
+      // an unterminated class is taken literally
+      if (i == pattern.size()) {
+        if (t != '[') return false;
+      } else {
+        if (matched == negated || t == '/') return false;
+        pi = i;
+      }
+    } else {
+      if (c == '\\' && pi + 1 < pattern.size()) c = pattern[++pi];
+      if (c != t) return false;
+    }
+
+    pi++;
+    ti++;
+  }
+  return ti == text.size();
+}
+
+std::shared_ptr<const IgnoreList> IgnoreList::load(int dir_fd, const std::string& dir_path, std::shared_ptr<const IgnoreList> parent) {
+  std::shared_ptr<IgnoreList> list;
+
+  for (const char* file_name : IGNORE_FILE_NAMES) {
+    int fd = openat(dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) continue;
+
+    std::string contents;
+    char block[1 << 12];
+    while (true) {
+      ssize_t n = read(fd, block, sizeof(block));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      contents.append(block, n);
+    }
+    close(fd);
+
+    if (!list) {
+      list              = std::make_shared<IgnoreList>();
+      list->parent      = parent;
+      list->base_length = dir_path.size() + (dir_path.empty() || dir_path.back() == '/' ? 0 : 1);
+    }
+
+    std::string_view rest = contents;
+    while (!rest.empty()) {
+      size_t end = rest.find('\n');
+      list->add_line(rest.substr(0, end));
+      rest.remove_prefix(end == std::string_view::npos ? rest.size() : end + 1);
+    }
+  }
+
+  if (!list || list->rules.empty()) return parent;
+  return list;
+}
+
+void IgnoreList::add_line(std::string_view line) {
+  if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+  // trailing spaces are ignored unless escaped
+  while (!line.empty() && line.back() == ' ' && !(line.size() > 1 && line[line.size() - 2] == '\\')) {
+    line.remove_suffix(1);
+  }
+  if (line.empty() || line[0] == '#') return;
+
+  IgnoreRule rule;
+  rule.negate = line[0] == '!';
+  if (rule.negate) line.remove_prefix(1);
+  // "\!" and "\#" start patterns that begin with those characters
+  if (line.size() > 1 && line[0] == '\\' && (line[1] == '!' || line[1] == '#')) line.remove_prefix(1);
+
+  rule.directory_only = !line.empty() && line.back() == '/';
+  while (!line.empty() && line.back() == '/') line.remove_suffix(1);
+
+  rule.anchored = line.find('/') != std::string_view::npos;
+  if (!line.empty() && line[0] == '/') line.remove_prefix(1);
+  if (line.empty()) return;
+
+  rule.glob = std::string(line);
+  if (rule.glob.find_first_of("*?[\\") == std::string::npos) {
+    rule.kind = IgnoreRule::Kind::LITERAL;
+  } else if (!rule.anchored && rule.glob[0] == '*' && rule.glob.find_first_of("*?[\\", 1) == std::string::npos) {
+    rule.kind = IgnoreRule::Kind::SUFFIX;
+    rule.glob.erase(0, 1);
+  } else {
+    rule.kind = IgnoreRule::Kind::GLOB;
+  }
+
+  uint32_t index = rules.size();
+  if (rule.kind == IgnoreRule::Kind::LITERAL) {
+    (rule.anchored ? paths : names)[rule.glob].push_back(index);
+  } else if (rule.kind == IgnoreRule::Kind::SUFFIX) {
+    suffixes.push_back(index);
+  } else {
+    globs.push_back(index);
+  }
+  rules.push_back(std::move(rule));
+}
+
+bool IgnoreList::ignored(std::string_view path, std::string_view name, bool directory) const {
+  for (const IgnoreList* list = this; list; list = list->parent.get()) {
+    Verdict verdict = list->match(path.substr(std::min(list->base_length, path.size())), name, directory);
+    if (verdict != Verdict::NONE) return verdict == Verdict::IGNORE;
+  }
+  return false;
+}
+
+IgnoreList::Verdict IgnoreList::match(std::string_view relative, std::string_view name, bool directory) const {
+  // the highest matching index is the rule that was written last
+  int64_t best = -1;
+  auto consider = [&](uint32_t index, bool matches) {
+    const IgnoreRule& rule = rules[index];
+    if ((int64_t)index > best && (directory || !rule.directory_only) && matches) best = index;
+  };
+
+  auto literal = [&](const std::unordered_map<std::string, std::vector<uint32_t>>& map, std::string_view key) {
+    if (map.empty()) return;
+    auto it = map.find(std::string(key));
+    if (it == map.end()) return;
+    for (uint32_t index : it->second) consider(index, true);
+  };
+  literal(names, name);
+  literal(paths, relative);
+
+  for (uint32_t index : suffixes) {
+    const std::string& suffix = rules[index].glob;
+    consider(index, name.size() >= suffix.size() && name.substr(name.size() - suffix.size()) == suffix);
+  }
+  for (uint32_t index : globs) {
+    if ((int64_t)index <= best) continue;
+    consider(index, glob_match(rules[index].glob, rules[index].anchored ? relative : name));
+  }
+
+  if (best < 0) return Verdict::NONE;
+  return rules[best].negate ? Verdict::KEEP : Verdict::IGNORE;
+}
+
+#endif
@@ -0,0 +1,1197 @@
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sys/file.h>
+
+#include "mapped_file.h"
+#include "postings.h"
+#include "throttle.h"
+
+// the index of a directory lives in this directory inside of it
+#define INDEX_DIRECTORY ".bool-search-index"
+// lists the segment files that make up the index, one name per line, replaced atomically
+#define INDEX_CURRENT "CURRENT"
+#define INDEX_MAGIC "BSINDEX"
+#define INDEX_VERSION 3
+// longer words are not put into the dictionary, the lines they are on are always verified instead
+#define INDEX_MAX_TERM_LENGTH 128
+// held by whoever rewrites CURRENT, and by a running compaction
+#define INDEX_LOCK "LOCK"
+#define INDEX_COMPACT_LOCK "COMPACT"
+// segments of up to this many bytes are on the lowest level of the merge policy, every level above
+// holds segments INDEX_MERGE_FACTOR times bigger, and that many segments of a level are merged
+#define INDEX_MERGE_UNIT (1 << 20)
+#define INDEX_MERGE_FACTOR 4
+// how often a reader tries again when a compaction deleted a segment between reading CURRENT and
+// opening it
+#define INDEX_OPEN_ATTEMPTS 5
+// what an entry of a builder's hash maps costs besides its key and list, roughly
+#define INDEX_BUILDER_ENTRY_BYTES 64
+
+enum class IndexStatus {
+  OK,
+  MISSING,
+  BAD_FORMAT,
+  // a segment ran out of 32 bit line ids
+  TOO_BIG,
+  IO_ERROR,
+};
+
+// Words are the maximal runs of letters, digits, "_" and bytes outside of ASCII, so UTF-8 text
+// stays in one piece. Everything else separates words and is not indexed.
+bool is_word_byte(unsigned char c) {
+  return std::isalnum(c) || c == '_' || c >= 0x80;
+}
+
+// A segment file is a header, a table of sections and the sections themselves, every one of them
+// 8 byte aligned so the file can be mapped and used in place. Numbers are in the byte order of the
+// machine that wrote it. Readers skip sections they don't know, which leaves room to add some
+// without a new version.
+enum class IndexSectionKind : uint32_t {
+  // IndexFileEntry for every file, in line id order
+  FILES = 1,
+  // the paths of the files, relative to the indexed directory
+  PATHS,
+  // IndexTermEntry for every word, sorted by its text
+  TERMS,
+  TERM_TEXT,
+  // the line ids of every term as encoded posting lists, back to back
+  POSTINGS,
+  // sorted uint32_t ids of lines with a word longer than INDEX_MAX_TERM_LENGTH
+  LONG_WORDS,
+  // IndexTrigramEntry for every three byte sequence, sorted by trigram
+  TRIGRAMS,
+  // the indexes of the files every trigram occurs in as encoded posting lists, back to back
+  TRIGRAM_FILES,
+  // IndexPathEntry for every file this segment deletes from the segments before it, in path order
+  REMOVED,
+  // IndexPathEntry for every file that was touched without changing since the segments before it,
+  // with the new mtime, in path order
+  RETIMED,
+  // IndexTrigramEntry for every three byte sequence of the terms, sorted by trigram, with the count
+  // and offset of a list of term indexes instead of files
+  TERM_TRIGRAMS,
+  // the indexes of the terms every trigram occurs in as encoded posting lists, back to back
+  TERM_TRIGRAM_TERMS,
+};
+
+struct IndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t section_count;
+  uint64_t file_count;
+  uint64_t line_count;
+  uint64_t term_count;
+};
+
+struct IndexSection {
+  uint32_t kind;
+  uint32_t reserved;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Lines of all files of a segment are numbered one after the other, the lines of a file have the
+// ids first_line to first_line + line_count - 1. mtime and size tell whether the file changed since,
+// the hash of its contents whether it really did.
+struct IndexFileEntry {
+  uint64_t path_offset;
+  uint32_t path_length;
+  uint32_t line_count;
+  uint64_t first_line;
+  int64_t mtime;
+  uint64_t size;
+  uint64_t hash;
+};
+
+// a path in the paths section, and the new mtime for RETIMED
+struct IndexPathEntry {
+  uint64_t path_offset;
+  uint32_t path_length;
+  uint32_t reserved;
+  int64_t mtime;
+};
+
+// posting_offset is where the list starts in the postings section, in bytes
+struct IndexTermEntry {
+  uint64_t text_offset;
+  uint32_t text_length;
+  uint32_t posting_count;
+  uint64_t posting_offset;
+};
+
+// the three bytes of a trigram are packed into the low 24 bits, first byte highest; file_offset is
+// in bytes like posting_offset
+struct IndexTrigramEntry {
+  uint32_t trigram;
+  uint32_t file_count;
+  uint64_t file_offset;
+};
+
+uint32_t make_trigram(const char* bytes) {
+  return (uint32_t)(unsigned char)bytes[0] << 16 | (uint32_t)(unsigned char)bytes[1] << 8 | (unsigned char)bytes[2];
+}
+
+// Appends index to the list of every trigram of the term. Terms have to come in index order, so
+// the lists stay sorted.
+void add_term_trigrams(std::string_view term, uint32_t index, std::unordered_map<uint32_t, std::vector<uint32_t>>& lists) {
+  for (size_t i = 0; i + 2 < term.size(); i++) {
+    std::vector<uint32_t>& ids = lists[make_trigram(term.data() + i)];
+    if (ids.empty() || ids.back() != index) ids.push_back(index);
+  }
+}
+
+// the entries of the lists of trigrams sorted by trigram, and the lists encoded back to back in that
+// order
+void encode_trigram_lists(const std::unordered_map<uint32_t, std::vector<uint32_t>>& lists, std::vector<IndexTrigramEntry>* entries, std::string* data) {
+  for (const auto& [trigram, ids] : lists) {
+    entries->push_back({trigram, (uint32_t)ids.size(), 0});
+  }
+  std::sort(entries->begin(), entries->end(), [](const auto& a, const auto& b) { return a.trigram < b.trigram; });
+  for (IndexTrigramEntry& entry : *entries) {
+    entry.file_offset = data->size();
+    encode_postings(lists.at(entry.trigram), *data);
+  }
+}
+
+// Orders paths component by component, so "a/b" sorts before "a-b" like it does in a tree listing.
+// Files of a segment are numbered in this order, which is the order --sort and --index print them.
+bool path_less(std::string_view a, std::string_view b) {
+  return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+    unsigned char ux = x == '/' ? 0 : x;
+    unsigned char uy = y == '/' ? 0 : y;
+    return ux < uy;
+  });
+}
+
+// A 64 bit hash of a file's contents, eight bytes at a time. It only has to tell whether a touched
+// file is still the same, not stand up to anyone making collisions on purpose.
+uint64_t content_hash(std::string_view contents) {
+  uint64_t hash = 0x9e3779b97f4a7c15ull ^ contents.size();
+  auto mix      = [&hash](uint64_t word) {
+    hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+    hash ^= hash >> 32;
+  };
+
+  size_t i = 0;
+  for (; i + 8 <= contents.size(); i += 8) {
+    uint64_t word;
+    std::memcpy(&word, contents.data() + i, sizeof(word));
+    mix(word);
+  }
+  if (i < contents.size()) {
+    uint64_t word = 0;
+    std::memcpy(&word, contents.data() + i, contents.size() - i);
+    mix(word);
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+class Index;
+
+// Collects the words of files in memory and writes them out as one segment.
+class IndexBuilder {
+public:
+  // files are numbered in the order they are added, false once the segment is out of line ids
+  bool add_file(std::string path, int64_t mtime, uint64_t size, std::string_view contents);
+  // for a segment written on top of others: the file is gone, or unchanged but has a new mtime
+  void remove_file(std::string path) { removed.push_back({std::move(path), 0}); }
+  void retime_file(std::string path, int64_t mtime) { retimed.push_back({std::move(path), mtime}); }
+  // takes segments first to last of the index as they are, false once out of line ids
+  bool merge(const Index& index, size_t first, size_t last, Throttle& throttle);
+  // writes to a temporary file first and renames it, a reader never sees half a segment
+  IndexStatus write(const std::string& path) const;
+  IndexStatus write(const std::string& path, Throttle& throttle) const;
+
+  size_t file_count() const { return files.size(); }
+  uint64_t line_count() const { return lines; }
+  size_t term_count() const { return postings.size(); }
+  size_t removed_count() const { return removed.size(); }
+  size_t retimed_count() const { return retimed.size(); }
+  // bytes the lists, words and paths take up so far, for builds that spill to disk
+  uint64_t memory_use() const { return memory; }
+
+private:
+  struct FileRecord {
+    std::string path;
+    int64_t mtime;
+    uint64_t size;
+    uint64_t hash;
+    uint64_t first_line;
+    uint32_t line_count;
+  };
+
+  struct PathRecord {
+    std::string path;
+    int64_t mtime;
+  };
+
+  void add_line_id(std::vector<uint32_t>& ids, uint32_t id);
+  // sorts lists that merged segments appended to out of order
+  void sort_merged();
+
+  std::vector<FileRecord> files;
+  std::unordered_map<std::string, std::vector<uint32_t>> postings;
+  std::vector<uint32_t> long_words;
+  // files every trigram occurs in, trigrams across a newline are left out since no identifier has one
+  std::unordered_map<uint32_t, std::vector<uint32_t>> trigrams;
+  std::vector<PathRecord> removed;
+  std::vector<PathRecord> retimed;
+  uint64_t lines  = 0;
+  uint64_t memory = 0;
+};
+
+class IndexSegment;
+
+// Writes runs, segments of consecutive stretches of files in path order, as one segment. Terms and
+// trigrams are merged k ways and their lists streamed to the file one at a time; only the files, the
+// dictionary, its trigrams and the lines with long words are held in memory.
+IndexStatus merge_runs(const std::vector<const IndexSegment*>& runs, const std::string& path, uint64_t* term_count);
+
+// A segment file mapped into memory, nothing is copied out of it until a posting list is read.
+class IndexSegment {
+public:
+  IndexStatus open(const std::string& path);
+
+  size_t file_count() const { return header->file_count; }
+  uint64_t line_count() const { return header->line_count; }
+  size_t term_count() const { return header->term_count; }
+  size_t byte_size() const { return mapped.view().size(); }
+
+  const IndexFileEntry& file(size_t index) const { return files[index]; }
+  std::string_view file_path(size_t index) const;
+  // the file the line id belongs to
+  size_t file_of(uint32_t line) const;
+  // index of the file with this path, or file_count() if there is none
+  size_t find_file(std::string_view path) const;
+  // whether the segment deletes the path from the segments before it
+  bool removes(std::string_view path) const { return find_path(removed, removed_count, path) != nullptr; }
+  // whether it records a new mtime for the unchanged file of the segments before it
+  bool retimes(std::string_view path, int64_t* mtime) const;
+  std::vector<std::string_view> removed_paths() const;
+  std::vector<std::pair<std::string_view, int64_t>> retimed_paths() const;
+
+  std::string_view term(size_t index) const;
+  // index of the term with exactly this text, or term_count() if there is none
+  size_t find_term(std::string_view text) const;
+  // the first term that is not less than text
+  size_t lower_bound(std::string_view text) const;
+  PostingList posting_list(size_t index) const;
+  std::vector<uint32_t> postings(size_t index) const { return posting_list(index).decode(); }
+  std::vector<uint32_t> long_words() const;
+
+  // false for segments written before trigrams were indexed
+  bool has_trigrams() const { return trigram_entries != nullptr; }
+  // indexes of the files the trigram occurs in
+  PostingList trigram_list(uint32_t trigram) const;
+  std::vector<uint32_t> trigram_files(uint32_t trigram) const { return trigram_list(trigram).decode(); }
+  // the trigrams one by one, in order
+  size_t trigram_count() const { return trigram_entry_count; }
+  uint32_t trigram(size_t index) const { return trigram_entries[index].trigram; }
+  PostingList trigram_list_at(size_t index) const;
+
+  // false for segments written before the trigrams of terms were indexed
+  bool has_term_trigrams() const { return term_trigram_entries != nullptr; }
+  // indexes of the terms the trigram occurs in
+  PostingList term_trigram_list(uint32_t trigram) const { return trigram_list(term_trigram_entries, term_trigram_entry_count, term_trigram_data, trigram); }
+
+private:
+  const IndexSection* find_section(IndexSectionKind kind) const;
+  PostingList trigram_list(const IndexTrigramEntry* entries, size_t count, const char* data, uint32_t trigram) const;
+  const IndexPathEntry* find_path(const IndexPathEntry* entries, size_t count, std::string_view path) const;
+
+  MappedFile mapped;
+  const IndexHeader* header = nullptr;
+  const IndexFileEntry* files = nullptr;
+  const char* paths = nullptr;
+  const IndexTermEntry* terms = nullptr;
+  const char* term_text = nullptr;
+  const char* posting_data = nullptr;
+  const IndexSection* long_word_section = nullptr;
+  const IndexTrigramEntry* trigram_entries = nullptr;
+  size_t trigram_entry_count = 0;
+  const char* trigram_file_data = nullptr;
+  const IndexTrigramEntry* term_trigram_entries = nullptr;
+  size_t term_trigram_entry_count = 0;
+  const char* term_trigram_data = nullptr;
+  const IndexPathEntry* removed = nullptr;
+  size_t removed_count = 0;
+  const IndexPathEntry* retimed = nullptr;
+  size_t retimed_count = 0;
+};
+
+// All segments listed in CURRENT of an index directory, oldest first. A later segment overrides the
+// files of the earlier ones: it has the new version of a file that changed, or deletes it, or
+// records a new mtime for a file that was only touched.
+class Index {
+public:
+  IndexStatus open(const std::string& index_directory);
+
+  const std::vector<std::unique_ptr<IndexSegment>>& get_segments() const { return segments; }
+  // the names CURRENT had when the segments were opened
+  const std::vector<std::string>& get_names() const { return names; }
+  // false if a later segment replaced or deleted the file, otherwise mtime is its newest mtime
+  bool live_file(size_t segment, size_t file, int64_t* mtime) const { return live_file(segment, file, mtime, segments.size() - 1); }
+  // the same for the segments up to last only
+  bool live_file(size_t segment, size_t file, int64_t* mtime, size_t last) const;
+
+private:
+  std::vector<std::unique_ptr<IndexSegment>> segments;
+  std::vector<std::string> names;
+};
+
+// An flock on a file in the index directory, held until it goes out of scope.
+class IndexLock {
+public:
+  IndexLock() = default;
+  IndexLock(const IndexLock&) = delete;
+  IndexLock& operator=(const IndexLock&) = delete;
+  ~IndexLock();
+
+  // waits for the lock if wait is set, otherwise false if someone else has it
+  bool lock(const std::string& index_directory, const char* name, bool wait);
+  void unlock();
+
+private:
+  int fd = -1;
+};
+
+// The newest segments to merge under the tiered policy, as the first of them, or the number of
+// segments if nothing needs merging. A segment's level is the power of INDEX_MERGE_FACTOR its size
+// is in INDEX_MERGE_UNIT. The newest segments down to a level are merged once INDEX_MERGE_FACTOR of
+// them are of that level, lowest level first, so merges stay small and few segments of a size pile
+// up.
+size_t plan_merge(const Index& index);
+// the same for segments of these sizes in bytes, oldest first
+size_t plan_merge(const std::vector<uint64_t>& sizes);
+
+// the segment names CURRENT of index_directory lists
+IndexStatus read_current(const std::string& index_directory, std::vector<std::string>* names);
+// replaces CURRENT by a list of other segments in one rename
+IndexStatus write_current(const std::string& index_directory, const std::vector<std::string>& names);
+const char* index_status_message(IndexStatus status);
+
+void IndexBuilder::add_line_id(std::vector<uint32_t>& ids, uint32_t id) {
+  // a word that occurs twice on a line is only listed once
+  if (!ids.empty() && ids.back() == id) return;
+  size_t capacity = ids.capacity();
+  ids.push_back(id);
+  memory += (ids.capacity() - capacity) * sizeof(uint32_t);
+}
+
+bool IndexBuilder::add_file(std::string path, int64_t mtime, uint64_t size, std::string_view contents) {
+  // lines are split like scan_lines does, a last line without a newline still counts
+  uint64_t line_count = std::count(contents.begin(), contents.end(), '\n');
+  if (!contents.empty() && contents.back() != '\n') line_count++;
+  if (lines + line_count > UINT32_MAX) return false;
+
+  uint32_t line  = lines;
+  size_t start   = 0;
+  bool in_word   = false;
+  std::string word;
+  for (size_t i = 0; i <= contents.size(); i++) {
+    unsigned char c = i < contents.size() ? contents[i] : '\n';
+    if (is_word_byte(c)) {
+      if (!in_word) start = i;
+      in_word = true;
+      continue;
+    }
+
+    if (in_word) {
+      size_t length = i - start;
+      if (length > INDEX_MAX_TERM_LENGTH) {
+        add_line_id(long_words, line);
+      } else {
+        word.assign(contents.data() + start, length);
+        auto [it, added] = postings.try_emplace(word);
+        if (added) memory += word.size() + INDEX_BUILDER_ENTRY_BYTES;
+        add_line_id(it->second, line);
+      }
+      in_word = false;
+    }
+    if (c == '\n') line++;
+  }
+
+  std::vector<uint32_t> file_trigrams;
+  for (size_t i = 0; i + 2 < contents.size(); i++) {
+    if (contents[i] == '\n' || contents[i + 1] == '\n' || contents[i + 2] == '\n') continue;
+    file_trigrams.push_back(make_trigram(contents.data() + i));
+  }
+  std::sort(file_trigrams.begin(), file_trigrams.end());
+  file_trigrams.erase(std::unique(file_trigrams.begin(), file_trigrams.end()), file_trigrams.end());
+  for (uint32_t trigram : file_trigrams) {
+    auto [it, added] = trigrams.try_emplace(trigram);
+    if (added) memory += INDEX_BUILDER_ENTRY_BYTES;
+    add_line_id(it->second, files.size());
+  }
+
+  memory += path.size() + sizeof(FileRecord);
+  files.push_back({std::move(path), mtime, size, content_hash(contents), lines, (uint32_t)line_count});
+  lines += line_count;
+  return true;
+}
+
+// Files keep their place in path order, their lines and numbers move to where that puts them. The
+// overrides of the merged segments still matter for the segments before first, if there are any.
+bool IndexBuilder::merge(const Index& index, size_t first, size_t last, Throttle& throttle) {
+  const auto& segments = index.get_segments();
+
+  struct Source {
+    size_t segment;
+    size_t file;
+    int64_t mtime;
+  };
+  std::vector<Source> sources;
+  for (size_t s = first; s <= last; s++) {
+    for (size_t f = 0; f < segments[s]->file_count(); f++) {
+      int64_t mtime;
+      if (index.live_file(s, f, &mtime, last)) sources.push_back({s, f, mtime});
+    }
+  }
+  std::sort(sources.begin(), sources.end(), [&segments](const Source& a, const Source& b) {
+    return path_less(segments[a.segment]->file_path(a.file), segments[b.segment]->file_path(b.file));
+  });
+
+  // the merged id of every line and file number of the sources, UINT32_MAX for those left out
+  std::vector<std::vector<uint32_t>> line_ids(last - first + 1);
+  std::vector<std::vector<uint32_t>> file_numbers(last - first + 1);
+  for (size_t s = first; s <= last; s++) {
+    line_ids[s - first].assign(segments[s]->line_count(), UINT32_MAX);
+    file_numbers[s - first].assign(segments[s]->file_count(), UINT32_MAX);
+  }
+  for (const Source& source : sources) {
+    const IndexSegment& segment = *segments[source.segment];
+    const IndexFileEntry& entry = segment.file(source.file);
+    if (lines + entry.line_count > UINT32_MAX) return false;
+
+    for (uint32_t line = 0; line < entry.line_count; line++) {
+      line_ids[source.segment - first][entry.first_line + line] = lines + line;
+    }
+    file_numbers[source.segment - first][source.file] = files.size();
+    files.push_back({std::string(segment.file_path(source.file)), source.mtime, entry.size, entry.hash, lines, entry.line_count});
+    lines += entry.line_count;
+  }
+
+  auto append_mapped = [](const std::vector<uint32_t>& ids, const std::vector<uint32_t>& mapping, std::vector<uint32_t>& out) {
+    for (uint32_t id : ids) {
+      if (mapping[id] != UINT32_MAX) out.push_back(mapping[id]);
+    }
+  };
+
+  for (size_t s = first; s <= last; s++) {
+    const IndexSegment& segment = *segments[s];
+    for (size_t t = 0; t < segment.term_count(); t++) {
+      PostingList list = segment.posting_list(t);
+      throttle.consume(list.encoded_size());
+
+      std::vector<uint32_t> mapped;
+      append_mapped(list.decode(), line_ids[s - first], mapped);
+      if (mapped.empty()) continue;
+      std::vector<uint32_t>& ids = postings[std::string(segment.term(t))];
+      ids.insert(ids.end(), mapped.begin(), mapped.end());
+    }
+    append_mapped(segment.long_words(), line_ids[s - first], long_words);
+
+    for (size_t t = 0; t < segment.trigram_count(); t++) {
+      PostingList list = segment.trigram_list_at(t);
+      throttle.consume(list.encoded_size());
+
+      std::vector<uint32_t> mapped;
+      append_mapped(list.decode(), file_numbers[s - first], mapped);
+      if (mapped.empty()) continue;
+      std::vector<uint32_t>& numbers = trigrams[segment.trigram(t)];
+      numbers.insert(numbers.end(), mapped.begin(), mapped.end());
+    }
+  }
+  sort_merged();
+
+  if (first == 0) return true;
+
+  // the newest override of a path that isn't merged in decides
+  auto merged = [this](std::string_view path) {
+    auto it = std::lower_bound(files.begin(), files.end(), path, [](const FileRecord& file, std::string_view value) { return path_less(file.path, value); });
+    return it != files.end() && it->path == path;
+  };
+  std::unordered_set<std::string_view> decided;
+  for (size_t s = last + 1; s-- > first;) {
+    for (std::string_view path : segments[s]->removed_paths()) {
+      if (!merged(path) && decided.insert(path).second) remove_file(std::string(path));
+    }
+    for (auto [path, mtime] : segments[s]->retimed_paths()) {
+      if (!merged(path) && decided.insert(path).second) retime_file(std::string(path), mtime);
+    }
+  }
+  return true;
+}
+
+// Ids of one segment stay in order when they are mapped, but the ids of several segments interleave.
+void IndexBuilder::sort_merged() {
+  auto sort = [](std::vector<uint32_t>& ids) {
+    if (!std::is_sorted(ids.begin(), ids.end())) std::sort(ids.begin(), ids.end());
+  };
+  for (auto& [term, ids] : postings) {
+    sort(ids);
+  }
+  for (auto& [trigram, numbers] : trigrams) {
+    sort(numbers);
+  }
+  sort(long_words);
+}
+
+IndexStatus IndexBuilder::write(const std::string& path) const {
+  Throttle unlimited(0);
+  return write(path, unlimited);
+}
+
+IndexStatus IndexBuilder::write(const std::string& path, Throttle& throttle) const {
+  std::vector<const std::pair<const std::string, std::vector<uint32_t>>*> sorted;
+  sorted.reserve(postings.size());
+  for (const auto& entry : postings) {
+    sorted.push_back(&entry);
+  }
+  std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+
+  std::vector<IndexFileEntry> file_entries;
+  std::string path_text;
+  for (const FileRecord& file : files) {
+    file_entries.push_back({path_text.size(), (uint32_t)file.path.size(), file.line_count, file.first_line, file.mtime, file.size, file.hash});
+    path_text.append(file.path);
+  }
+
+  auto path_entries = [&path_text](std::vector<PathRecord> records) {
+    std::sort(records.begin(), records.end(), [](const PathRecord& a, const PathRecord& b) { return path_less(a.path, b.path); });
+    std::vector<IndexPathEntry> entries;
+    for (const PathRecord& record : records) {
+      entries.push_back({path_text.size(), (uint32_t)record.path.size(), 0, record.mtime});
+      path_text.append(record.path);
+    }
+    return entries;
+  };
+  std::vector<IndexPathEntry> removed_entries = path_entries(removed);
+  std::vector<IndexPathEntry> retimed_entries = path_entries(retimed);
+
+  std::vector<IndexTermEntry> term_entries;
+  std::string term_text;
+  std::string posting_data;
+  for (const auto* entry : sorted) {
+    term_entries.push_back({term_text.size(), (uint32_t)entry->first.size(), (uint32_t)entry->second.size(), posting_data.size()});
+    term_text.append(entry->first);
+    encode_postings(entry->second, posting_data);
+  }
+
+  std::vector<IndexTrigramEntry> trigram_entries;
+  std::string trigram_file_data;
+  encode_trigram_lists(trigrams, &trigram_entries, &trigram_file_data);
+
+  std::unordered_map<uint32_t, std::vector<uint32_t>> term_trigrams;
+  for (size_t i = 0; i < sorted.size(); i++) {
+    add_term_trigrams(sorted[i]->first, i, term_trigrams);
+  }
+  std::vector<IndexTrigramEntry> term_trigram_entries;
+  std::string term_trigram_data;
+  encode_trigram_lists(term_trigrams, &term_trigram_entries, &term_trigram_data);
+
+  auto align = [](uint64_t offset) { return (offset + 7) & ~(uint64_t)7; };
+
+  std::vector<IndexSection> sections = {
+    {(uint32_t)IndexSectionKind::FILES, 0, 0, file_entries.size() * sizeof(IndexFileEntry)},
+    {(uint32_t)IndexSectionKind::PATHS, 0, 0, path_text.size()},
+    {(uint32_t)IndexSectionKind::TERMS, 0, 0, term_entries.size() * sizeof(IndexTermEntry)},
+    {(uint32_t)IndexSectionKind::TERM_TEXT, 0, 0, term_text.size()},
+    {(uint32_t)IndexSectionKind::POSTINGS, 0, 0, posting_data.size()},
+    {(uint32_t)IndexSectionKind::LONG_WORDS, 0, 0, long_words.size() * sizeof(uint32_t)},
+    {(uint32_t)IndexSectionKind::TRIGRAMS, 0, 0, trigram_entries.size() * sizeof(IndexTrigramEntry)},
+    {(uint32_t)IndexSectionKind::TRIGRAM_FILES, 0, 0, trigram_file_data.size()},
+    {(uint32_t)IndexSectionKind::REMOVED, 0, 0, removed_entries.size() * sizeof(IndexPathEntry)},
+    {(uint32_t)IndexSectionKind::RETIMED, 0, 0, retimed_entries.size() * sizeof(IndexPathEntry)},
+    {(uint32_t)IndexSectionKind::TERM_TRIGRAMS, 0, 0, term_trigram_entries.size() * sizeof(IndexTrigramEntry)},
+    {(uint32_t)IndexSectionKind::TERM_TRIGRAM_TERMS, 0, 0, term_trigram_data.size()},
+  };
+  uint64_t offset = align(sizeof(IndexHeader) + sections.size() * sizeof(IndexSection));
+  for (IndexSection& section : sections) {
+    section.offset = offset;
+    offset         = align(offset + section.size);
+  }
+
+  IndexHeader header{};
+  std::memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version       = INDEX_VERSION;
+  header.section_count = sections.size();
+  header.file_count    = files.size();
+  header.line_count    = lines;
+  header.term_count    = sorted.size();
+
+  std::string temporary = path + ".tmp";
+  std::ofstream stream(temporary, std::ios::binary | std::ios::trunc);
+  if (!stream) return IndexStatus::IO_ERROR;
+
+  uint64_t written = 0;
+  auto put = [&](const void* data, uint64_t size) {
+    stream.write(static_cast<const char*>(data), size);
+    written += size;
+    throttle.consume(size);
+  };
+  auto pad = [&]() {
+    static const char zeros[8] = {};
+    put(zeros, align(written) - written);
+  };
+
+  put(&header, sizeof(header));
+  put(sections.data(), sections.size() * sizeof(IndexSection));
+  pad();
+  put(file_entries.data(), sections[0].size);
+  pad();
+  put(path_text.data(), sections[1].size);
+  pad();
+  put(term_entries.data(), sections[2].size);
+  pad();
+  put(term_text.data(), sections[3].size);
+  pad();
+  put(posting_data.data(), sections[4].size);
+  pad();
+  put(long_words.data(), sections[5].size);
+  pad();
+  put(trigram_entries.data(), sections[6].size);
+  pad();
+  put(trigram_file_data.data(), sections[7].size);
+  pad();
+  put(removed_entries.data(), sections[8].size);
+  pad();
+  put(retimed_entries.data(), sections[9].size);
+  pad();
+  put(term_trigram_entries.data(), sections[10].size);
+  pad();
+  put(term_trigram_data.data(), sections[11].size);
+  pad();
+
+  stream.close();
+  if (!stream || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    return IndexStatus::IO_ERROR;
+  }
+  return IndexStatus::OK;
+}
+
+// Visits the keys of several sorted lists of keys in order, every key once with the runs that have it
+// in run order, as (run, index) pairs.
+template <typename Key, typename KeyAt, typename Visit>
+void merge_keys(const std::vector<size_t>& counts, KeyAt key_at, Visit visit) {
+  struct Cursor {
+    Key key;
+    size_t run;
+    size_t index;
+  };
+  auto later = [](const Cursor& a, const Cursor& b) { return a.key != b.key ? a.key > b.key : a.run > b.run; };
+  std::priority_queue<Cursor, std::vector<Cursor>, decltype(later)> heap(later);
+  for (size_t run = 0; run < counts.size(); run++) {
+    if (counts[run] > 0) heap.push({key_at(run, 0), run, 0});
+  }
+
+  std::vector<std::pair<size_t, size_t>> sources;
+  while (!heap.empty()) {
+    Key key = heap.top().key;
+    sources.clear();
+    while (!heap.empty() && heap.top().key == key) {
+      Cursor cursor = heap.top();
+      heap.pop();
+      sources.push_back({cursor.run, cursor.index});
+      if (++cursor.index < counts[cursor.run]) heap.push({key_at(cursor.run, cursor.index), cursor.run, cursor.index});
+    }
+    visit(key, sources);
+  }
+}
+
+// The sections whose size depends on the merge are written first, the header and the section table
+// last, once their offsets are known.
+IndexStatus merge_runs(const std::vector<const IndexSegment*>& runs, const std::string& path, uint64_t* term_count) {
+  // where the lines and file numbers of every run start in the merged segment
+  std::vector<uint32_t> first_lines;
+  std::vector<uint32_t> first_files;
+  uint64_t lines = 0;
+  uint64_t files = 0;
+  for (const IndexSegment* run : runs) {
+    if (lines + run->line_count() > UINT32_MAX) return IndexStatus::TOO_BIG;
+    first_lines.push_back(lines);
+    first_files.push_back(files);
+    lines += run->line_count();
+    files += run->file_count();
+  }
+
+  std::vector<IndexFileEntry> file_entries;
+  std::string path_text;
+  std::vector<uint32_t> long_words;
+  for (size_t r = 0; r < runs.size(); r++) {
+    for (size_t f = 0; f < runs[r]->file_count(); f++) {
+      IndexFileEntry entry = runs[r]->file(f);
+      entry.path_offset    = path_text.size();
+      entry.first_line += first_lines[r];
+      file_entries.push_back(entry);
+      path_text.append(runs[r]->file_path(f));
+    }
+    for (uint32_t id : runs[r]->long_words()) {
+      long_words.push_back(first_lines[r] + id);
+    }
+  }
+
+  std::string temporary = path + ".tmp";
+  std::ofstream stream(temporary, std::ios::binary | std::ios::trunc);
+  if (!stream) return IndexStatus::IO_ERROR;
+
+  auto align       = [](uint64_t offset) { return (offset + 7) & ~(uint64_t)7; };
+  uint64_t written = 0;
+  auto put         = [&](const void* data, uint64_t size) {
+    stream.write(static_cast<const char*>(data), size);
+    written += size;
+  };
+  auto pad = [&]() {
+    static const char zeros[8] = {};
+    put(zeros, align(written) - written);
+  };
+
+  const size_t SECTION_COUNT = 12;
+  std::vector<IndexSection> sections;
+  std::string placeholder(sizeof(IndexHeader) + SECTION_COUNT * sizeof(IndexSection), '\0');
+  put(placeholder.data(), placeholder.size());
+  auto put_section = [&](IndexSectionKind kind, const void* data, uint64_t size) {
+    pad();
+    sections.push_back({(uint32_t)kind, 0, written, size});
+    put(data, size);
+  };
+
+  // the lists of a key are the lists of the runs one after the other, their ids moved past the
+  // runs before
+  std::vector<uint32_t> ids;
+  std::string encoded;
+  auto put_list = [&](const std::vector<std::pair<size_t, size_t>>& sources, auto list_at, const std::vector<uint32_t>& firsts) {
+    ids.clear();
+    for (auto [run, index] : sources) {
+      for (uint32_t id : list_at(run, index).decode()) {
+        ids.push_back(firsts[run] + id);
+      }
+    }
+    encoded.clear();
+    encode_postings(ids, encoded);
+    put(encoded.data(), encoded.size());
+  };
+
+  std::vector<size_t> counts;
+  for (const IndexSegment* run : runs) {
+    counts.push_back(run->term_count());
+  }
+  std::vector<IndexTermEntry> term_entries;
+  std::string term_text;
+  std::unordered_map<uint32_t, std::vector<uint32_t>> term_trigrams;
+  pad();
+  uint64_t postings_start = written;
+  merge_keys<std::string_view>(counts, [&runs](size_t run, size_t index) { return runs[run]->term(index); }, [&](std::string_view term, const auto& sources) {
+    uint64_t offset = written - postings_start;
+    put_list(sources, [&runs](size_t run, size_t index) { return runs[run]->posting_list(index); }, first_lines);
+    add_term_trigrams(term, term_entries.size(), term_trigrams);
+    term_entries.push_back({term_text.size(), (uint32_t)term.size(), (uint32_t)ids.size(), offset});
+    term_text.append(term);
+  });
+  sections.push_back({(uint32_t)IndexSectionKind::POSTINGS, 0, postings_start, written - postings_start});
+
+  counts.clear();
+  for (const IndexSegment* run : runs) {
+    counts.push_back(run->trigram_count());
+  }
+  std::vector<IndexTrigramEntry> trigram_entries;
+  pad();
+  uint64_t trigram_files_start = written;
+  merge_keys<uint32_t>(counts, [&runs](size_t run, size_t index) { return runs[run]->trigram(index); }, [&](uint32_t trigram, const auto& sources) {
+    uint64_t offset = written - trigram_files_start;
+    put_list(sources, [&runs](size_t run, size_t index) { return runs[run]->trigram_list_at(index); }, first_files);
+    trigram_entries.push_back({trigram, (uint32_t)ids.size(), offset});
+  });
+  sections.push_back({(uint32_t)IndexSectionKind::TRIGRAM_FILES, 0, trigram_files_start, written - trigram_files_start});
+
+  put_section(IndexSectionKind::FILES, file_entries.data(), file_entries.size() * sizeof(IndexFileEntry));
+  put_section(IndexSectionKind::PATHS, path_text.data(), path_text.size());
+  put_section(IndexSectionKind::TERMS, term_entries.data(), term_entries.size() * sizeof(IndexTermEntry));
+  put_section(IndexSectionKind::TERM_TEXT, term_text.data(), term_text.size());
+  put_section(IndexSectionKind::LONG_WORDS, long_words.data(), long_words.size() * sizeof(uint32_t));
+  put_section(IndexSectionKind::TRIGRAMS, trigram_entries.data(), trigram_entries.size() * sizeof(IndexTrigramEntry));
+  put_section(IndexSectionKind::REMOVED, nullptr, 0);
+  put_section(IndexSectionKind::RETIMED, nullptr, 0);
+
+  std::vector<IndexTrigramEntry> term_trigram_entries;
+  std::string term_trigram_data;
+  encode_trigram_lists(term_trigrams, &term_trigram_entries, &term_trigram_data);
+  term_trigrams.clear();
+  put_section(IndexSectionKind::TERM_TRIGRAMS, term_trigram_entries.data(), term_trigram_entries.size() * sizeof(IndexTrigramEntry));
+  put_section(IndexSectionKind::TERM_TRIGRAM_TERMS, term_trigram_data.data(), term_trigram_data.size());
+  pad();
+
+  IndexHeader header{};
+  std::memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version       = INDEX_VERSION;
+  header.section_count = sections.size();
+  header.file_count    = files;
+  header.line_count    = lines;
+  header.term_count    = term_entries.size();
+  stream.seekp(0);
+  stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  stream.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(IndexSection));
+
+  stream.close();
+  if (!stream || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    return IndexStatus::IO_ERROR;
+  }
+  *term_count = term_entries.size();
+  return IndexStatus::OK;
+}
+
+// whether an encoded list of count ids at offset, its skip entries and the end of its last block, is
+// inside a section of size bytes
+bool posting_list_fits(const char* section, uint64_t size, uint64_t offset, uint32_t count) {
+  if (offset % 4 != 0 || offset > size) return false;
+  PostingList list(section + offset, count);
+  uint64_t skips = list.block_count() * sizeof(PostingSkip);
+  if (skips > size - offset) return false;
+  return list.block_count() == 0 || list.skip(list.block_count() - 1).end <= size - offset - skips;
+}
+
+// Every entry is checked against the section it points into, so a truncated or damaged segment fails
+// to open instead of being read out of bounds later. The blocks inside a list are not, that would
+// read all the postings on every open.
+IndexStatus IndexSegment::open(const std::string& path) {
+  if (!mapped.open(path.c_str())) return IndexStatus::MISSING;
+
+  std::string_view contents = mapped.view();
+  if (contents.size() < sizeof(IndexHeader)) return IndexStatus::BAD_FORMAT;
+  header = reinterpret_cast<const IndexHeader*>(contents.data());
+  if (std::memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != INDEX_VERSION) return IndexStatus::BAD_FORMAT;
+  if (sizeof(IndexHeader) + header->section_count * sizeof(IndexSection) > contents.size()) return IndexStatus::BAD_FORMAT;
+
+  const IndexSection* table = reinterpret_cast<const IndexSection*>(header + 1);
+  for (uint32_t i = 0; i < header->section_count; i++) {
+    if (table[i].offset % 8 != 0 || table[i].offset > contents.size() || table[i].size > contents.size() - table[i].offset) return IndexStatus::BAD_FORMAT;
+  }
+
+  const IndexSection* file_section    = find_section(IndexSectionKind::FILES);
+  const IndexSection* path_section    = find_section(IndexSectionKind::PATHS);
+  const IndexSection* term_section    = find_section(IndexSectionKind::TERMS);
+  const IndexSection* text_section    = find_section(IndexSectionKind::TERM_TEXT);
+  const IndexSection* posting_section = find_section(IndexSectionKind::POSTINGS);
+  long_word_section                   = find_section(IndexSectionKind::LONG_WORDS);
+  if (!file_section || !path_section || !term_section || !text_section || !posting_section || !long_word_section) return IndexStatus::BAD_FORMAT;
+  if (file_section->size != header->file_count * sizeof(IndexFileEntry) || term_section->size != header->term_count * sizeof(IndexTermEntry)) {
+    return IndexStatus::BAD_FORMAT;
+  }
+
+  files        = reinterpret_cast<const IndexFileEntry*>(contents.data() + file_section->offset);
+  paths        = contents.data() + path_section->offset;
+  terms        = reinterpret_cast<const IndexTermEntry*>(contents.data() + term_section->offset);
+  term_text    = contents.data() + text_section->offset;
+  posting_data = contents.data() + posting_section->offset;
+
+  auto path_fits = [path_section](uint64_t offset, uint32_t length) { return offset <= path_section->size && length <= path_section->size - offset; };
+  uint64_t next_line = 0;
+  for (size_t i = 0; i < file_count(); i++) {
+    if (!path_fits(files[i].path_offset, files[i].path_length)) return IndexStatus::BAD_FORMAT;
+    // files number their lines one after the other
+    if (files[i].first_line != next_line || files[i].line_count > line_count() - next_line) return IndexStatus::BAD_FORMAT;
+    next_line += files[i].line_count;
+  }
+  for (size_t i = 0; i < term_count(); i++) {
+    if (terms[i].text_offset > text_section->size || terms[i].text_length > text_section->size - terms[i].text_offset) return IndexStatus::BAD_FORMAT;
+    if (!posting_list_fits(posting_data, posting_section->size, terms[i].posting_offset, terms[i].posting_count)) return IndexStatus::BAD_FORMAT;
+  }
+  if (long_word_section->size % sizeof(uint32_t) != 0) return IndexStatus::BAD_FORMAT;
+
+  // trigrams are optional, without them every file is a candidate
+  const IndexSection* trigram_section      = find_section(IndexSectionKind::TRIGRAMS);
+  const IndexSection* trigram_file_section = find_section(IndexSectionKind::TRIGRAM_FILES);
+  if (trigram_section && trigram_file_section) {
+    if (trigram_section->size % sizeof(IndexTrigramEntry) != 0) return IndexStatus::BAD_FORMAT;
+    trigram_entries     = reinterpret_cast<const IndexTrigramEntry*>(contents.data() + trigram_section->offset);
+    trigram_entry_count = trigram_section->size / sizeof(IndexTrigramEntry);
+    trigram_file_data   = contents.data() + trigram_file_section->offset;
+    for (size_t i = 0; i < trigram_entry_count; i++) {
+      if (!posting_list_fits(trigram_file_data, trigram_file_section->size, trigram_entries[i].file_offset, trigram_entries[i].file_count)) return IndexStatus::BAD_FORMAT;
+    }
+  }
+  // so are those of terms, without them a lookup reads the whole dictionary
+  const IndexSection* term_trigram_section      = find_section(IndexSectionKind::TERM_TRIGRAMS);
+  const IndexSection* term_trigram_term_section = find_section(IndexSectionKind::TERM_TRIGRAM_TERMS);
+  if (term_trigram_section && term_trigram_term_section) {
+    if (term_trigram_section->size % sizeof(IndexTrigramEntry) != 0) return IndexStatus::BAD_FORMAT;
+    term_trigram_entries     = reinterpret_cast<const IndexTrigramEntry*>(contents.data() + term_trigram_section->offset);
+    term_trigram_entry_count = term_trigram_section->size / sizeof(IndexTrigramEntry);
+    term_trigram_data        = contents.data() + term_trigram_term_section->offset;
+    for (size_t i = 0; i < term_trigram_entry_count; i++) {
+      if (!posting_list_fits(term_trigram_data, term_trigram_term_section->size, term_trigram_entries[i].file_offset, term_trigram_entries[i].file_count)) return IndexStatus::BAD_FORMAT;
+    }
+  }
+  // so is what a segment overrides of the ones before it
+  if (const IndexSection* removed_section = find_section(IndexSectionKind::REMOVED)) {
+    removed       = reinterpret_cast<const IndexPathEntry*>(contents.data() + removed_section->offset);
+    removed_count = removed_section->size / sizeof(IndexPathEntry);
+  }
+  if (const IndexSection* retimed_section = find_section(IndexSectionKind::RETIMED)) {
+    retimed       = reinterpret_cast<const IndexPathEntry*>(contents.data() + retimed_section->offset);
+    retimed_count = retimed_section->size / sizeof(IndexPathEntry);
+  }
+  for (size_t i = 0; i < removed_count; i++) {
+    if (!path_fits(removed[i].path_offset, removed[i].path_length)) return IndexStatus::BAD_FORMAT;
+  }
+  for (size_t i = 0; i < retimed_count; i++) {
+    if (!path_fits(retimed[i].path_offset, retimed[i].path_length)) return IndexStatus::BAD_FORMAT;
+  }
+  // lookups jump around the dictionary, reading ahead would only waste memory
+  madvise(const_cast<char*>(contents.data()), contents.size(), MADV_RANDOM);
+  return IndexStatus::OK;
+}
+
+const IndexSection* IndexSegment::find_section(IndexSectionKind kind) const {
+  const IndexSection* table = reinterpret_cast<const IndexSection*>(header + 1);
+  for (uint32_t i = 0; i < header->section_count; i++) {
+    if (table[i].kind == (uint32_t)kind) return &table[i];
+  }
+  return nullptr;
+}
+
+std::string_view IndexSegment::file_path(size_t index) const {
+  return std::string_view(paths + files[index].path_offset, files[index].path_length);
+}
+
+size_t IndexSegment::file_of(uint32_t line) const {
+  const IndexFileEntry* end = files + file_count();
+  const IndexFileEntry* it  = std::upper_bound(files, end, line, [](uint32_t id, const IndexFileEntry& entry) { return id < entry.first_line; });
+  return it - files - 1;
+}
+
+size_t IndexSegment::find_file(std::string_view path) const {
+  const IndexFileEntry* end = files + file_count();
+  const IndexFileEntry* it  = std::lower_bound(files, end, path, [this](const IndexFileEntry& entry, std::string_view value) {
+    return path_less(std::string_view(paths + entry.path_offset, entry.path_length), value);
+  });
+  if (it == end || file_path(it - files) != path) return file_count();
+  return it - files;
+}
+
+const IndexPathEntry* IndexSegment::find_path(const IndexPathEntry* entries, size_t count, std::string_view path) const {
+  const IndexPathEntry* end = entries + count;
+  const IndexPathEntry* it  = std::lower_bound(entries, end, path, [this](const IndexPathEntry& entry, std::string_view value) {
+    return path_less(std::string_view(paths + entry.path_offset, entry.path_length), value);
+  });
+  if (it == end || std::string_view(paths + it->path_offset, it->path_length) != path) return nullptr;
+  return it;
+}
+
+bool IndexSegment::retimes(std::string_view path, int64_t* mtime) const {
+  const IndexPathEntry* entry = find_path(retimed, retimed_count, path);
+  if (entry == nullptr) return false;
+  *mtime = entry->mtime;
+  return true;
+}
+
+std::string_view IndexSegment::term(size_t index) const {
+  return std::string_view(term_text + terms[index].text_offset, terms[index].text_length);
+}
+
+size_t IndexSegment::lower_bound(std::string_view text) const {
+  size_t low  = 0;
+  size_t high = term_count();
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (term(middle) < text) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+size_t IndexSegment::find_term(std::string_view text) const {
+  size_t index = lower_bound(text);
+  return index < term_count() && term(index) == text ? index : term_count();
+}
+
+PostingList IndexSegment::posting_list(size_t index) const {
+  return PostingList(posting_data + terms[index].posting_offset, terms[index].posting_count);
+}
+
+std::vector<uint32_t> IndexSegment::long_words() const {
+  const uint32_t* start = reinterpret_cast<const uint32_t*>(mapped.view().data() + long_word_section->offset);
+  return std::vector<uint32_t>(start, start + long_word_section->size / sizeof(uint32_t));
+}
+
+PostingList IndexSegment::trigram_list_at(size_t index) const {
+  return PostingList(trigram_file_data + trigram_entries[index].file_offset, trigram_entries[index].file_count);
+}
+
+std::vector<std::string_view> IndexSegment::removed_paths() const {
+  std::vector<std::string_view> result;
+  for (size_t i = 0; i < removed_count; i++) {
+    result.emplace_back(paths + removed[i].path_offset, removed[i].path_length);
+  }
+  return result;
+}
+
+std::vector<std::pair<std::string_view, int64_t>> IndexSegment::retimed_paths() const {
+  std::vector<std::pair<std::string_view, int64_t>> result;
+  for (size_t i = 0; i < retimed_count; i++) {
+    result.emplace_back(std::string_view(paths + retimed[i].path_offset, retimed[i].path_length), retimed[i].mtime);
+  }
+  return result;
+}
+
+PostingList IndexSegment::trigram_list(uint32_t trigram) const {
+  return trigram_list(trigram_entries, trigram_entry_count, trigram_file_data, trigram);
+}
+
+PostingList IndexSegment::trigram_list(const IndexTrigramEntry* entries, size_t count, const char* data, uint32_t trigram) const {
+  const IndexTrigramEntry* end = entries + count;
+  const IndexTrigramEntry* it  = std::lower_bound(entries, end, trigram, [](const IndexTrigramEntry& entry, uint32_t value) { return entry.trigram < value; });
+  if (it == end || it->trigram != trigram) return {};
+  return PostingList(data + it->file_offset, it->file_count);
+}
+
+// Segments are never changed, only replaced: a compaction writes the merged segment, swaps CURRENT
+// and deletes the segments it merged. A segment that is gone between reading CURRENT and opening it
+// means CURRENT moved on, and is read again. Segments already mapped stay readable after they are
+// deleted.
+IndexStatus Index::open(const std::string& index_directory) {
+  IndexStatus status = IndexStatus::MISSING;
+  for (int attempt = 0; attempt < INDEX_OPEN_ATTEMPTS; attempt++) {
+    status = read_current(index_directory, &names);
+    if (status != IndexStatus::OK) return status;
+
+    segments.clear();
+    for (const std::string& name : names) {
+      auto segment = std::make_unique<IndexSegment>();
+      status       = segment->open(index_directory + "/" + name);
+      if (status != IndexStatus::OK) break;
+      segments.push_back(std::move(segment));
+    }
+    if (status != IndexStatus::MISSING) return status;
+  }
+  return status;
+}
+
+bool Index::live_file(size_t segment, size_t file, int64_t* mtime, size_t last) const {
+  std::string_view path = segments[segment]->file_path(file);
+  *mtime                = segments[segment]->file(file).mtime;
+
+  // the newest segment that retimes the file has its mtime
+  bool retimed = false;
+  for (size_t later = last; later > segment; later--) {
+    const IndexSegment& other = *segments[later];
+    if (other.find_file(path) < other.file_count() || other.removes(path)) return false;
+    if (!retimed) retimed = other.retimes(path, mtime);
+  }
+  return true;
+}
+
+IndexLock::~IndexLock() {
+  unlock();
+}
+
+void IndexLock::unlock() {
+  if (fd >= 0) close(fd);
+  fd = -1;
+}
+
+bool IndexLock::lock(const std::string& index_directory, const char* name, bool wait) {
+  fd = ::open((index_directory + "/" + name).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) return false;
+  if (flock(fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) == 0) return true;
+  close(fd);
+  fd = -1;
+  return false;
+}
+
+size_t plan_merge(const Index& index) {
+  std::vector<uint64_t> sizes;
+  for (const auto& segment : index.get_segments()) {
+    sizes.push_back(segment->byte_size());
+  }
+  return plan_merge(sizes);
+}
+
+size_t plan_merge(const std::vector<uint64_t>& sizes) {
+  std::vector<unsigned> levels;
+  for (uint64_t size : sizes) {
+    unsigned level = 0;
+    for (uint64_t bound = INDEX_MERGE_UNIT; size > bound; bound *= INDEX_MERGE_FACTOR) level++;
+    levels.push_back(level);
+  }
+
+  // smaller segments newer than those of a level go along in its merge, but don't count towards it,
+  // else a big old segment would be rewritten for every few small ones
+  for (unsigned level = 0;; level++) {
+    size_t first = sizes.size();
+    size_t peers = 0;
+    while (first > 0 && levels[first - 1] <= level) peers += levels[--first] == level;
+    if (peers >= INDEX_MERGE_FACTOR) return first;
+    if (first == 0) return sizes.size();
+  }
+}
+
+IndexStatus read_current(const std::string& index_directory, std::vector<std::string>* names) {
+  std::ifstream stream(index_directory + "/" + INDEX_CURRENT);
+  if (!stream) return IndexStatus::MISSING;
+
+  names->clear();
+  std::string line;
+  while (std::getline(stream, line)) {
+    if (!line.empty()) names->push_back(line);
+  }
+  return IndexStatus::OK;
+}
+
+IndexStatus write_current(const std::string& index_directory, const std::vector<std::string>& names) {
+  std::string path      = index_directory + "/" + INDEX_CURRENT;
+  std::string temporary = path + ".tmp";
+
+  std::ofstream stream(temporary, std::ios::trunc);
+  for (const std::string& name : names) {
+    stream << name << '\n';
+  }
+  stream.close();
+
+  if (!stream || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    return IndexStatus::IO_ERROR;
+  }
+  return IndexStatus::OK;
+}
+
+const char* index_status_message(IndexStatus status) {
+  switch (status) {
+    case IndexStatus::OK:
+      return "ok";
+    case IndexStatus::MISSING:
+      return "no index, run 'bool-search index build' first";
+    case IndexStatus::BAD_FORMAT:
+      return "the index is damaged or was written by another version";
+    case IndexStatus::TOO_BIG:
+      return "too many lines for one index segment";
+    case IndexStatus::IO_ERROR:
+      return "could not write the index";
+  }
+  return "unknown error";
+}
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef _INDEX_QUERY_H_
+#define _INDEX_QUERY_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bitmap.h"
+#include "index.h"
+#include "intersect.h"
+#include "query.h"
+
+// What the index knows about the lines matching a query: every line in yes matches, every matching
+// line is in maybe. Lines in maybe but not in yes have to be checked against the file.
+struct LineMatch {
+  Bitmap yes;
+  Bitmap maybe;
+};
+
+// The dictionary terms an identifier needs, looked up once when a query is planned. A line may
+// contain the identifier if it has a term of every group, or a word too long for the dictionary. For
+// an exact lookup there is one group and its terms are certain.
+struct IdLookup {
+  bool exact = false;
+  std::vector<std::vector<uint32_t>> groups;
+  // postings of every group, what reading it costs
+  std::vector<uint64_t> postings;
+  // the most lines the identifier can be on
+  uint64_t estimate = 0;
+};
+
+// probing a line in every posting list of a group costs about this many postings read in order
+#define INDEX_PROBE_COST 8
+// groups of at most this many terms are intersected with a domain list by list, bigger ones go
+// through a bitmap
+#define INDEX_LIST_TERMS 4
+
+IdLookup lookup_id(const IndexSegment& segment, std::string_view id);
+// the lines of the segment that may contain the identifier, and those that certainly do, only
+// those in domain if there is one
+LineMatch match_lookup(const IndexSegment& segment, const IdLookup& lookup, const Bitmap* domain);
+// the files of the segment that have every trigram the query needs, by index
+Bitmap candidate_files(const IndexSegment& segment, const Query& query);
+
+Bitmap posting_bitmap(const PostingList& list) {
+  std::vector<uint32_t> ids = list.decode();
+  return Bitmap(ids.data(), ids.size());
+}
+
+// The ids in every one of the lists. The rarest list is read first, the others are only probed for
+// what it leaves once they are much longer.
+std::vector<uint32_t> intersect_lists(std::vector<PostingList> lists) {
+  if (lists.empty()) return {};
+  std::sort(lists.begin(), lists.end(), [](const PostingList& a, const PostingList& b) { return a.size() < b.size(); });
+
+  std::vector<uint32_t> ids = lists[0].decode();
+  for (size_t i = 1; i < lists.size() && !ids.empty(); i++) {
+    if (ids.size() * INDEX_PROBE_COST >= lists[i].size()) {
+      ids = intersect(ids, lists[i].decode());
+      continue;
+    }
+    PostingCursor cursor(lists[i]);
+    ids.erase(std::remove_if(ids.begin(), ids.end(), [&cursor](uint32_t id) { return !cursor.seek(id); }), ids.end());
+  }
+  return ids;
+}
+
+// the distinct trigrams of text, in order
+std::vector<uint32_t> text_trigrams(std::string_view text) {
+  std::vector<uint32_t> trigrams;
+  for (size_t i = 0; i + 2 < text.size(); i++) {
+    trigrams.push_back(make_trigram(text.data() + i));
+  }
+  std::sort(trigrams.begin(), trigrams.end());
+  trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+  return trigrams;
+}
+
+// the terms from first to last the predicate accepts
+template <typename Accept>
+std::vector<uint32_t> find_terms(const IndexSegment& segment, size_t first, size_t last, Accept accept) {
+  std::vector<uint32_t> found;
+  for (size_t i = first; i < last; i++) {
+    if (accept(segment.term(i))) found.push_back(i);
+  }
+  return found;
+}
+
+// The terms containing text the predicate accepts. Only terms with every trigram of the text can
+// contain it, so where the segment has the trigrams of its terms only those are checked; text shorter
+// than a trigram, or an older segment, still goes through the whole dictionary.
+template <typename Accept>
+std::vector<uint32_t> find_terms_containing(const IndexSegment& segment, std::string_view text, Accept accept) {
+  std::vector<uint32_t> trigrams = text_trigrams(text);
+  if (trigrams.empty() || !segment.has_term_trigrams()) return find_terms(segment, 0, segment.term_count(), accept);
+
+  std::vector<PostingList> lists;
+  for (uint32_t trigram : trigrams) {
+    lists.push_back(segment.term_trigram_list(trigram));
+  }
+  std::vector<uint32_t> found = intersect_lists(lists);
+  found.erase(std::remove_if(found.begin(), found.end(), [&](uint32_t term) { return !accept(segment.term(term)); }), found.end());
+  return found;
+}
+
+// All lines with one of the terms, which have total postings. A big union goes through a plain bit
+// per line, so every posting is a single OR into a word instead of a merge.
+Bitmap lines_with_terms(const IndexSegment& segment, const std::vector<uint32_t>& accepted, uint64_t total) {
+  if (accepted.empty()) return Bitmap();
+  if (accepted.size() == 1) return posting_bitmap(segment.posting_list(accepted[0]));
+
+  if (total < segment.line_count() / 64) {
+    Bitmap lines;
+    for (uint32_t i : accepted) {
+      lines |= posting_bitmap(segment.posting_list(i));
+    }
+    return lines;
+  }
+
+  std::vector<uint64_t> bits((segment.line_count() + 63) / 64, 0);
+  uint32_t block[POSTINGS_BLOCK_SIZE];
+  for (uint32_t i : accepted) {
+    PostingList list = segment.posting_list(i);
+    for (size_t b = 0; b < list.block_count(); b++) {
+      size_t count = list.decode_block(b, block);
+      for (size_t k = 0; k < count; k++) {
+        bits[block[k] / 64] |= 1ull << (block[k] % 64);
+      }
+    }
+  }
+  return Bitmap::from_bits(bits);
+}
+
+// The lines of domain with one of the terms. When the domain is small next to the postings, every
+// line of it is looked up in the lists instead of reading them whole. A few lists with about as many
+// postings as the domain has lines are intersected with it one by one, with the kernel their
+// lengths call for.
+Bitmap lines_with_terms(const IndexSegment& segment, const std::vector<uint32_t>& terms, uint64_t total, const Bitmap* domain) {
+  if (domain == nullptr) return lines_with_terms(segment, terms, total);
+  uint64_t domain_size = domain->cardinality();
+  if (domain_size * terms.size() * INDEX_PROBE_COST >= total) {
+    if (terms.size() > INDEX_LIST_TERMS || domain_size > total) return lines_with_terms(segment, terms, total) & *domain;
+
+    std::vector<uint32_t> lines;
+    std::vector<uint32_t> domain_ids = domain->ids(0, segment.line_count());
+    for (uint32_t term : terms) {
+      lines = unite(lines, intersect(domain_ids, segment.postings(term)));
+    }
+    return Bitmap(lines.data(), lines.size());
+  }
+
+  std::vector<PostingCursor> cursors;
+  for (uint32_t term : terms) {
+    cursors.emplace_back(segment.posting_list(term));
+  }
+  std::vector<uint32_t> found;
+  for (uint32_t id : domain->ids(0, segment.line_count())) {
+    for (PostingCursor& cursor : cursors) {
+      if (cursor.seek(id)) {
+        found.push_back(id);
+        break;
+      }
+    }
+  }
+  return Bitmap(found.data(), found.size());
+}
+
+// The index only knows words. An identifier made of word bytes only is inside one word wherever it
+// occurs, so the lines with a word containing it are exactly its lines. Otherwise its word runs give
+// candidates: a run between two separators is a whole word, the first run ends a word and the last
+// one starts a word. Lines with words too long for the dictionary could contain anything.
+IdLookup lookup_id(const IndexSegment& segment, std::string_view id) {
+  std::vector<std::pair<size_t, size_t>> runs;
+  for (size_t i = 0; i < id.size();) {
+    if (!is_word_byte(id[i])) {
+      i++;
+      continue;
+    }
+    size_t start = i;
+    while (i < id.size() && is_word_byte(id[i])) i++;
+    runs.emplace_back(start, i - start);
+  }
+
+  IdLookup lookup;
+  size_t terms = segment.term_count();
+
+  if (runs.size() == 1 && runs[0].second == id.size()) {
+    lookup.exact = true;
+    lookup.groups.push_back(find_terms_containing(segment, id, [id](std::string_view term) { return term.find(id) != std::string_view::npos; }));
+  }
+
+  for (size_t r = 0; r < runs.size() && !lookup.exact; r++) {
+    auto [start, length] = runs[r];
+    std::string_view run = id.substr(start, length);
+    bool starts_word     = start > 0;
+    bool ends_word       = start + length < id.size();
+
+    if (starts_word && ends_word) {
+      size_t index = segment.find_term(run);
+      lookup.groups.push_back(index < terms ? std::vector<uint32_t>{(uint32_t)index} : std::vector<uint32_t>{});
+    } else if (starts_word) {
+      // words starting with the run are next to each other in the dictionary
+      size_t first = segment.lower_bound(run);
+      size_t last  = first;
+      while (last < terms && segment.term(last).substr(0, run.size()) == run) last++;
+      lookup.groups.push_back(find_terms(segment, first, last, [](std::string_view) { return true; }));
+    } else {
+      lookup.groups.push_back(find_terms_containing(segment, run, [run](std::string_view term) {
+        return term.size() >= run.size() && term.substr(term.size() - run.size()) == run;
+      }));
+    }
+  }
+
+  // the group with the fewest postings is read first, the others only for the lines it leaves
+  uint64_t long_words = segment.long_words().size();
+  std::vector<std::pair<uint64_t, std::vector<uint32_t>>> costed;
+  for (std::vector<uint32_t>& group : lookup.groups) {
+    uint64_t total = 0;
+    for (uint32_t term : group) {
+      total += segment.posting_list(term).size();
+    }
+    costed.emplace_back(total, std::move(group));
+  }
+  std::sort(costed.begin(), costed.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  lookup.groups.clear();
+  lookup.estimate = segment.line_count();
+  for (auto& [total, group] : costed) {
+    lookup.postings.push_back(total);
+    lookup.groups.push_back(std::move(group));
+    lookup.estimate = std::min<uint64_t>(lookup.estimate, total + long_words);
+  }
+  return lookup;
+}
+
+LineMatch match_lookup(const IndexSegment& segment, const IdLookup& lookup, const Bitmap* domain) {
+  std::vector<uint32_t> long_word_ids = segment.long_words();
+  Bitmap long_words(long_word_ids.data(), long_word_ids.size());
+  if (domain != nullptr) long_words = long_words & *domain;
+
+  if (lookup.exact) {
+    Bitmap lines = lines_with_terms(segment, lookup.groups[0], lookup.postings[0], domain);
+    return {lines, lines | long_words};
+  }
+
+  // without a word there is nothing to look up, every line is a candidate
+  if (lookup.groups.empty()) return {Bitmap(), domain != nullptr ? *domain : Bitmap::range(0, segment.line_count())};
+
+  Bitmap maybe = lines_with_terms(segment, lookup.groups[0], lookup.postings[0], domain) | long_words;
+  for (size_t g = 1; g < lookup.groups.size() && !maybe.empty(); g++) {
+    Bitmap lines = lines_with_terms(segment, lookup.groups[g], lookup.postings[g], &maybe);
+    maybe        = lines | (long_words & maybe);
+  }
+  return {Bitmap(), maybe};
+}
+
+// A file can only contain an identifier if it has every trigram of it. Identifiers shorter than three
+// bytes, and anything under a "not", don't narrow the files down.
+Bitmap candidate_files_node(const IndexSegment& segment, const Query& query, uint32_t index) {
+  Bitmap all = Bitmap::range(0, segment.file_count());
+
+  const QueryNode& node = query.get_nodes()[index];
+  switch (node.op) {
+    case QueryOp::ID: {
+      std::vector<uint32_t> trigrams = text_trigrams(query.get_ids()[node.left]);
+      if (trigrams.empty()) return all;
+
+      std::vector<PostingList> lists;
+      for (uint32_t trigram : trigrams) {
+        lists.push_back(segment.trigram_list(trigram));
+      }
+      std::vector<uint32_t> files = intersect_lists(lists);
+      return Bitmap(files.data(), files.size());
+    }
+    case QueryOp::NOT:
+      return all;
+    case QueryOp::AND:
+      return candidate_files_node(segment, query, node.left) & candidate_files_node(segment, query, node.right);
+    case QueryOp::OR:
+      return candidate_files_node(segment, query, node.left) | candidate_files_node(segment, query, node.right);
+  }
+  return all;
+}
+
+Bitmap candidate_files(const IndexSegment& segment, const Query& query) {
+  if (!segment.has_trigrams()) return Bitmap::range(0, segment.file_count());
+  return candidate_files_node(segment, query, query.get_root());
+}
+
+#endif
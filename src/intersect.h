@@ -0,0 +1,244 @@
+#ifndef _INTERSECT_H_
+#define _INTERSECT_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INTERSECT_X86 1
+#endif
+
+// Kernels that intersect and unite sorted lists of distinct ids. Which one is fastest depends on how
+// much longer one list is than the other: lists of about the same length are best walked together,
+// four ids at a time with SIMD compares; a short list next to a long one is best searched for in it,
+// jumping over the long list with exponential steps. Hashing the short list is the fallback for a
+// short list that isn't sorted, on sorted lists it never beats the merge (see bench-intersect).
+enum class SetKernel {
+  MERGE,
+  SIMD,
+  HASH,
+  GALLOP,
+};
+
+// length ratio of the longer to the shorter list from which galloping through the long list beats a
+// merge, and beats the SIMD merge
+#define INTERSECT_GALLOP_RATIO 16
+#define INTERSECT_SIMD_GALLOP_RATIO 64
+// the same for unions, which have no SIMD merge
+#define UNITE_GALLOP_RATIO 32
+
+// the kernel for lists of these lengths
+SetKernel choose_intersect_kernel(size_t a_count, size_t b_count);
+SetKernel choose_unite_kernel(size_t a_count, size_t b_count);
+
+// Every kernel writes the ids of both lists, or the ids in both, to out in order and returns how many
+// there are. out has room for the shorter list when intersecting and for both when uniting. The
+// hash kernel only needs the longer list sorted.
+size_t intersect_merge(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out);
+size_t intersect_simd(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out);
+size_t intersect_hash(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out);
+size_t intersect_gallop(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out);
+size_t intersect(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out, SetKernel kernel);
+
+size_t unite_merge(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out);
+size_t unite_gallop(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out);
+size_t unite(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out, SetKernel kernel);
+
+std::vector<uint32_t> intersect(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b);
+std::vector<uint32_t> unite(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b);
+
+bool intersect_simd_supported();
+
+SetKernel choose_intersect_kernel(size_t a_count, size_t b_count) {
+  size_t shorter = std::min(a_count, b_count);
+  size_t longer  = std::max(a_count, b_count);
+  static const bool simd = intersect_simd_supported();
+  if (shorter == 0 || longer / shorter >= (simd ? INTERSECT_SIMD_GALLOP_RATIO : INTERSECT_GALLOP_RATIO)) return SetKernel::GALLOP;
+  return simd ? SetKernel::SIMD : SetKernel::MERGE;
+}
+
+SetKernel choose_unite_kernel(size_t a_count, size_t b_count) {
+  size_t shorter = std::min(a_count, b_count);
+  size_t longer  = std::max(a_count, b_count);
+  return shorter == 0 || longer / shorter >= UNITE_GALLOP_RATIO ? SetKernel::GALLOP : SetKernel::MERGE;
+}
+
+size_t intersect_merge(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out) {
+  size_t i = 0;
+  size_t j = 0;
+  size_t k = 0;
+  while (i < a_count && j < b_count) {
+    uint32_t x = a[i];
+    uint32_t y = b[j];
+    // written every time and kept only on a match, so there is no branch on it
+    out[k] = x;
+    k += x == y;
+    i += x <= y;
+    j += y <= x;
+  }
+  return k;
+}
+
+// the first index from start on where list is at least id, searching with doubling steps
+size_t gallop(const uint32_t* list, size_t count, size_t start, uint32_t id) {
+  if (start >= count) return count;
+  size_t low  = start;
+  size_t step = 1;
+  while (low + step < count && list[low + step] < id) {
+    low += step;
+    step *= 2;
+  }
+  if (list[low] >= id) return low;
+  return std::lower_bound(list + low + 1, list + std::min(low + step + 1, count), id) - list;
+}
+
+size_t intersect_gallop(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out) {
+  if (a_count > b_count) return intersect_gallop(b, b_count, a, a_count, out);
+
+  size_t position = 0;
+  size_t k        = 0;
+  for (size_t i = 0; i < a_count && position < b_count; i++) {
+    position = gallop(b, b_count, position, a[i]);
+    if (position < b_count && b[position] == a[i]) out[k++] = a[i];
+  }
+  return k;
+}
+
+// Buckets of four slots, with four times as many slots as ids so a bucket is rarely full. A lookup
+// compares the whole bucket without branching and only moves on to the next bucket when this one is
+// full. Free slots hold the largest id, which is looked up on its own.
+size_t intersect_hash(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out) {
+  if (a_count > b_count) return intersect_hash(b, b_count, a, a_count, out);
+  if (a_count == 0) return 0;
+
+  const uint32_t FREE = UINT32_MAX;
+  size_t buckets      = 1;
+  while (buckets < a_count) buckets *= 2;
+  std::vector<uint32_t> table(4 * buckets, FREE);
+  auto bucket = [buckets](uint32_t id) { return (size_t)((id * 0x9e3779b97f4a7c15ull) >> 32) & (buckets - 1); };
+
+  bool has_free = false;
+  for (size_t i = 0; i < a_count; i++) {
+    if (a[i] == FREE) {
+      has_free = true;
+      continue;
+    }
+    uint32_t* slots = &table[4 * bucket(a[i])];
+    while (slots[3] != FREE) slots = &table[(slots - table.data() + 4) & (4 * buckets - 1)];
+    *std::find(slots, slots + 4, FREE) = a[i];
+  }
+
+  // the long list is walked in order, so the output is sorted too
+  size_t k = 0;
+  for (size_t j = 0; j < b_count; j++) {
+    uint32_t id           = b[j];
+    const uint32_t* slots = &table[4 * bucket(id)];
+    bool found            = (slots[0] == id) | (slots[1] == id) | (slots[2] == id) | (slots[3] == id);
+    while (!found && slots[3] != FREE) {
+      slots = &table[(slots - table.data() + 4) & (4 * buckets - 1)];
+      found = (slots[0] == id) | (slots[1] == id) | (slots[2] == id) | (slots[3] == id);
+    }
+    // out holds no more than the short list, so only a hit is written
+    if (id == FREE ? has_free : found) out[k++] = id;
+  }
+  return k;
+}
+
+size_t intersect(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out, SetKernel kernel) {
+  switch (kernel) {
+    case SetKernel::MERGE:
+      return intersect_merge(a, a_count, b, b_count, out);
+    case SetKernel::SIMD:
+      return intersect_simd(a, a_count, b, b_count, out);
+    case SetKernel::HASH:
+      return intersect_hash(a, a_count, b, b_count, out);
+    case SetKernel::GALLOP:
+      return intersect_gallop(a, a_count, b, b_count, out);
+  }
+  return 0;
+}
+
+size_t unite_merge(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out) {
+  return std::set_union(a, a + a_count, b, b + b_count, out) - out;
+}
+
+// copies the long list in stretches between the ids of the short one
+size_t unite_gallop(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out) {
+  if (a_count > b_count) return unite_gallop(b, b_count, a, a_count, out);
+
+  size_t position = 0;
+  uint32_t* next  = out;
+  for (size_t i = 0; i < a_count; i++) {
+    size_t end = gallop(b, b_count, position, a[i]);
+    next       = std::copy(b + position, b + end, next);
+    *next++    = a[i];
+    position   = end < b_count && b[end] == a[i] ? end + 1 : end;
+  }
+  next = std::copy(b + position, b + b_count, next);
+  return next - out;
+}
+
+size_t unite(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out, SetKernel kernel) {
+  if (kernel == SetKernel::GALLOP) return unite_gallop(a, a_count, b, b_count, out);
+  return unite_merge(a, a_count, b, b_count, out);
+}
+
+std::vector<uint32_t> intersect(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+  std::vector<uint32_t> out(std::min(a.size(), b.size()));
+  out.resize(intersect(a.data(), a.size(), b.data(), b.size(), out.data(), choose_intersect_kernel(a.size(), b.size())));
+  return out;
+}
+
+std::vector<uint32_t> unite(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+  std::vector<uint32_t> out(a.size() + b.size());
+  out.resize(unite(a.data(), a.size(), b.data(), b.size(), out.data(), choose_unite_kernel(a.size(), b.size())));
+  return out;
+}
+
+#ifdef INTERSECT_X86
+
+// Compares four ids of each list at once: the block of b is rotated three times so every id of a
+// meets every id of b, and the block whose last id is smaller moves on.
+__attribute__((target("sse2"))) size_t intersect_simd(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out) {
+  size_t i = 0;
+  size_t j = 0;
+  size_t k = 0;
+  while (i + 4 <= a_count && j + 4 <= b_count) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+
+    __m128i equal = _mm_cmpeq_epi32(x, y);
+    equal         = _mm_or_si128(equal, _mm_cmpeq_epi32(x, _mm_shuffle_epi32(y, 0x39)));
+    equal         = _mm_or_si128(equal, _mm_cmpeq_epi32(x, _mm_shuffle_epi32(y, 0x4e)));
+    equal         = _mm_or_si128(equal, _mm_cmpeq_epi32(x, _mm_shuffle_epi32(y, 0x93)));
+    for (int mask = _mm_movemask_ps(_mm_castsi128_ps(equal)); mask != 0; mask &= mask - 1) {
+      out[k++] = a[i + __builtin_ctz(mask)];
+    }
+
+    uint32_t a_last = a[i + 3];
+    uint32_t b_last = b[j + 3];
+    i += a_last <= b_last ? 4 : 0;
+    j += b_last <= a_last ? 4 : 0;
+  }
+  return k + intersect_merge(a + i, a_count - i, b + j, b_count - j, out + k);
+}
+
+bool intersect_simd_supported() {
+  return __builtin_cpu_supports("sse2");
+}
+
+#else
+
+size_t intersect_simd(const uint32_t* a, size_t a_count, const uint32_t* b, size_t b_count, uint32_t* out) {
+  return intersect_merge(a, a_count, b, b_count, out);
+}
+
+bool intersect_simd_supported() {
+  return false;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef _LINE_READER_H_
+#define _LINE_READER_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include <unistd.h>
+
+struct LinePiece {
+  std::string_view text;
+  // the line continues in the next piece
+  bool more;
+  // bytes at the start of text that were already part of the previous piece
+  size_t carried;
+};
+
+// Splits a descriptor into lines using a fixed size buffer. Lines that don't fit are handed out in
+// pieces, each starting with the last `overlap` bytes of the previous one, so memory stays bounded
+// by the buffer no matter how long a line gets.
+class LineReader {
+public:
+  LineReader(int fd, size_t capacity, size_t overlap);
+
+  // text stays valid until the next call
+  bool next(LinePiece& piece);
+
+private:
+  bool fill();
+
+  int fd;
+  std::vector<char> buffer;
+  size_t overlap;
+  size_t begin   = 0;
+  size_t end     = 0;
+  // bytes after begin that are known not to contain a newline
+  size_t scanned = 0;
+  size_t carried = 0;
+  bool eof       = false;
+};
+
+LineReader::LineReader(int fd, size_t capacity, size_t overlap) : fd(fd), buffer(std::max(capacity, overlap + 1)), overlap(overlap) {}
+
+bool LineReader::next(LinePiece& piece) {
+  while (true) {
+    const char* start   = buffer.data() + begin;
+    const char* newline = static_cast<const char*>(std::memchr(start + scanned, '\n', end - begin - scanned));
+
+    if (newline) {
+      piece   = {std::string_view(start, newline - start), false, carried};
+      begin   = newline - buffer.data() + 1;
+      scanned = 0;
+      carried = 0;
+      return true;
+    }
+    scanned = end - begin;
+
+    if (eof) {
+      if (begin == end) return false;
+      piece   = {std::string_view(start, end - begin), false, carried};
+      begin   = end;
+      scanned = 0;
+      carried = 0;
+      return true;
+    }
+
+    if (begin > 0) {
+      std::memmove(buffer.data(), start, end - begin);
+      end -= begin;
+      begin = 0;
+    }
+
+    if (end == buffer.size()) {
+      piece = {std::string_view(buffer.data(), end), true, carried};
+      // keep the tail around so an identifier that straddles the boundary is still found
+      carried = std::min(overlap, end);
+      begin   = end - carried;
+      scanned = carried;
+      return true;
+    }
+
+    if (!fill()) eof = true;
+  }
+}
+
+bool LineReader::fill() {
+  while (true) {
+    ssize_t n = read(fd, buffer.data() + end, buffer.size() - end);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    end += n;
+    return n > 0;
+  }
+}
+
+#endif
@@ -1,25 +1,178 @@
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <filesystem>
-#include <fstream>
+#include <thread>
+#include <unordered_map>
 
 #include "argtable3.h"
+#include "bloom_cache.h"
+#include "chunks.h"
+#include "index.h"
+#include "line_reader.h"
+#include "mapped_file.h"
+#include "output.h"
 #include "parser.h"
-#include "termcolor.hpp"
+#include "planner.h"
+#include "prefetch.h"
+#include "query.h"
+#include "ring.h"
+#include "scheduler.h"
+#include "sequencer.h"
+#include "walker.h"
 
-bool handle_file(const std::filesystem::path& path, Parser& p);
-bool handle_directory(const std::filesystem::path& directory, Parser& p);
-void handle_file_println(const std::filesystem::path& path, const size_t line_num, const std::string& line);
-void handle_stdin_println(const size_t line_num, const std::string& line);
+// the number of bytes at the start of a file that are inspected to decide if it is binary
+#define BINARY_CHECK_SIZE 8192
+// megabytes per second a compaction of the index reads and writes by default
+#define COMPACT_RATE_MB 64
+// megabytes the builders of an index build hold in all by default before they spill runs to disk
+#define BUILD_MEMORY_MB 1024
+// a parallel build splits the files into this many shards per thread, so threads that got small
+// files go on with more
+#define BUILD_SHARDS_PER_THREAD 4
+// lines longer than this are searched piece by piece and only a preview of them is printed
+#define LONG_LINE_SIZE (1 << 20)
+// size of the pieces a long line is searched in, small enough to stay in cache across all identifiers
+#define LONG_LINE_CHUNK (1 << 16)
+// how much of a long line is printed
+#define LONG_LINE_PREVIEW 256
+// discovered files waiting for the search stage, walkers block once this many are queued
+#define WALK_QUEUE_SIZE 4096
+// default size of the pieces big files are split into so several threads can search them
+#define CHUNK_SIZE_MB 64
+// output a chunk may hold on to while it waits for the chunks before it to be written
+#define CHUNK_OUTPUT_LIMIT (4 << 20)
+// how many files a worker may get ahead of the one whose output is being written
+#define SEQUENCE_WINDOW 1024
+// output of files further ahead that may wait in memory before their workers block
+#define SEQUENCE_MAX_BYTES (64 << 20)
+// a file is searched at the latest once this many files found after it were scheduled before it
+#define SCHEDULE_WINDOW 256
+
+static_assert(SCHEDULE_WINDOW <= SEQUENCE_WINDOW, "files held back by the scheduler must stay within the sequencer's window");
+
+struct SearchOptions {
+  // print "Binary file FILE matches" on the first hit instead of skipping binary files
+  bool report_binary = false;
+  // threads expanding directories during a recursive search
+  size_t walk_threads = 1;
+  // threads opening and mapping the files of a recursive walk
+  size_t read_threads = 1;
+  // threads searching the files of a recursive walk
+  size_t threads = 1;
+  // files bigger than this are split into chunks that are searched by several threads
+  size_t chunk_size = (size_t)CHUNK_SIZE_MB << 20;
+  // search files of a recursive walk in path order instead of discovery order
+  bool sort = false;
+  // print the queue counters of every pipeline stage to stderr
+  bool stats = false;
+  // skip what .gitignore and .ignore files exclude
+  bool ignore = true;
+  // names of the files of a recursive walk that are searched
+  NameFilter filter;
+  // descend into symlinked directories, searching every file once
+  bool follow = false;
+  // stay on the filesystem of the searched directory
+  bool one_file_system = false;
+  // answer queries on directories from their index instead of walking them
+  bool use_index = false;
+  // trigram filters of files searched before, files they rule out aren't opened
+  BloomCache* cache = nullptr;
+  // helpers with the chunks of big files, none if nullptr
+  ChunkPool* chunk_pool = nullptr;
+  // bytes per second a compaction of the index may read and write, 0 for no limit
+  uint64_t compact_rate = (uint64_t)COMPACT_RATE_MB << 20;
+  // compact after an index update before returning, instead of in the background
+  bool compact_wait = false;
+  // bytes all threads of an index build may hold before they write what they have to disk
+  uint64_t build_memory = (uint64_t)BUILD_MEMORY_MB << 20;
+};
+
+// a file of a recursive walk, seq is its position in the walk and the output, order its position in
+// the order files are searched in
+struct WalkedFile {
+  size_t seq;
+  size_t order;
+  std::string path;
+};
+
+// a file of a recursive walk that the read stage opened and mapped
+struct ReadFile {
+  size_t seq;
+  std::string path;
+  // nullptr if it couldn't be opened
+  std::shared_ptr<MappedFile> file;
+};
+
+// the files of an index segment that may have matching lines, one after the other in path order
+struct IndexCursor {
+  size_t segment;
+  LineMatch match;
+  Bitmap files;
+  // where the search for the next one starts
+  uint32_t next = 0;
+  // the file found, with the mtime the index has for it
+  uint32_t file = 0;
+  int64_t mtime = 0;
+};
+
+bool is_binary(std::string_view block);
+void feed_long_line(const Query& query, QueryScratch& scratch, std::string_view text);
+std::string long_line_preview(std::string_view start, size_t length);
+bool handle_stdin(const Query& query, OutputBuffer& out);
+bool handle_file(const std::filesystem::path& path, const Query& query, QueryScratch& scratch, const SearchOptions& options, OutputBuffer& out);
+bool handle_mapped_file(const std::string& path, std::shared_ptr<MappedFile> file, const Query& query, QueryScratch& scratch, const SearchOptions& options, OutputBuffer& out);
+bool handle_chunked_file(const std::string& path, std::shared_ptr<MappedFile> file, const Query& query, const SearchOptions& options, OutputBuffer& out);
+void scan_lines(std::string_view contents, size_t line_num, const std::string& path, std::string_view prefix, bool binary, const Query& query, QueryScratch& scratch, OutputBuffer& out);
+EvalStatus eval_line(std::string_view line, const Query& query, QueryScratch& scratch, bool* result);
+bool handle_directory(const std::string& directory, const Query& query, const SearchOptions& options, OutputBuffer& out);
+int index_main(int argc, char** argv);
+std::vector<std::string> index_files(const std::string& directory, const SearchOptions& options);
+bool build_index(const std::string& directory, const SearchOptions& options);
+bool update_index(const std::string& directory, const SearchOptions& options);
+bool compact_index(const std::string& directory, bool all, const SearchOptions& options);
+void compact_in_background(const std::string& directory, const SearchOptions& options);
+std::string new_segment_name(const std::string& index_directory);
+bool advance_index_cursor(const Index& index, IndexCursor& cursor);
+bool handle_index(const std::string& directory, const Query& query, const SearchOptions& options, OutputBuffer& out);
+bool explain_index(const std::string& directory, const Query& query);
+void search_index_file(const std::string& path, const IndexFileEntry& entry, int64_t mtime, const std::vector<uint32_t>& lines, const Bitmap& yes, const Query& query, QueryScratch& scratch, const SearchOptions& options, OutputBuffer& out);
+bool cache_rules_out(const std::string& path, const Query& query, const SearchOptions& options);
+void read_files(RingBuffer<WalkedFile>& walked, RingBuffer<ReadFile>& read, std::atomic<size_t>& turn, const PrefetchWindow& prefetch, const Query& query, const SearchOptions& options);
+void search_files(RingBuffer<ReadFile>& read, const Query& query, const SearchOptions& options, OutputBuffer& out, Sequencer& sequencer, PrefetchWindow& prefetch);
+void print_ring_stats(const char* stage, const RingStats& stats, size_t capacity);
+void handle_file_println(OutputBuffer& out, std::string_view prefix, const size_t line_num, std::string_view line);
+void handle_stdin_println(OutputBuffer& out, std::string_view prefix, const size_t line_num, std::string_view line);
 
 int main(int argc, char** argv) {
+  if (argc > 1 && std::strcmp(argv[1], "index") == 0) return index_main(argc, argv);
+
   struct arg_lit* recursive_arg = arg_lit0("r", "recursive", "recusivly search given directories");
   struct arg_lit* help_arg      = arg_lit0("h", "help", "display this help and exit");
   struct arg_lit* debug_arg     = arg_lit0("d", "debug", "outputs a dot file from the given EXPR");
+  struct arg_lit* explain_arg   = arg_lit0(NULL, "explain", "print how the index of every directory would answer EXPR");
+  struct arg_lit* binary_arg    = arg_lit0(NULL, "binary", "report binary files that match instead of skipping them");
+  struct arg_int* walkers_arg   = arg_int0(NULL, "walk-threads", "N", "number of threads walking directories (default: number of cores)");
+  struct arg_int* readers_arg   = arg_int0(NULL, "read-threads", "N", "number of threads opening and mapping files (default: 1)");
+  struct arg_lit* sort_arg      = arg_lit0(NULL, "sort", "search files in path order, output is the same on every run");
+  struct arg_lit* no_ignore_arg = arg_lit0(NULL, "no-ignore", "don't skip files excluded by .gitignore and .ignore files");
+  struct arg_str* include_arg   = arg_strn(NULL, "include", "GLOB", 0, argc, "only search files whose name matches GLOB");
+  struct arg_str* exclude_arg   = arg_strn(NULL, "exclude", "GLOB", 0, argc, "skip files whose name matches GLOB");
+  struct arg_str* type_arg      = arg_strn(NULL, "type", "TYPE", 0, argc, "only search files of TYPE, like cpp, py or md");
+  struct arg_lit* follow_arg    = arg_lit0("L", "follow", "follow symlinked directories, search every file only once");
+  struct arg_lit* one_fs_arg    = arg_lit0(NULL, "one-file-system", "don't descend into directories on other filesystems");
+  struct arg_int* threads_arg   = arg_int0("j", "threads", "N", "number of threads searching files (default: number of cores)");
+  struct arg_int* chunk_arg     = arg_int0(NULL, "chunk-size", "MB", "split files bigger than this between threads (default: 64)");
+  struct arg_lit* stats_arg     = arg_lit0(NULL, "stats", "print queue statistics of every search stage to stderr");
+  struct arg_lit* index_arg     = arg_lit0(NULL, "index", "answer from the index of every directory (see 'index build')");
+  struct arg_file* cache_arg    = arg_file0(NULL, "cache", "FILE", "skip files FILE's filters rule out, and keep filters of the files searched in it");
   struct arg_str* expr_arg      = arg_str1(NULL, NULL, "EXPR", "The expression that is used to search");
   struct arg_file* file_arg     = arg_filen(NULL, NULL, "FILE", 0, argc + 2, "The file or directory (if has -r option) to search from");
   struct arg_end* end           = arg_end(20);
 
-  void* argtable[] = {recursive_arg, help_arg, debug_arg, expr_arg, file_arg, end};
+  void* argtable[] = {recursive_arg, help_arg, debug_arg, explain_arg, binary_arg, walkers_arg, readers_arg, sort_arg, no_ignore_arg, include_arg, exclude_arg, type_arg, follow_arg, one_fs_arg, threads_arg, chunk_arg, stats_arg, index_arg, cache_arg, expr_arg, file_arg, end};
 
   if (arg_nullcheck(argtable) != 0) {
     std::cerr << argv[0] << ": insufficient memory\n";
@@ -35,7 +188,9 @@ int main(int argc, char** argv) {
     arg_print_glossary(stdout, argtable, "  %-25s %s\n");
 
     std::cout << "\n"
-              << "When FILE is absent, read in input from standard input. Read from \".\", if -r option is specified.\n";
+              << "When FILE is absent, read in input from standard input. Read from \".\", if -r option is specified.\n"
+              << "Run '" << argv[0] << " index build DIR' to index DIR for --index, 'index update DIR' after files changed.\n"
+              << "Updates merge the index's segments in the background, 'index compact DIR' merges them right away.\n";
 
     arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
     return 0;
@@ -71,86 +226,1027 @@ int main(int argc, char** argv) {
     return 0;
   }
 
-  if (file_arg->count == 0) {
-    if (recursive_arg->count > 0) {
-      handle_directory(".", p);
-    } else {
-      std::string line;
-      int line_num = 1;
-      while (std::getline(std::cin, line)) {
-        bool result;
-        EvalStatus eval_status = p.eval(line, &result);
-
-        if (eval_status != EvalStatus::OK) {
-          line_num++;
-          continue;
-        }
+  Query query;
+  if (query.compile(p) != EvalStatus::OK) {
+    arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+    return 1;
+  }
 
-        if (result) {
-          handle_stdin_println(line_num, line);
-        }
-        line_num++;
+  if (explain_arg->count > 0) {
+    bool ok = true;
+    if (file_arg->count == 0) ok = explain_index(".", query);
+    for (int i = 0; i < file_arg->count; i++) {
+      ok = explain_index(file_arg->filename[i], query) && ok;
+    }
+    arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+    return ok ? 0 : 1;
+  }
+
+  size_t cores = std::max(std::thread::hardware_concurrency(), 1u);
+
+  SearchOptions options;
+  options.report_binary   = binary_arg->count > 0;
+  options.walk_threads    = walkers_arg->count > 0 ? std::max(walkers_arg->ival[0], 1) : cores;
+  options.read_threads    = readers_arg->count > 0 ? std::max(readers_arg->ival[0], 1) : 1;
+  options.threads         = threads_arg->count > 0 ? std::max(threads_arg->ival[0], 1) : cores;
+  options.sort            = sort_arg->count > 0;
+  options.chunk_size      = (size_t)(chunk_arg->count > 0 ? std::max(chunk_arg->ival[0], 1) : CHUNK_SIZE_MB) << 20;
+  options.stats           = stats_arg->count > 0;
+  options.ignore          = no_ignore_arg->count == 0;
+  options.follow          = follow_arg->count > 0;
+  options.one_file_system = one_fs_arg->count > 0;
+  options.use_index       = index_arg->count > 0;
+  // which of several links to the same file is searched depends on which walker gets there first
+  if (options.sort && options.follow) options.walk_threads = 1;
+
+  for (int i = 0; i < include_arg->count; i++) {
+    options.filter.add(include_arg->sval[i], NameFilter::INCLUDE);
+  }
+  for (int i = 0; i < exclude_arg->count; i++) {
+    options.filter.add(exclude_arg->sval[i], NameFilter::EXCLUDE);
+  }
+  for (int i = 0; i < type_arg->count; i++) {
+    if (!options.filter.add_type(type_arg->sval[i])) {
+      std::cerr << "Unknown file type: " << type_arg->sval[i] << "\nKnown types:";
+      for (const FileType& file_type : FILE_TYPES) {
+        std::cerr << ' ' << file_type.name;
       }
+      std::cerr << '\n';
+      arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+      return 1;
+    }
+  }
+  options.filter.compile();
+
+  BloomCache cache;
+  if (cache_arg->count > 0) {
+    cache.open(cache_arg->filename[0]);
+    options.cache = &cache;
+  }
+  // the search threads themselves take part, so there is one helper less
+  ChunkPool chunk_pool(options.threads - 1);
+  options.chunk_pool = &chunk_pool;
+
+  OutputBuffer out(STDOUT_FILENO, isatty(STDOUT_FILENO));
+
+  if (file_arg->count == 0) {
+    if (options.use_index) {
+      handle_index(".", query, options, out);
+    } else if (recursive_arg->count > 0) {
+      handle_directory(".", query, options, out);
+    } else {
+      handle_stdin(query, out);
     }
   } else {
+    QueryScratch scratch = query.scratch();
     for (int i = 0; i < file_arg->count; i++) {
       const char* filename = file_arg->filename[i];
       if (std::filesystem::is_directory(filename)) {
-        if (recursive_arg->count > 0) {
-          handle_directory(filename, p);
+        if (options.use_index) {
+          handle_index(filename, query, options, out);
+        } else if (recursive_arg->count > 0) {
+          handle_directory(filename, query, options, out);
         } else {
-          std::cout << argv[0] << ": " << filename << ": Is a directory\n";
+          out.flush();
+          std::cout << argv[0] << ": " << filename << ": Is a directory" << std::endl;
         }
       } else if (std::filesystem::is_regular_file(filename)) {
-        handle_file(filename, p);
+        handle_file(filename, query, scratch, options, out);
       } else {
-        std::cout << "'" << filename << "' is not a valid file\n";
+        out.flush();
+        std::cout << "'" << filename << "' is not a valid file" << std::endl;
       }
     }
   }
 
+  out.flush();
+  if (options.cache && !cache.save()) std::cerr << cache_arg->filename[0] << ": can't write the cache\n";
   arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
 
   return 0;
 }
 
-bool handle_file(const std::filesystem::path& path, Parser& p) {
-  std::ifstream file(path);
-  if (!file) return false;
+bool is_binary(std::string_view block) {
+  return std::memchr(block.data(), '\0', block.size()) != nullptr;
+}
+
+void feed_long_line(const Query& query, QueryScratch& scratch, std::string_view text) {
+  size_t overlap = std::max<size_t>(query.max_id_length(), 1) - 1;
+
+  while (text.size() > LONG_LINE_CHUNK) {
+    query.eval_feed(text.substr(0, LONG_LINE_CHUNK), scratch);
+    text.remove_prefix(LONG_LINE_CHUNK - std::min<size_t>(overlap, LONG_LINE_CHUNK - 1));
+  }
+  query.eval_feed(text, scratch);
+}
+
+std::string long_line_preview(std::string_view start, size_t length) {
+  std::string preview(start.substr(0, LONG_LINE_PREVIEW));
+  preview.append(" [... ").append(std::to_string(length)).append(" bytes]");
+  return preview;
+}
+
+bool handle_stdin(const Query& query, OutputBuffer& out) {
+  std::string prefix   = out.stdin_prefix();
+  QueryScratch scratch = query.scratch();
+  LineReader reader(STDIN_FILENO, LONG_LINE_SIZE, std::max<size_t>(query.max_id_length(), 1) - 1);
 
-  std::string line;
-  int line_num = 1;
-  while (std::getline(file, line)) {
+  // state of a line that arrives in several pieces
+  bool long_line = false;
+  std::string preview_start;
+  size_t length = 0;
+
+  LinePiece piece;
+  size_t line_num = 1;
+  while (reader.next(piece)) {
     bool result;
-    EvalStatus eval_status = p.eval(line, &result);
+    EvalStatus eval_status;
+
+    if (!long_line && !piece.more) {
+      eval_status = query.eval(piece.text, scratch, &result);
+      if (eval_status == EvalStatus::OK && result) {
+        handle_stdin_println(out, prefix, line_num, piece.text);
+      }
+      line_num++;
+      continue;
+    }
+
+    if (!long_line) {
+      long_line = true;
+      preview_start.assign(piece.text.substr(0, LONG_LINE_PREVIEW));
+      length = 0;
+      query.eval_begin(scratch);
+    }
+    feed_long_line(query, scratch, piece.text);
+    length += piece.text.size() - piece.carried;
+
+    if (piece.more) continue;
+
+    long_line   = false;
+    eval_status = query.eval_end(scratch, &result);
+    if (eval_status == EvalStatus::OK && result) {
+      handle_stdin_println(out, prefix, line_num, long_line_preview(preview_start, length));
+    }
+    line_num++;
+  }
+
+  return true;
+}
+
+bool handle_file(const std::filesystem::path& path, const Query& query, QueryScratch& scratch, const SearchOptions& options, OutputBuffer& out) {
+  if (cache_rules_out(path.string(), query, options)) return true;
+  auto file = std::make_shared<MappedFile>();
+  if (!file->open(path.c_str())) return false;
+
+  return handle_mapped_file(path.string(), file, query, scratch, options, out);
+}
+
+bool handle_mapped_file(const std::string& path, std::shared_ptr<MappedFile> file, const Query& query, QueryScratch& scratch, const SearchOptions& options, OutputBuffer& out) {
+  std::string_view contents = file->view();
+
+  // only the first block is inspected, binary files are skipped without touching the rest of them
+  bool binary = is_binary(contents.substr(0, BINARY_CHECK_SIZE));
+
+  // a file without an up to date filter gets one now that it is read anyway, a binary file gets an
+  // entry without one so it is never read for it
+  struct stat st;
+  if (options.cache && fstat(file->descriptor(), &st) == 0) {
+    int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    bool stale    = !options.cache->fresh(path, mtime, st.st_size);
+    if (stale && binary) options.cache->update_unfiltered(path, mtime, st.st_size);
+    if (stale && !binary) options.cache->update(path, mtime, st.st_size, contents);
+  }
+  if (binary && !options.report_binary) return true;
+
+  if (!binary && options.threads > 1 && contents.size() > options.chunk_size) {
+    return handle_chunked_file(path, file, query, options, out);
+  }
+
+  std::string prefix = out.file_prefix(path);
+  // matched lines point into the mapping, the output buffer keeps it alive until they are written
+  out.set_source(file);
+  scan_lines(contents, 1, path, prefix, binary, query, scratch, out);
+  out.set_source(nullptr);
+  return true;
+}
+
+// whether the cache knows the file as it is now and its filter has no line that can match
+bool cache_rules_out(const std::string& path, const Query& query, const SearchOptions& options) {
+  struct stat st;
+  if (!options.cache || stat(path.c_str(), &st) != 0) return false;
+  int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  return !options.cache->may_match(path, mtime, st.st_size, query);
+}
+
+bool handle_chunked_file(const std::string& path, std::shared_ptr<MappedFile> file, const Query& query, const SearchOptions& options, OutputBuffer& out) {
+  std::vector<std::string_view> chunks = split_chunks(file->view(), options.chunk_size);
+  std::string prefix                   = out.file_prefix(path);
+  ChunkOrder order(chunks.size());
+  std::atomic<size_t> next{0};
+
+  // whatever this worker wrote before has to come out before the first chunk
+  out.flush();
+
+  auto work = [&]() {
+    QueryScratch scratch = query.scratch();
+
+    size_t index;
+    while ((index = next.fetch_add(1)) < chunks.size()) {
+      std::string_view chunk = chunks[index];
+      size_t first_line      = order.first_line(index, std::count(chunk.begin(), chunk.end(), '\n'));
+
+      OutputBuffer chunk_out(out.descriptor(), out.has_color(), out.get_lock());
+      chunk_out.set_sink(out.get_sink());
+      chunk_out.set_source(file);
+      chunk_out.set_limit(CHUNK_OUTPUT_LIMIT);
+      chunk_out.set_gate([&order, index]() { order.wait_turn(index); });
+
+      scan_lines(chunk, first_line, path, prefix, false, query, scratch, chunk_out);
+
+      order.wait_turn(index);
+      chunk_out.flush();
+      order.finish(index);
+    }
+  };
 
-    if (eval_status != EvalStatus::OK) {
+  // the helpers that are idle right now join in, this thread searches what they don't take
+  std::mutex lock;
+  std::condition_variable done;
+  size_t helping = 0;
+  for (size_t i = 1; i < std::min(options.threads, chunks.size()) && options.chunk_pool; i++) {
+    std::lock_guard<std::mutex> guard(lock);
+    bool started = options.chunk_pool->try_run([&]() {
+      work();
+      std::lock_guard<std::mutex> guard(lock);
+      if (--helping == 0) done.notify_all();
+    });
+    if (!started) break;
+    helping++;
+  }
+  work();
+
+  std::unique_lock<std::mutex> guard(lock);
+  done.wait(guard, [&helping] { return helping == 0; });
+  return true;
+}
+
+// searches contents line by line, the first line is numbered line_num
+void scan_lines(std::string_view contents, size_t line_num, const std::string& path, std::string_view prefix, bool binary, const Query& query, QueryScratch& scratch, OutputBuffer& out) {
+  while (!contents.empty()) {
+    size_t end            = contents.find('\n');
+    std::string_view line = contents.substr(0, end);
+    contents.remove_prefix(end == std::string_view::npos ? contents.size() : end + 1);
+
+    bool result;
+    if (eval_line(line, query, scratch, &result) != EvalStatus::OK) {
       line_num++;
       continue;
     }
 
     if (result) {
-      handle_file_println(path, line_num, line);
+      if (binary) {
+        out.append("Binary file ");
+        out.append(path);
+        out.append(" matches\n");
+        break;
+      }
+      if (line.size() > LONG_LINE_SIZE) {
+        handle_file_println(out, prefix, line_num, long_line_preview(line, line.size()));
+      } else {
+        handle_file_println(out, prefix, line_num, line);
+      }
     }
     line_num++;
   }
+}
+
+// evaluates one line, a long one in pieces
+EvalStatus eval_line(std::string_view line, const Query& query, QueryScratch& scratch, bool* result) {
+  if (line.size() <= LONG_LINE_SIZE) return query.eval(line, scratch, result);
+  query.eval_begin(scratch);
+  feed_long_line(query, scratch, line);
+  return query.eval_end(scratch, result);
+}
+
+// The search of a directory is a pipeline of four stages connected by lock free rings:
+//
+//   traversal (--walk-threads) -> read (--read-threads) -> match (-j) -> output (one writer)
+//
+// Files are numbered in the order the traversal finds them. With several matchers the scheduler lets
+// the biggest files of a bounded window go first, the sequencer of the output stage puts their output
+// back into walk order.
+bool handle_directory(const std::string& directory, const Query& query, const SearchOptions& options, OutputBuffer& out) {
+  bool schedule = options.threads > 1;
+  WalkOptions walk_options;
+  walk_options.sizes           = schedule;
+  walk_options.ignore          = options.ignore;
+  walk_options.filter          = options.filter.empty() ? nullptr : &options.filter;
+  walk_options.follow          = options.follow;
+  walk_options.one_file_system = options.one_file_system;
+  Walker walker(options.walk_threads, walk_options);
+  RingBuffer<WalkedFile> walked(WALK_QUEUE_SIZE);
+  RingBuffer<ReadFile> read(options.threads * PREFETCH_MAX_WINDOW);
+  Sequencer sequencer(SEQUENCE_WINDOW, SEQUENCE_MAX_BYTES);
+  PrefetchWindow prefetch;
+
+  walked.set_sample_depth(options.stats);
+  read.set_sample_depth(options.stats);
+  sequencer.set_sample_depth(options.stats);
+
+  // everything written so far has to come out before the writer thread starts
+  out.flush();
+
+  // the walk runs in the background while files are searched as they come in
+  std::thread walk_thread([&]() {
+    size_t seq   = 0;
+    size_t order = 0;
+    // the sequencer relies on one matcher always being free to take the file it writes next
+    Scheduler scheduler(SCHEDULE_WINDOW, options.threads - 1);
+
+    auto add = [&](std::string path, size_t size) {
+      if (!schedule) {
+        walked.push({seq++, order++, std::move(path)});
+        return;
+      }
+      scheduler.add({seq++, std::move(path), size});
+      while (scheduler.ready()) {
+        ScheduledFile file = scheduler.take();
+        walked.push({file.seq, order++, std::move(file.path)});
+      }
+    };
+
+    if (options.sort) {
+      std::mutex lock;
+      std::vector<std::pair<std::string, size_t>> sorted;
+      walker.walk(directory, [&](std::string path, size_t size) {
+        std::lock_guard<std::mutex> guard(lock);
+        sorted.emplace_back(std::move(path), size);
+      });
+
+      std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return path_less(a.first, b.first); });
+      for (auto& [path, size] : sorted) {
+        add(std::move(path), size);
+      }
+    } else {
+      // walkers take turns so files are numbered in the order they are added, the push itself doesn't lock
+      std::mutex lock;
+      walker.walk(directory, [&](std::string path, size_t size) {
+        std::lock_guard<std::mutex> guard(lock);
+        add(std::move(path), size);
+      });
+    }
+
+    while (!scheduler.empty()) {
+      ScheduledFile file = scheduler.take();
+      walked.push({file.seq, order++, std::move(file.path)});
+    }
+    walked.close();
+  });
+
+  std::atomic<size_t> read_turn{0};
+  std::vector<std::thread> readers;
+  for (size_t i = 0; i < options.read_threads; i++) {
+    readers.emplace_back([&]() { read_files(walked, read, read_turn, prefetch, query, options); });
+  }
 
+  std::vector<std::thread> matchers;
+  for (size_t i = 0; i < options.threads; i++) {
+    matchers.emplace_back([&]() {
+      OutputBuffer worker_out(out.descriptor(), out.has_color());
+      search_files(read, query, options, worker_out, sequencer, prefetch);
+    });
+  }
+
+  std::thread writer([&]() { sequencer.run(out); });
+
+  walk_thread.join();
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  read.close();
+  for (std::thread& matcher : matchers) {
+    matcher.join();
+  }
+  sequencer.close();
+  writer.join();
+
+  if (options.stats) {
+    print_ring_stats("traversal -> read", walked.stats(), walked.capacity());
+    print_ring_stats("read -> match", read.stats(), read.capacity());
+    print_ring_stats("match -> output", sequencer.stats(), sequencer.ring_capacity());
+  }
   return true;
 }
 
-bool handle_directory(const std::filesystem::path& directory, Parser& p) {
-  for (const std::filesystem::directory_entry& entry : std::filesystem::recursive_directory_iterator(directory)) {
-    if (entry.is_regular_file()) {
-      handle_file(entry.path(), p);
+// "bool-search index build DIR" writes the index --index answers from, "index update DIR" brings it
+// up to date with the files that changed since and "index compact DIR" merges its segments. It takes
+// the walk options of a search, files that search would skip are not indexed.
+int index_main(int argc, char** argv) {
+  struct arg_str* command_arg   = arg_str1(NULL, NULL, "build|update|compact", "build a new index, update or compact the one there is");
+  struct arg_file* dir_arg      = arg_file0(NULL, NULL, "DIR", "the directory to index (default: .)");
+  struct arg_lit* help_arg      = arg_lit0("h", "help", "display this help and exit");
+  struct arg_lit* no_ignore_arg = arg_lit0(NULL, "no-ignore", "don't skip files excluded by .gitignore and .ignore files");
+  struct arg_lit* all_arg       = arg_lit0(NULL, "all", "compact: merge all segments into one");
+  struct arg_lit* wait_arg      = arg_lit0(NULL, "wait", "update: compact before returning instead of in the background");
+  struct arg_int* rate_arg      = arg_int0(NULL, "rate", "MB", "megabytes per second a compaction reads and writes (default: 64, 0: no limit)");
+  struct arg_int* threads_arg   = arg_int0("j", "threads", "N", "build: number of threads indexing files (default: number of cores)");
+  struct arg_int* memory_arg    = arg_int0(NULL, "memory", "MB", "build: megabytes held before runs are spilled to disk (default: 1024)");
+  struct arg_end* end           = arg_end(20);
+
+  void* argtable[] = {command_arg, dir_arg, help_arg, no_ignore_arg, all_arg, wait_arg, rate_arg, threads_arg, memory_arg, end};
+  std::string name = std::string(argv[0]) + " index";
+
+  if (arg_nullcheck(argtable) != 0) {
+    std::cerr << name << ": insufficient memory\n";
+    return 1;
+  }
+
+  // the first argument, "index", takes the place of the program name
+  int nerr = arg_parse(argc - 1, argv + 1, argtable);
+
+  if (help_arg->count > 0) {
+    std::cout << "Usage: " << name << ' ';
+    arg_print_syntax(stdout, argtable, "\n");
+    arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+    std::cout << "\nThe index is written to DIR/" INDEX_DIRECTORY " and used by searches with --index.\n";
+    arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+    return 0;
+  }
+
+  std::string command = nerr == 0 ? command_arg->sval[0] : "";
+  if (nerr == 0 && command != "build" && command != "update" && command != "compact") {
+    std::cerr << name << ": unknown command '" << command_arg->sval[0] << "'\n";
+    nerr = 1;
+  } else if (nerr > 0) {
+    arg_print_errors(stdout, end, name.c_str());
+  }
+  if (nerr > 0) {
+    std::cerr << "Try '" << name << " --help' for more information.\n";
+    arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+    return 1;
+  }
+
+  SearchOptions options;
+  options.walk_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  options.ignore       = no_ignore_arg->count == 0;
+  options.compact_rate = rate_arg->count > 0 ? (uint64_t)std::max(rate_arg->ival[0], 0) << 20 : options.compact_rate;
+  options.compact_wait = wait_arg->count > 0;
+  options.threads      = threads_arg->count > 0 ? std::max(threads_arg->ival[0], 1) : options.walk_threads;
+  options.build_memory = memory_arg->count > 0 ? (uint64_t)std::max(memory_arg->ival[0], 1) << 20 : options.build_memory;
+
+  std::string directory = dir_arg->count > 0 ? dir_arg->filename[0] : ".";
+  bool ok;
+  if (command == "update") {
+    ok = update_index(directory, options);
+  } else if (command == "compact") {
+    ok = compact_index(directory, all_arg->count > 0, options);
+  } else {
+    ok = build_index(directory, options);
+  }
+
+  arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+  return ok ? 0 : 1;
+}
+
+// the files a recursive search of directory would search, in path order, the index itself left out
+std::vector<std::string> index_files(const std::string& directory, const SearchOptions& options) {
+  WalkOptions walk_options;
+  walk_options.ignore = options.ignore;
+  Walker walker(options.walk_threads, walk_options);
+
+  std::mutex lock;
+  std::vector<std::string> paths;
+  size_t base_length = join_path(directory, "").size();
+  walker.walk(directory, [&](std::string path, size_t) {
+    if (std::string_view(path).substr(base_length, sizeof(INDEX_DIRECTORY)) == INDEX_DIRECTORY "/") return;
+    std::lock_guard<std::mutex> guard(lock);
+    paths.push_back(std::move(path));
+  });
+  // files are numbered in path order, which is the order --index prints them in
+  std::sort(paths.begin(), paths.end(), path_less);
+  return paths;
+}
+
+// Indexes the files in shards, consecutive stretches of them in path order that the threads take
+// one after the other. A thread writes what it has as a run, a segment of part of a shard, when its
+// builder outgrows its part of the memory and when the shard is done; the runs in order are then
+// merged into the segment.
+bool build_index(const std::string& directory, const SearchOptions& options) {
+  std::vector<std::string> paths = index_files(directory, options);
+  std::string index_directory    = join_path(directory, INDEX_DIRECTORY);
+  size_t base_length             = join_path(directory, "").size();
+
+  if (mkdir(index_directory.c_str(), 0777) != 0 && errno != EEXIST) {
+    std::cerr << index_directory << ": " << std::strerror(errno) << '\n';
+    return false;
+  }
+  // searches and later builds skip the index itself
+  std::ofstream(join_path(index_directory, ".gitignore")) << "*\n";
+
+  // the lock is only held to claim a name, the build runs while searches, updates and compactions
+  // go on
+  std::string segment;
+  {
+    IndexLock lock;
+    lock.lock(index_directory, INDEX_LOCK, true);
+    segment = new_segment_name(index_directory);
+    std::ofstream(join_path(index_directory, segment + ".tmp"));
+  }
+
+  size_t threads  = std::max<size_t>(std::min(options.threads, paths.size()), 1);
+  size_t shards   = threads == 1 ? 1 : std::min(paths.size(), threads * BUILD_SHARDS_PER_THREAD);
+  uint64_t budget = options.build_memory / threads;
+
+  std::vector<std::vector<std::string>> runs(shards);
+  std::atomic<size_t> next_shard{0};
+  std::atomic<IndexStatus> failure{IndexStatus::OK};
+  auto build_shards = [&]() {
+    for (size_t shard; (shard = next_shard++) < shards && failure == IndexStatus::OK;) {
+      IndexBuilder builder;
+      auto spill = [&]() {
+        std::string run    = segment + ".run-" + std::to_string(shard) + "-" + std::to_string(runs[shard].size());
+        IndexStatus status = builder.write(join_path(index_directory, run));
+        if (status != IndexStatus::OK) failure = status;
+        runs[shard].push_back(run);
+        builder = IndexBuilder();
+      };
+
+      for (size_t i = paths.size() * shard / shards; i < paths.size() * (shard + 1) / shards; i++) {
+        MappedFile file;
+        struct stat st;
+        if (!file.open(paths[i].c_str()) || fstat(file.descriptor(), &st) != 0) continue;
+        std::string_view contents = file.view();
+        if (is_binary(contents.substr(0, BINARY_CHECK_SIZE))) continue;
+
+        std::string relative = paths[i].substr(base_length);
+        int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        if (!builder.add_file(relative, mtime, st.st_size, contents)) {
+          // out of line ids, the segment will be too
+          failure = IndexStatus::TOO_BIG;
+          break;
+        }
+        if (builder.memory_use() > budget) spill();
+      }
+      if (builder.file_count() > 0 || runs[shard].empty()) spill();
+    }
+  };
+
+  std::vector<std::thread> helpers;
+  for (size_t i = 1; i < threads; i++) {
+    helpers.emplace_back(build_shards);
+  }
+  build_shards();
+  for (std::thread& helper : helpers) {
+    helper.join();
+  }
+
+  std::vector<std::string> run_names;
+  for (const std::vector<std::string>& shard_runs : runs) {
+    run_names.insert(run_names.end(), shard_runs.begin(), shard_runs.end());
+  }
+  IndexStatus status = failure;
+  uint64_t terms     = 0;
+  std::vector<std::unique_ptr<IndexSegment>> run_segments;
+  std::vector<const IndexSegment*> merged;
+  for (size_t i = 0; i < run_names.size() && status == IndexStatus::OK; i++) {
+    run_segments.push_back(std::make_unique<IndexSegment>());
+    status = run_segments.back()->open(join_path(index_directory, run_names[i]));
+    merged.push_back(run_segments.back().get());
+  }
+  // a single run already is the segment
+  if (status == IndexStatus::OK && run_names.size() == 1) {
+    terms = merged[0]->term_count();
+    if (std::rename(join_path(index_directory, run_names[0]).c_str(), join_path(index_directory, segment).c_str()) != 0) status = IndexStatus::IO_ERROR;
+  } else if (status == IndexStatus::OK) {
+    status = merge_runs(merged, join_path(index_directory, segment), &terms);
+  }
+  for (const std::string& run : run_names) {
+    std::remove(join_path(index_directory, run).c_str());
+  }
+
+  // the segments CURRENT has by now go once it moved on, whatever updated or merged them meanwhile
+  IndexLock lock;
+  lock.lock(index_directory, INDEX_LOCK, true);
+  std::vector<std::string> old_segments;
+  read_current(index_directory, &old_segments);
+  if (status == IndexStatus::OK) status = write_current(index_directory, {segment});
+  std::remove(join_path(index_directory, segment + ".tmp").c_str());
+  if (status != IndexStatus::OK) {
+    std::remove(join_path(index_directory, segment).c_str());
+    std::cerr << index_directory << ": " << index_status_message(status) << '\n';
+    return false;
+  }
+  for (const std::string& old_segment : old_segments) {
+    std::remove(join_path(index_directory, old_segment).c_str());
+  }
+
+  uint64_t files = 0;
+  uint64_t lines = 0;
+  for (const IndexSegment* run : merged) {
+    files += run->file_count();
+    lines += run->line_count();
+  }
+  std::cout << "Indexed " << files << " files, " << lines << " lines and " << terms << " words into " << index_directory << '\n';
+  return true;
+}
+
+// Writes a segment on top of the index with only what changed. A file whose mtime and size are what
+// the index has is taken as unchanged without reading it. Otherwise it is hashed, and if its contents
+// are the same after all only its new mtime is recorded; a file that really changed, or is new, is
+// indexed again. Files that are gone are deleted from the older segments.
+bool update_index(const std::string& directory, const SearchOptions& options) {
+  std::string index_directory = join_path(directory, INDEX_DIRECTORY);
+  if (!std::filesystem::exists(join_path(index_directory, INDEX_CURRENT))) return build_index(directory, options);
+
+  Index index;
+  IndexStatus status = index.open(index_directory);
+  if (status != IndexStatus::OK) {
+    std::cerr << index_directory << ": " << index_status_message(status) << '\n';
+    return false;
+  }
+
+  struct ManifestEntry {
+    int64_t mtime;
+    uint64_t size;
+    uint64_t hash;
+    bool seen;
+  };
+  std::unordered_map<std::string, ManifestEntry> manifest;
+  const auto& segments = index.get_segments();
+  for (size_t s = 0; s < segments.size(); s++) {
+    for (size_t f = 0; f < segments[s]->file_count(); f++) {
+      int64_t mtime;
+      if (!index.live_file(s, f, &mtime)) continue;
+      const IndexFileEntry& entry = segments[s]->file(f);
+      manifest.emplace(segments[s]->file_path(f), ManifestEntry{mtime, entry.size, entry.hash, false});
+    }
+  }
+
+  std::vector<std::string> paths = index_files(directory, options);
+  size_t base_length             = join_path(directory, "").size();
+  size_t added                   = 0;
+
+  IndexBuilder builder;
+  for (const std::string& path : paths) {
+    std::string relative(std::string_view(path).substr(base_length));
+    auto known = manifest.find(relative);
+
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) continue;
+    int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    if (known != manifest.end() && known->second.mtime == mtime && known->second.size == (uint64_t)st.st_size) {
+      known->second.seen = true;
+      continue;
+    }
+
+    MappedFile file;
+    if (!file.open(path.c_str()) || fstat(file.descriptor(), &st) != 0) continue;
+    std::string_view contents = file.view();
+    // a file that turned binary is left unseen, so it is deleted from the index
+    if (is_binary(contents.substr(0, BINARY_CHECK_SIZE))) continue;
+
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    if (known != manifest.end()) {
+      known->second.seen = true;
+      if (known->second.size == (uint64_t)st.st_size && known->second.hash == content_hash(contents)) {
+        builder.retime_file(relative, mtime);
+        continue;
+      }
+    } else {
+      added++;
+    }
+    if (!builder.add_file(relative, mtime, st.st_size, contents)) {
+      std::cerr << directory << ": " << index_status_message(IndexStatus::TOO_BIG) << '\n';
+      return false;
     }
   }
+  for (const auto& [path, entry] : manifest) {
+    if (!entry.seen) builder.remove_file(path);
+  }
+
+  if (builder.file_count() == 0 && builder.removed_count() == 0 && builder.retimed_count() == 0) {
+    std::cout << "The index in " << index_directory << " is up to date\n";
+    return true;
+  }
+
+  // The lock is only taken now, the walk runs while searches, builds and compactions go on. The new
+  // segment goes on top of whatever CURRENT has by now: a compaction in the meantime only merged the
+  // files the walk compared against, and a later segment overrides them anyway.
+  IndexLock lock;
+  lock.lock(index_directory, INDEX_LOCK, true);
+  std::vector<std::string> names;
+  read_current(index_directory, &names);
+  std::string segment = new_segment_name(index_directory);
+  names.push_back(segment);
+
+  status = builder.write(join_path(index_directory, segment));
+  if (status == IndexStatus::OK) status = write_current(index_directory, names);
+  if (status != IndexStatus::OK) {
+    std::remove(join_path(index_directory, segment).c_str());
+    std::cerr << index_directory << ": " << index_status_message(status) << '\n';
+    return false;
+  }
+
+  std::cout << "Updated " << index_directory << ": " << builder.file_count() - added << " changed, " << added << " new, "
+            << builder.removed_count() << " deleted and " << builder.retimed_count() << " touched files\n";
+
+  lock.unlock();
+  if (index.open(index_directory) != IndexStatus::OK || plan_merge(index) == index.get_segments().size()) return true;
+  if (options.compact_wait) return compact_index(directory, false, options);
+  compact_in_background(directory, options);
   return true;
 }
 
-void handle_file_println(const std::filesystem::path& path, const size_t line_num, const std::string& line) {
-  std::cout << termcolor::magenta << path.string() << termcolor::blue << ":" << termcolor::green << line_num << termcolor::reset << ": " << termcolor::bold << line << termcolor::reset << '\n';
+// Merges segments of the index, the newest ones the tiered policy picks until it is content, or all
+// of them. The merge runs without the lock, searches and updates go on meanwhile; the lock is only
+// taken to swap the merged segment into CURRENT, in place of the segments it was made of.
+bool compact_index(const std::string& directory, bool all, const SearchOptions& options) {
+  std::string index_directory = join_path(directory, INDEX_DIRECTORY);
+  IndexLock compacting;
+  if (!compacting.lock(index_directory, INDEX_COMPACT_LOCK, false)) {
+    std::cout << "The index in " << index_directory << " is being compacted already\n";
+    return true;
+  }
+
+  Throttle throttle(options.compact_rate);
+  for (;;) {
+    Index index;
+    IndexStatus status = index.open(index_directory);
+    if (status != IndexStatus::OK) {
+      std::cerr << index_directory << ": " << index_status_message(status) << '\n';
+      return false;
+    }
+    size_t count = index.get_segments().size();
+    size_t first = all ? (count > 1 ? 0 : count) : plan_merge(index);
+    if (first == count) return true;
+
+    std::vector<std::string> merged;
+    std::string segment;
+    {
+      IndexLock lock;
+      lock.lock(index_directory, INDEX_LOCK, true);
+      // an update or another compaction since the index was opened changed what first means
+      read_current(index_directory, &merged);
+      if (merged != index.get_names()) continue;
+      merged.erase(merged.begin(), merged.begin() + first);
+      // claims the name before an update can pick it too
+      segment = new_segment_name(index_directory);
+      std::ofstream(join_path(index_directory, segment + ".tmp"));
+    }
+
+    IndexBuilder builder;
+    status = builder.merge(index, first, count - 1, throttle) ? builder.write(join_path(index_directory, segment), throttle) : IndexStatus::TOO_BIG;
+    if (status != IndexStatus::OK) {
+      std::remove(join_path(index_directory, segment + ".tmp").c_str());
+      std::cerr << index_directory << ": " << index_status_message(status) << '\n';
+      return false;
+    }
+
+    IndexLock lock;
+    lock.lock(index_directory, INDEX_LOCK, true);
+    std::vector<std::string> names;
+    read_current(index_directory, &names);
+    auto start = std::search(names.begin(), names.end(), merged.begin(), merged.end());
+    if (start == names.end()) {
+      // a build replaced the segments in the meantime
+      std::remove(join_path(index_directory, segment).c_str());
+      return true;
+    }
+    start = names.erase(start, start + merged.size());
+    names.insert(start, segment);
+    status = write_current(index_directory, names);
+    if (status != IndexStatus::OK) {
+      std::remove(join_path(index_directory, segment).c_str());
+      std::cerr << index_directory << ": " << index_status_message(status) << '\n';
+      return false;
+    }
+    for (const std::string& name : merged) {
+      std::remove(join_path(index_directory, name).c_str());
+    }
+    std::cout << "Merged " << merged.size() << " segments of " << index_directory << " into " << segment << '\n';
+  }
+}
+
+// runs compact_index in a process of its own that outlives this one
+void compact_in_background(const std::string& directory, const SearchOptions& options) {
+  std::cout.flush();
+  pid_t pid = fork();
+  if (pid != 0) {
+    if (pid > 0) std::cout << "Compacting the index in the background\n";
+    return;
+  }
+
+  setsid();
+  // without /dev/null the standard streams stay as they are
+  int null = open("/dev/null", O_RDWR);
+  if (null >= 0) {
+    for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+      dup2(null, fd);
+    }
+    if (null > STDERR_FILENO) close(null);
+  }
+  _exit(compact_index(directory, false, options) ? 0 : 1);
+}
+
+// A new segment gets a name no reader can have open yet: a number above those of all segments, and
+// of those still being written.
+std::string new_segment_name(const std::string& index_directory) {
+  size_t number = 0;
+  std::error_code error;
+  for (const auto& entry : std::filesystem::directory_iterator(index_directory, error)) {
+    std::string name = entry.path().filename().string();
+    if (name.compare(0, std::strlen("segment-"), "segment-") != 0) continue;
+    number = std::max<size_t>(number, std::strtoull(name.c_str() + std::strlen("segment-"), nullptr, 10));
+  }
+  return "segment-" + std::to_string(number + 1) + ".bsi";
+}
+
+// Answers the query for a directory from its index. The index narrows the search down to the lines
+// that may match, only those are read, and only those the index can't decide are searched. Files
+// that changed since the index was built are searched as a whole. The candidates of all segments are
+// merged by path, so the output is in path order however many updates the index had.
+bool handle_index(const std::string& directory, const Query& query, const SearchOptions& options, OutputBuffer& out) {
+  Index index;
+  IndexStatus status = index.open(join_path(directory, INDEX_DIRECTORY));
+  if (status != IndexStatus::OK) {
+    out.flush();
+    std::cerr << directory << ": " << index_status_message(status) << ", searching the directory instead\n";
+    return handle_directory(directory, query, options, out);
+  }
+
+  const auto& segments = index.get_segments();
+  std::vector<IndexCursor> cursors;
+  for (size_t s = 0; s < segments.size(); s++) {
+    IndexCursor cursor{s, match_lines(*segments[s], query), candidate_files(*segments[s], query)};
+    if (advance_index_cursor(index, cursor)) cursors.push_back(std::move(cursor));
+  }
+
+  QueryScratch scratch = query.scratch();
+  while (!cursors.empty()) {
+    auto path_of = [&segments](const IndexCursor& cursor) { return segments[cursor.segment]->file_path(cursor.file); };
+    auto first   = std::min_element(cursors.begin(), cursors.end(), [&](const IndexCursor& a, const IndexCursor& b) { return path_less(path_of(a), path_of(b)); });
+
+    IndexCursor& cursor         = *first;
+    const IndexFileEntry& entry = segments[cursor.segment]->file(cursor.file);
+    std::string_view relative   = path_of(cursor);
+    std::string_view name       = relative.substr(relative.rfind('/') + 1);
+    if (options.filter.empty() || options.filter.accepts(name)) {
+      // line numbers of the file, starting at 1
+      std::vector<uint32_t> lines = cursor.match.maybe.ids(entry.first_line, entry.first_line + entry.line_count);
+      for (uint32_t& id : lines) {
+        id = id - entry.first_line + 1;
+      }
+      search_index_file(join_path(directory, relative), entry, cursor.mtime, lines, cursor.match.yes, query, scratch, options, out);
+    }
+
+    if (!advance_index_cursor(index, cursor)) cursors.erase(first);
+  }
+  return true;
+}
+
+// moves on to the next candidate file of the segment that has a line that may match and that no later
+// segment overrides, false if there is none
+bool advance_index_cursor(const Index& index, IndexCursor& cursor) {
+  const IndexSegment& segment = *index.get_segments()[cursor.segment];
+  while (cursor.next < segment.file_count()) {
+    // skips ahead to the next candidate file that has a line that may match
+    uint32_t file;
+    uint32_t line;
+    if (!cursor.files.next(cursor.next, &file) || !cursor.match.maybe.next(segment.file(file).first_line, &line)) break;
+    if (segment.file_of(line) != file) {
+      cursor.next = segment.file_of(line);
+      continue;
+    }
+
+    cursor.next = file + 1;
+    if (index.live_file(cursor.segment, file, &cursor.mtime)) {
+      cursor.file = file;
+      return true;
+    }
+  }
+  cursor.next = segment.file_count();
+  return false;
+}
+
+// Prints the plan every segment of the index would run, and the files its trigrams leave.
+bool explain_index(const std::string& directory, const Query& query) {
+  Index index;
+  IndexStatus status = index.open(join_path(directory, INDEX_DIRECTORY));
+  if (status != IndexStatus::OK) {
+    std::cerr << directory << ": " << index_status_message(status) << '\n';
+    return false;
+  }
+
+  const auto& segments = index.get_segments();
+  for (size_t i = 0; i < segments.size(); i++) {
+    const IndexSegment& segment = *segments[i];
+    std::cout << directory << ": segment " << i << " of " << segments.size() << ", " << segment.file_count() << " files, "
+              << segment.line_count() << " lines, " << segment.term_count() << " words\n";
+    std::cout << QueryPlan(segment, query).explain();
+    std::cout << "candidate files " << candidate_files(segment, query).cardinality() << " of " << segment.file_count() << '\n';
+  }
+  return true;
+}
+
+// prints the given lines of a file that match, lines whose id is in yes are known to match
+void search_index_file(const std::string& path, const IndexFileEntry& entry, int64_t mtime, const std::vector<uint32_t>& lines, const Bitmap& yes, const Query& query, QueryScratch& scratch, const SearchOptions& options, OutputBuffer& out) {
+  auto file = std::make_shared<MappedFile>();
+  struct stat st;
+  if (!file->open(path.c_str()) || fstat(file->descriptor(), &st) != 0) return;
+
+  if ((int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec != mtime || (uint64_t)st.st_size != entry.size) {
+    handle_mapped_file(path, file, query, scratch, options, out);
+    return;
+  }
+
+  std::string prefix = out.file_prefix(path);
+  out.set_source(file);
+
+  std::string_view rest = file->view();
+  uint32_t line_num     = 1;
+  for (uint32_t wanted : lines) {
+    for (; line_num < wanted && !rest.empty(); line_num++) {
+      const char* newline = static_cast<const char*>(std::memchr(rest.data(), '\n', rest.size()));
+      rest.remove_prefix(newline ? newline - rest.data() + 1 : rest.size());
+    }
+    std::string_view line = rest.substr(0, rest.find('\n'));
+
+    // a line the index couldn't settle is evaluated on its own, empty lines too
+    bool matches = yes.contains(entry.first_line + wanted - 1);
+    if (!matches && eval_line(line, query, scratch, &matches) != EvalStatus::OK) continue;
+    if (!matches) continue;
+    if (line.size() > LONG_LINE_SIZE) {
+      handle_file_println(out, prefix, wanted, long_line_preview(line, line.size()));
+    } else {
+      handle_file_println(out, prefix, wanted, line);
+    }
+  }
+  out.set_source(nullptr);
+}
+
+// Opens, advises and maps files for the match stage. The expensive part runs in parallel, but files
+// are handed on in the order they were scheduled: a matcher waiting for the window to move must never
+// wait for a file that is still stuck behind it in a reader.
+void read_files(RingBuffer<WalkedFile>& walked, RingBuffer<ReadFile>& read, std::atomic<size_t>& turn, const PrefetchWindow& prefetch, const Query& query, const SearchOptions& options) {
+  WalkedFile next;
+  while (walked.pop(next)) {
+    // keeps about a prefetch window of opened files ahead of every matcher
+    Backoff backoff;
+    while (read.depth() >= prefetch.size() * options.threads) {
+      backoff.wait();
+    }
+
+    // a file the cache rules out is passed on unopened, like one that couldn't be read
+    ReadFile file{next.seq, std::move(next.path), nullptr};
+    int fd = cache_rules_out(file.path, query, options) ? -1 : prefetch_open(file.path);
+    if (fd >= 0) {
+      auto mapped = std::make_shared<MappedFile>();
+      if (mapped->adopt(fd)) file.file = std::move(mapped);
+    }
+
+    backoff.reset();
+    while (turn.load(std::memory_order_acquire) != next.order) {
+      backoff.wait();
+    }
+    read.push(std::move(file));
+    turn.store(next.order + 1, std::memory_order_release);
+  }
+}
+
+// Searches files from the read stage until it is closed, called by every matcher with its own output
+// buffer. The output of every file is deposited in the sequencer instead of being written.
+void search_files(RingBuffer<ReadFile>& read, const Query& query, const SearchOptions& options, OutputBuffer& out, Sequencer& sequencer, PrefetchWindow& prefetch) {
+  QueryScratch scratch = query.scratch();
+
+  ReadFile next;
+  while (read.pop(next)) {
+    sequencer.begin(next.seq);
+    out.set_sink([&sequencer, seq = next.seq](OutputPiece piece) { sequencer.deposit(seq, std::move(piece)); });
+
+    if (next.file) {
+      auto start = std::chrono::steady_clock::now();
+      handle_mapped_file(next.path, next.file, query, scratch, options, out);
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      prefetch.report(next.file->view().size(), elapsed.count());
+    }
+
+    // every sequence number has to be finished, even for files that couldn't be read
+    out.flush();
+    sequencer.finish(next.seq);
+  }
+}
+
+void print_ring_stats(const char* stage, const RingStats& stats, size_t capacity) {
+  size_t pushes = stats.pushes.load();
+  std::cerr << stage << ": capacity " << capacity << ", pushes " << pushes << ", average depth "
+            << (pushes > 0 ? (double)stats.depth_total.load() / pushes : 0.0) << ", max depth " << stats.max_depth.load()
+            << ", full waits " << stats.full_waits.load() << ", empty waits " << stats.empty_waits.load() << '\n';
+}
+
+void handle_file_println(OutputBuffer& out, std::string_view prefix, const size_t line_num, std::string_view line) {
+  out.println(prefix, line_num, line);
 }
 
-void handle_stdin_println(const size_t line_num, const std::string& line) {
-  std::cout << termcolor::green << line_num << termcolor::reset << ": " << termcolor::bold << line << termcolor::reset << '\n';
+void handle_stdin_println(OutputBuffer& out, std::string_view prefix, const size_t line_num, std::string_view line) {
+  out.println(prefix, line_num, line);
 }
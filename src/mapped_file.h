@@ -0,0 +1,86 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <cerrno>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only view of a whole file. The file is mapped when possible so lines can be handed around as
+// string_views without copying; files that can't be mapped (procfs, empty st_size) are read into memory.
+class MappedFile {
+public:
+  MappedFile() = default;
+  ~MappedFile();
+
+  MappedFile(const MappedFile&)            = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool open(const char* path);
+  // takes ownership of an already opened descriptor
+  bool adopt(int fd);
+
+  std::string_view view() const { return contents; }
+  int descriptor() const { return fd; }
+
+private:
+  bool read_all();
+
+  int fd        = -1;
+  void* mapping = nullptr;
+  size_t length = 0;
+  std::string fallback;
+  std::string_view contents;
+};
+
+MappedFile::~MappedFile() {
+  if (mapping) munmap(mapping, length);
+  if (fd >= 0) close(fd);
+}
+
+bool MappedFile::open(const char* path) {
+  int file_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (file_fd < 0) return false;
+  return adopt(file_fd);
+}
+
+bool MappedFile::adopt(int file_fd) {
+  fd = file_fd;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) return false;
+
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      mapping  = addr;
+      length   = st.st_size;
+      contents = std::string_view(static_cast<const char*>(addr), length);
+      madvise(mapping, length, MADV_SEQUENTIAL);
+      return true;
+    }
+  }
+
+  return read_all();
+}
+
+bool MappedFile::read_all() {
+  char block[1 << 16];
+  while (true) {
+    ssize_t n = read(fd, block, sizeof(block));
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    if (n == 0) break;
+    fallback.append(block, n);
+  }
+  contents = fallback;
+  return true;
+}
+
+#endif
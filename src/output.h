@@ -0,0 +1,289 @@
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// the buffer is written out once it grows past this many bytes
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+// lines at least this long are referenced in place instead of being copied into the buffer
+#define OUTPUT_REFERENCE_MIN 512
+// referenced runs at least this long are vmspliced into the pipe when stdout is one
+#define OUTPUT_SPLICE_MIN (1 << 16)
+
+#ifndef IOV_MAX
+  #define IOV_MAX 1024
+#endif
+
+// same escape sequences termcolor emits, so colored output looks the same as before
+#define COLOR_RESET   "\033[00m"
+#define COLOR_BOLD    "\033[1m"
+#define COLOR_GREEN   "\033[32m"
+#define COLOR_BLUE    "\033[34m"
+#define COLOR_MAGENTA "\033[35m"
+
+struct OutputSegment {
+  // nullptr when the bytes live in the owned buffer starting at offset
+  const char* external;
+  size_t offset;
+  size_t size;
+};
+
+// Output taken out of an OutputBuffer before it was written, so another thread can write it later.
+struct OutputPiece {
+  std::string buffer;
+  std::vector<OutputSegment> segments;
+  // keep the memory referenced by external segments alive
+  std::vector<std::shared_ptr<const void>> retained;
+  size_t size = 0;
+};
+
+using OutputSink = std::function<void(OutputPiece piece)>;
+
+// Collects formatted matches and hands them to the kernel with a single writev(2) per block.
+// Short text is copied into an owned byte buffer, long lines are kept as references into the input
+// (usually an mmapped file) so they are never copied in user space. Every worker owns one; when
+// several of them write to the same descriptor they share a lock that is held while flushing.
+class OutputBuffer {
+public:
+  OutputBuffer(int fd, bool color, std::mutex* lock = nullptr);
+  ~OutputBuffer();
+
+  OutputBuffer(const OutputBuffer&)            = delete;
+  OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+  // builds the part of a line that is the same for every match in a file: "path:" plus its colors
+  std::string file_prefix(std::string_view path) const;
+  // builds the prefix used for lines read from standard input
+  std::string stdin_prefix() const;
+
+  // Lines passed to println after this point live in memory owned by source, so they may be
+  // referenced instead of copied. Pass nullptr when the lines are transient again.
+  void set_source(std::shared_ptr<const void> source);
+
+  void println(std::string_view prefix, size_t line_num, std::string_view line);
+  void append(std::string_view text);
+  bool flush();
+
+  // number of pending bytes that triggers a flush, OUTPUT_BUFFER_SIZE by default
+  void set_limit(size_t bytes) { limit = bytes; }
+  // called right before anything is written, may block until it is this buffer's turn
+  void set_gate(std::function<void()> new_gate) { gate = std::move(new_gate); }
+  // when set, flush hands the pending output to sink instead of writing it
+  void set_sink(OutputSink new_sink) { sink = std::move(new_sink); }
+  const OutputSink& get_sink() const { return sink; }
+
+  // writes a piece another buffer handed to its sink
+  bool write(const OutputPiece& piece);
+
+  bool has_color() const { return color; }
+  int descriptor() const { return fd; }
+  std::mutex* get_lock() const { return lock; }
+
+private:
+  void reference(std::string_view text);
+  void copy(std::string_view text);
+  bool write_all(const std::string& bytes, const std::vector<OutputSegment>& pieces);
+  bool write_segments(std::vector<iovec>& iov);
+  bool splice_segment(const iovec& segment);
+
+  int fd;
+  bool color;
+  std::mutex* lock;
+  bool use_splice = false;
+  size_t pending  = 0;
+  size_t limit    = OUTPUT_BUFFER_SIZE;
+  std::function<void()> gate;
+  OutputSink sink;
+  std::string buffer;
+  std::vector<OutputSegment> segments;
+  std::shared_ptr<const void> source;
+  // sources that have referenced lines waiting in `segments`
+  std::vector<std::shared_ptr<const void>> retained;
+};
+
+OutputBuffer::OutputBuffer(int fd, bool color, std::mutex* lock) : fd(fd), color(color), lock(lock) {
+  buffer.reserve(OUTPUT_BUFFER_SIZE * 2);
+
+#ifdef __linux__
+  struct stat st;
+  use_splice = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+#endif
+}
+
+OutputBuffer::~OutputBuffer() {
+  flush();
+}
+
+std::string OutputBuffer::file_prefix(std::string_view path) const {
+  std::string prefix;
+  if (color) {
+    prefix.append(COLOR_MAGENTA).append(path).append(COLOR_BLUE ":" COLOR_GREEN);
+  } else {
+    prefix.append(path).append(":");
+  }
+  return prefix;
+}
+
+std::string OutputBuffer::stdin_prefix() const {
+  return color ? COLOR_GREEN : "";
+}
+
+void OutputBuffer::set_source(std::shared_ptr<const void> new_source) {
+  source = std::move(new_source);
+}
+
+void OutputBuffer::println(std::string_view prefix, size_t line_num, std::string_view line) {
+  char num[24];
+  auto [end, ec] = std::to_chars(num, num + sizeof(num), line_num);
+
+  copy(prefix);
+  copy(std::string_view(num, end - num));
+  copy(color ? COLOR_RESET ": " COLOR_BOLD : ": ");
+
+  if (source && line.size() >= OUTPUT_REFERENCE_MIN) {
+    reference(line);
+  } else {
+    copy(line);
+  }
+
+  copy(color ? COLOR_RESET "\n" : "\n");
+
+  if (pending >= limit) flush();
+}
+
+void OutputBuffer::append(std::string_view text) {
+  copy(text);
+  if (pending >= limit) flush();
+}
+
+void OutputBuffer::copy(std::string_view text) {
+  if (!segments.empty() && segments.back().external == nullptr) {
+    segments.back().size += text.size();
+  } else {
+    segments.push_back({nullptr, buffer.size(), text.size()});
+  }
+  buffer.append(text);
+  pending += text.size();
+}
+
+void OutputBuffer::reference(std::string_view text) {
+  if (retained.empty() || retained.back() != source) retained.push_back(source);
+  segments.push_back({text.data(), 0, text.size()});
+  pending += text.size();
+}
+
+bool OutputBuffer::flush() {
+  if (segments.empty()) return true;
+  if (gate) gate();
+
+  if (sink) {
+    OutputPiece piece;
+    piece.buffer.swap(buffer);
+    piece.segments.swap(segments);
+    piece.retained.swap(retained);
+    piece.size = pending;
+    pending    = 0;
+    sink(std::move(piece));
+    return true;
+  }
+
+  bool ok = write_all(buffer, segments);
+
+  buffer.clear();
+  segments.clear();
+  retained.clear();
+  pending = 0;
+  return ok;
+}
+
+bool OutputBuffer::write(const OutputPiece& piece) {
+  return write_all(piece.buffer, piece.segments);
+}
+
+bool OutputBuffer::write_all(const std::string& bytes, const std::vector<OutputSegment>& pieces) {
+  std::unique_lock<std::mutex> guard;
+  if (lock) guard = std::unique_lock<std::mutex>(*lock);
+
+  std::vector<iovec> iov;
+  iov.reserve(std::min<size_t>(pieces.size(), IOV_MAX));
+
+  bool ok = true;
+  for (const OutputSegment& segment : pieces) {
+    iovec entry;
+    entry.iov_base = const_cast<char*>(segment.external ? segment.external : bytes.data() + segment.offset);
+    entry.iov_len  = segment.size;
+
+    // Only file backed memory is spliced: the pipe keeps referencing the pages after vmsplice
+    // returns, so the owned buffer, which is reused right away, always goes through writev.
+    if (ok && use_splice && segment.external && segment.size >= OUTPUT_SPLICE_MIN) {
+      ok = write_segments(iov) && splice_segment(entry);
+      continue;
+    }
+
+    iov.push_back(entry);
+    if (iov.size() == IOV_MAX) ok = ok && write_segments(iov);
+  }
+  return ok && write_segments(iov);
+}
+
+bool OutputBuffer::write_segments(std::vector<iovec>& iov) {
+  size_t first = 0;
+  while (first < iov.size()) {
+    ssize_t written = writev(fd, iov.data() + first, std::min<size_t>(iov.size() - first, IOV_MAX));
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      iov.clear();
+      return false;
+    }
+
+    // skip over everything that made it out, a short write can stop in the middle of an entry
+    while (first < iov.size() && static_cast<size_t>(written) >= iov[first].iov_len) {
+      written -= iov[first].iov_len;
+      first++;
+    }
+    if (first < iov.size()) {
+      iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+      iov[first].iov_len -= written;
+    }
+  }
+  iov.clear();
+  return true;
+}
+
+bool OutputBuffer::splice_segment(const iovec& segment) {
+#ifdef __linux__
+  iovec remaining = segment;
+  while (remaining.iov_len > 0) {
+    ssize_t spliced = vmsplice(fd, &remaining, 1, 0);
+    if (spliced < 0) {
+      if (errno == EINTR) continue;
+      // not supported for this descriptor, everything from now on is written normally
+      use_splice = false;
+      std::vector<iovec> iov{remaining};
+      return write_segments(iov);
+    }
+    remaining.iov_base = static_cast<char*>(remaining.iov_base) + spliced;
+    remaining.iov_len -= spliced;
+  }
+  return true;
+#else
+  std::vector<iovec> iov{segment};
+  return write_segments(iov);
+#endif
+}
+
+#endif
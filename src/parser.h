@@ -3,6 +3,7 @@
 
 #include "tokenizer.h"
 
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <memory>
@@ -73,7 +74,15 @@ public:
   ParseStatus parse();
   EvalStatus eval(std::string_view input, bool* value);
 
+  // Streaming evaluation for input that is searched in pieces. Consecutive pieces passed to
+  // eval_feed must overlap by max_id_length() - 1 bytes so no identifier is split between them.
+  void eval_begin();
+  void eval_feed(std::string_view piece);
+  EvalStatus eval_end(bool* value);
+  size_t max_id_length() const;
+
   Token get_current_token();
+  std::shared_ptr<Node> get_root() { return root; }
   const std::unordered_map<std::string_view, bool>& get_id_map() { return id_map; }
 
   std::string dot(std::string_view label);
@@ -210,6 +219,32 @@ EvalStatus Parser::eval(std::string_view input, bool* value) {
   return eval_tree(root, value);
 }
 
+void Parser::eval_begin() {
+  for (auto& i : id_map) {
+    i.second = false;
+  }
+}
+
+void Parser::eval_feed(std::string_view piece) {
+  for (auto& i : id_map) {
+    if (!i.second) i.second = piece.find(i.first) != std::string_view::npos;
+  }
+}
+
+EvalStatus Parser::eval_end(bool* value) {
+  *value = false;
+
+  return eval_tree(root, value);
+}
+
+size_t Parser::max_id_length() const {
+  size_t length = 0;
+  for (auto& i : id_map) {
+    length = std::max(length, i.first.size());
+  }
+  return length;
+}
+
 EvalStatus Parser::eval_tree(std::shared_ptr<Node> node, bool* value) {
   if (!node) {
     std::cerr << "node is null value\n";
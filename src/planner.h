@@ -0,0 +1,231 @@
+#ifndef _PLANNER_H_
+#define _PLANNER_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bitmap.h"
+#include "index.h"
+#include "index_query.h"
+#include "query.h"
+
+enum class PlanOp : uint8_t {
+  LOOKUP,
+  INTERSECT,
+  UNION,
+  DIFFERENCE,
+  COMPLEMENT,
+};
+
+// An operator of a plan. A LOOKUP reads the postings of identifier id. INTERSECT and UNION combine
+// all their children, cheapest first. DIFFERENCE takes the lines of its first child that none of the
+// others has, COMPLEMENT the lines its child doesn't have.
+struct PlanNode {
+  PlanOp op;
+  uint32_t id = 0;
+  std::vector<uint32_t> children;
+  // the most lines the operator can produce, by the lengths of the posting lists
+  uint64_t estimate = 0;
+};
+
+// The query rewritten for the index of one segment. Chains of "and" and "or" become one operator
+// each, a "not" under an "and" is taken away from the other operands instead of being complemented
+// and "not not" cancels out. Intersections start with their rarest operand and later operands only
+// look at the lines that are left, so a common identifier next to a rare one is probed line by line
+// and never read whole.
+class QueryPlan {
+public:
+  QueryPlan(const IndexSegment& segment, const Query& query);
+
+  LineMatch execute() const;
+  // the plan as an indented tree with the estimates, for --explain
+  std::string explain() const;
+
+private:
+  uint32_t plan_node(uint32_t index);
+  uint32_t add(PlanNode node);
+  // the operands of a chain of op
+  void collect(uint32_t index, QueryOp op, std::vector<uint32_t>& operands) const;
+  LineMatch execute_node(uint32_t index, const Bitmap* domain) const;
+  void explain_node(uint32_t index, size_t depth, std::string& out) const;
+
+  const IndexSegment& segment;
+  const Query& query;
+  std::vector<IdLookup> lookups;
+  std::vector<PlanNode> nodes;
+  uint32_t root;
+};
+
+LineMatch match_lines(const IndexSegment& segment, const Query& query) {
+  return QueryPlan(segment, query).execute();
+}
+
+QueryPlan::QueryPlan(const IndexSegment& segment, const Query& query) : segment(segment), query(query) {
+  for (const std::string& id : query.get_ids()) {
+    lookups.push_back(lookup_id(segment, id));
+  }
+  root = plan_node(query.get_root());
+}
+
+uint32_t QueryPlan::add(PlanNode node) {
+  nodes.push_back(std::move(node));
+  return nodes.size() - 1;
+}
+
+void QueryPlan::collect(uint32_t index, QueryOp op, std::vector<uint32_t>& operands) const {
+  const QueryNode& node = query.get_nodes()[index];
+  if (node.op != op) {
+    operands.push_back(index);
+    return;
+  }
+  collect(node.left, op, operands);
+  collect(node.right, op, operands);
+}
+
+uint32_t QueryPlan::plan_node(uint32_t index) {
+  uint64_t lines        = segment.line_count();
+  const QueryNode& node = query.get_nodes()[index];
+  auto by_estimate      = [this](uint32_t a, uint32_t b) { return nodes[a].estimate < nodes[b].estimate; };
+
+  switch (node.op) {
+    case QueryOp::ID:
+      return add({PlanOp::LOOKUP, node.left, {}, lookups[node.left].estimate});
+    case QueryOp::NOT: {
+      const QueryNode& operand = query.get_nodes()[node.left];
+      if (operand.op == QueryOp::NOT) return plan_node(operand.left);
+      uint32_t child = plan_node(node.left);
+      return add({PlanOp::COMPLEMENT, 0, {child}, lines - std::min(lines, nodes[child].estimate)});
+    }
+    case QueryOp::OR: {
+      std::vector<uint32_t> operands;
+      collect(index, QueryOp::OR, operands);
+
+      PlanNode plan{PlanOp::UNION, 0, {}, 0};
+      for (uint32_t operand : operands) {
+        plan.children.push_back(plan_node(operand));
+        plan.estimate += nodes[plan.children.back()].estimate;
+      }
+      std::sort(plan.children.begin(), plan.children.end(), by_estimate);
+      plan.estimate = std::min(plan.estimate, lines);
+      return add(std::move(plan));
+    }
+    case QueryOp::AND: {
+      std::vector<uint32_t> operands;
+      collect(index, QueryOp::AND, operands);
+
+      // "a and not b" is a minus b
+      std::vector<uint32_t> positive;
+      std::vector<uint32_t> negative;
+      for (uint32_t operand : operands) {
+        bool negated = false;
+        while (query.get_nodes()[operand].op == QueryOp::NOT) {
+          negated = !negated;
+          operand = query.get_nodes()[operand].left;
+        }
+        (negated ? negative : positive).push_back(plan_node(operand));
+      }
+      std::sort(positive.begin(), positive.end(), by_estimate);
+      std::sort(negative.begin(), negative.end(), by_estimate);
+
+      if (positive.empty()) {
+        // "not a and not b" is everything but a or b
+        PlanNode either{PlanOp::UNION, 0, negative, 0};
+        for (uint32_t child : negative) {
+          either.estimate += nodes[child].estimate;
+        }
+        either.estimate   = std::min(either.estimate, lines);
+        uint64_t estimate = lines - either.estimate;
+        uint32_t child    = negative.size() == 1 ? negative[0] : add(std::move(either));
+        return add({PlanOp::COMPLEMENT, 0, {child}, estimate});
+      }
+
+      uint32_t kept = positive[0];
+      if (positive.size() > 1) kept = add({PlanOp::INTERSECT, 0, positive, nodes[positive[0]].estimate});
+      if (negative.empty()) return kept;
+
+      PlanNode difference{PlanOp::DIFFERENCE, 0, {kept}, nodes[kept].estimate};
+      difference.children.insert(difference.children.end(), negative.begin(), negative.end());
+      return add(std::move(difference));
+    }
+  }
+  return add({PlanOp::LOOKUP, 0, {}, 0});
+}
+
+LineMatch QueryPlan::execute() const {
+  return execute_node(root, nullptr);
+}
+
+// Every operator only answers for the lines in domain, when there is one, which is how operands
+// after the first of an intersection or difference skip the lines already ruled out.
+LineMatch QueryPlan::execute_node(uint32_t index, const Bitmap* domain) const {
+  const PlanNode& node = nodes[index];
+  switch (node.op) {
+    case PlanOp::LOOKUP:
+      return match_lookup(segment, lookups[node.id], domain);
+    case PlanOp::INTERSECT: {
+      LineMatch match = execute_node(node.children[0], domain);
+      for (size_t i = 1; i < node.children.size() && !match.maybe.empty(); i++) {
+        LineMatch operand = execute_node(node.children[i], &match.maybe);
+        match             = {match.yes & operand.yes, operand.maybe};
+      }
+      return match;
+    }
+    case PlanOp::UNION: {
+      LineMatch match;
+      for (uint32_t child : node.children) {
+        LineMatch operand = execute_node(child, domain);
+        match.yes |= operand.yes;
+        match.maybe |= operand.maybe;
+      }
+      return match;
+    }
+    case PlanOp::DIFFERENCE: {
+      // a line certainly matches "a and not b" if it certainly has a and can't have b, and may match
+      // if it may have a and doesn't certainly have b
+      LineMatch match = execute_node(node.children[0], domain);
+      for (size_t i = 1; i < node.children.size() && !match.maybe.empty(); i++) {
+        LineMatch operand = execute_node(node.children[i], &match.maybe);
+        match             = {match.yes - operand.maybe, match.maybe - operand.yes};
+      }
+      return match;
+    }
+    case PlanOp::COMPLEMENT: {
+      LineMatch operand = execute_node(node.children[0], domain);
+      Bitmap all        = domain != nullptr ? *domain : Bitmap::range(0, segment.line_count());
+      return {all - operand.maybe, all - operand.yes};
+    }
+  }
+  return {};
+}
+
+std::string QueryPlan::explain() const {
+  std::string out;
+  explain_node(root, 0, out);
+  return out;
+}
+
+void QueryPlan::explain_node(uint32_t index, size_t depth, std::string& out) const {
+  static const char* const NAMES[] = {"lookup", "intersect", "union", "difference", "complement"};
+
+  const PlanNode& node = nodes[index];
+  out.append(2 * depth, ' ').append(NAMES[(int)node.op]);
+  if (node.op == PlanOp::LOOKUP) {
+    const IdLookup& lookup = lookups[node.id];
+    size_t terms           = 0;
+    for (const std::vector<uint32_t>& group : lookup.groups) {
+      terms += group.size();
+    }
+    out.append(" '").append(query.get_ids()[node.id]).append("' ");
+    out.append(std::to_string(terms)).append(terms == 1 ? " word" : " words");
+    if (!lookup.exact) out.append(" in ").append(std::to_string(lookup.groups.size())).append(" runs");
+  }
+  out.append(", at most ").append(std::to_string(node.estimate)).append(" lines\n");
+
+  for (uint32_t child : node.children) {
+    explain_node(child, depth + 1, out);
+  }
+}
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef _POSTINGS_H_
+#define _POSTINGS_H_
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POSTINGS_X86 1
+#endif
+
+// ids per block, every block has a skip entry so a reader can jump over it
+#define POSTINGS_BLOCK_SIZE 128
+
+// An encoded posting list is
+//
+//   skip entries: {last id of the block, end of the block's data} for every block
+//   blocks:       Stream VByte control bytes, then the data bytes of the block
+//
+// Ids are stored as deltas to the id before them; a block starts from the last id of the block
+// before it, which the skip entries have, so every block decodes on its own. Stream VByte keeps the
+// 2 bit lengths of four deltas in one control byte and the bytes of the deltas after all control
+// bytes, so four deltas are decoded with one shuffle. Lists are padded to 4 bytes.
+struct PostingSkip {
+  uint32_t last_id;
+  uint32_t end;
+};
+
+// appends the encoding of sorted, distinct ids to out
+void encode_postings(const std::vector<uint32_t>& ids, std::string& out);
+
+// A view of an encoded list, count is the number of ids in it.
+class PostingList {
+public:
+  PostingList() = default;
+  PostingList(const char* data, uint32_t count) : data(data), count(count) {}
+
+  uint32_t size() const { return count; }
+  size_t block_count() const { return (count + POSTINGS_BLOCK_SIZE - 1) / POSTINGS_BLOCK_SIZE; }
+  const PostingSkip& skip(size_t block) const { return reinterpret_cast<const PostingSkip*>(data)[block]; }
+  // bytes the list takes up, padding included
+  size_t encoded_size() const;
+
+  // decodes a block into out, which has room for POSTINGS_BLOCK_SIZE ids, returns how many there are
+  size_t decode_block(size_t block, uint32_t* out) const;
+  // the same with the decoder chosen by the caller, for benchmarks
+  size_t decode_block(size_t block, uint32_t* out, bool simd) const;
+  std::vector<uint32_t> decode() const;
+
+private:
+  const char* data = nullptr;
+  uint32_t count   = 0;
+};
+
+// Walks a posting list forwards to look up ascending ids without decoding all of it: the skip
+// entries are searched exponentially from the current block, only the block an id would be in is
+// decoded.
+class PostingCursor {
+public:
+  PostingCursor(const PostingList& list) : list(list) {}
+
+  // true if id is in the list, ids must be asked for in ascending order
+  bool seek(uint32_t id);
+
+private:
+  PostingList list;
+  size_t block   = 0;
+  size_t decoded = SIZE_MAX;
+  uint32_t ids[POSTINGS_BLOCK_SIZE];
+  size_t count    = 0;
+  size_t position = 0;
+};
+
+// decode functions, picked once by what the cpu can do
+size_t decode_stream_vbyte_scalar(const uint8_t* control, const uint8_t* bytes, size_t count, uint32_t previous, uint32_t* out);
+size_t decode_stream_vbyte_simd(const uint8_t* control, const uint8_t* bytes, const uint8_t* bytes_end, size_t count, uint32_t previous, uint32_t* out);
+bool postings_simd_supported();
+
+void encode_postings(const std::vector<uint32_t>& ids, std::string& out) {
+  size_t blocks = (ids.size() + POSTINGS_BLOCK_SIZE - 1) / POSTINGS_BLOCK_SIZE;
+  size_t start  = out.size();
+  out.resize(start + blocks * sizeof(PostingSkip));
+
+  uint32_t previous = 0;
+  size_t data_start = out.size();
+  for (size_t block = 0; block < blocks; block++) {
+    size_t first = block * POSTINGS_BLOCK_SIZE;
+    size_t count = std::min<size_t>(POSTINGS_BLOCK_SIZE, ids.size() - first);
+
+    size_t control = out.size();
+    out.append((count + 3) / 4, '\0');
+    for (size_t i = 0; i < count; i++) {
+      uint32_t delta = ids[first + i] - previous;
+      previous       = ids[first + i];
+
+      uint8_t length = delta < (1u << 8) ? 1 : delta < (1u << 16) ? 2 : delta < (1u << 24) ? 3 : 4;
+      out[control + i / 4] |= (char)((length - 1) << (2 * (i % 4)));
+      for (uint8_t b = 0; b < length; b++) {
+        out.push_back((char)(delta >> (8 * b)));
+      }
+    }
+
+    PostingSkip skip{previous, (uint32_t)(out.size() - data_start)};
+    std::memcpy(&out[start + block * sizeof(PostingSkip)], &skip, sizeof(skip));
+  }
+  out.resize((out.size() + 3) & ~(size_t)3, '\0');
+}
+
+size_t PostingList::encoded_size() const {
+  size_t blocks = block_count();
+  if (blocks == 0) return 0;
+  return (blocks * sizeof(PostingSkip) + skip(blocks - 1).end + 3) & ~(size_t)3;
+}
+
+size_t PostingList::decode_block(size_t block, uint32_t* out) const {
+  static const bool simd = postings_simd_supported();
+  return decode_block(block, out, simd);
+}
+
+size_t PostingList::decode_block(size_t block, uint32_t* out, bool simd) const {
+  size_t blocks        = block_count();
+  size_t first         = block * POSTINGS_BLOCK_SIZE;
+  size_t n             = std::min<size_t>(POSTINGS_BLOCK_SIZE, count - first);
+  const uint8_t* base  = reinterpret_cast<const uint8_t*>(data) + blocks * sizeof(PostingSkip);
+  const uint8_t* start = base + (block == 0 ? 0 : skip(block - 1).end);
+  const uint8_t* end   = base + skip(block).end;
+  uint32_t previous    = block == 0 ? 0 : skip(block - 1).last_id;
+  const uint8_t* bytes = start + (n + 3) / 4;
+
+  if (simd) return decode_stream_vbyte_simd(start, bytes, end, n, previous, out);
+  return decode_stream_vbyte_scalar(start, bytes, n, previous, out);
+}
+
+std::vector<uint32_t> PostingList::decode() const {
+  std::vector<uint32_t> ids(count);
+  for (size_t block = 0; block < block_count(); block++) {
+    decode_block(block, ids.data() + block * POSTINGS_BLOCK_SIZE);
+  }
+  return ids;
+}
+
+bool PostingCursor::seek(uint32_t id) {
+  size_t blocks = list.block_count();
+  if (block == blocks) return false;
+
+  if (list.skip(block).last_id < id) {
+    // gallop to a block that ends at or after id, then narrow it down
+    size_t low  = block;
+    size_t step = 1;
+    while (low + step < blocks && list.skip(low + step).last_id < id) {
+      low += step;
+      step *= 2;
+    }
+    size_t high = std::min(low + step, blocks);
+    while (low + 1 < high) {
+      size_t middle = low + (high - low) / 2;
+      if (list.skip(middle).last_id < id) {
+        low = middle;
+      } else {
+        high = middle;
+      }
+    }
+    block = high;
+    if (block == blocks) return false;
+  }
+
+  if (block != decoded) {
+    count    = list.decode_block(block, ids);
+    decoded  = block;
+    position = 0;
+  }
+  while (position < count && ids[position] < id) position++;
+  return position < count && ids[position] == id;
+}
+
+size_t decode_stream_vbyte_scalar(const uint8_t* control, const uint8_t* bytes, size_t count, uint32_t previous, uint32_t* out) {
+  for (size_t i = 0; i < count; i++) {
+    uint8_t length = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+    uint32_t delta = 0;
+    for (uint8_t b = 0; b < length; b++) {
+      delta |= (uint32_t)bytes[b] << (8 * b);
+    }
+    bytes += length;
+    previous += delta;
+    out[i] = previous;
+  }
+  return count;
+}
+
+#ifdef POSTINGS_X86
+
+// for every control byte, the shuffle that spreads its four deltas over four 32 bit lanes and the
+// number of data bytes they take
+struct StreamVByteTables {
+  std::array<std::array<uint8_t, 16>, 256> shuffles;
+  std::array<uint8_t, 256> lengths;
+
+  StreamVByteTables() {
+    for (unsigned control = 0; control < 256; control++) {
+      uint8_t offset = 0;
+      for (unsigned lane = 0; lane < 4; lane++) {
+        uint8_t length = ((control >> (2 * lane)) & 3) + 1;
+        for (unsigned b = 0; b < 4; b++) {
+          // a set high bit makes the shuffle write a zero
+          shuffles[control][lane * 4 + b] = b < length ? offset + b : 0x80;
+        }
+        offset += length;
+      }
+      lengths[control] = offset;
+    }
+  }
+};
+
+__attribute__((target("ssse3"))) size_t decode_stream_vbyte_simd(const uint8_t* control, const uint8_t* bytes, const uint8_t* bytes_end, size_t count, uint32_t previous, uint32_t* out) {
+  static const StreamVByteTables tables;
+
+  size_t i      = 0;
+  __m128i carry = _mm_set1_epi32(previous);
+  // a shuffle loads 16 bytes, the last quads go the scalar way so nothing past the list is read
+  for (; i + 4 <= count && bytes + 16 <= bytes_end; i += 4) {
+    uint8_t byte   = control[i / 4];
+    __m128i data   = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes));
+    __m128i shuf   = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.shuffles[byte].data()));
+    __m128i deltas = _mm_shuffle_epi8(data, shuf);
+    bytes += tables.lengths[byte];
+
+    // prefix sum of the four lanes, then add the last id before them
+    deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 4));
+    deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 8));
+    __m128i ids = _mm_add_epi32(deltas, carry);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), ids);
+    carry = _mm_shuffle_epi32(ids, 0xff);
+  }
+
+  if (i == count) return count;
+  previous = i == 0 ? previous : out[i - 1];
+  // the remaining control bytes start at a whole byte, since i is a multiple of four
+  return i + decode_stream_vbyte_scalar(control + i / 4, bytes, count - i, previous, out + i);
+}
+
+bool postings_simd_supported() {
+  return __builtin_cpu_supports("ssse3");
+}
+
+#else
+
+size_t decode_stream_vbyte_simd(const uint8_t* control, const uint8_t* bytes, const uint8_t*, size_t count, uint32_t previous, uint32_t* out) {
+  return decode_stream_vbyte_scalar(control, bytes, count, previous, out);
+}
+
+bool postings_simd_supported() {
+  return false;
+}
+
+#endif
+
+#endif
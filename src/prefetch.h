@@ -0,0 +1,68 @@
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// bounds for the number of files kept open and advised ahead of the one being scanned
+#define PREFETCH_MIN_WINDOW 1
+#define PREFETCH_MAX_WINDOW 64
+// only the start of huge files is advised, the rest is left to the kernel's sequential readahead
+#define PREFETCH_MAX_BYTES (16 << 20)
+// weight of the newest sample in the moving averages
+#define PREFETCH_SMOOTHING 0.2
+
+// opens the file and issues posix_fadvise(WILLNEED) on it, returns -1 if it can't be opened
+int prefetch_open(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, PREFETCH_MAX_BYTES, POSIX_FADV_WILLNEED);
+#endif
+  }
+  return fd;
+}
+
+// How many files every scanner should have opened and advised ahead of the one it is scanning, so
+// cold reads overlap with matching of earlier files.
+//
+// The window adapts to how fast files are matched compared to how fast they arrive from storage:
+// to hide the read latency of one file, about match_rate / io_rate files must be in flight before it.
+class PrefetchWindow {
+public:
+  // feeds back how long scanning a file took, called by every scanner
+  void report(size_t bytes, double seconds);
+
+  size_t size() const { return window.load(std::memory_order_relaxed); }
+
+private:
+  std::mutex lock;
+  // fastest recent throughput, files that were already cached are scanned at about this rate
+  double match_rate = 0.0;
+  // throughput of every scan, including the time spent waiting for storage
+  double io_rate = 0.0;
+  std::atomic<size_t> window{PREFETCH_MIN_WINDOW};
+};
+
+void PrefetchWindow::report(size_t bytes, double seconds) {
+  // tiny files say more about per file overhead than about storage
+  if (bytes < 4096 || seconds <= 0.0) return;
+
+  std::lock_guard<std::mutex> guard(lock);
+  double rate = bytes / seconds;
+  io_rate     = io_rate == 0.0 ? rate : io_rate + PREFETCH_SMOOTHING * (rate - io_rate);
+  // decays slowly so a single lucky sample doesn't pin the estimate forever
+  match_rate = std::max(rate, match_rate * (1.0 - PREFETCH_SMOOTHING / 10));
+
+  double wanted = std::ceil(match_rate / io_rate);
+  window.store(std::clamp(static_cast<size_t>(wanted), (size_t)PREFETCH_MIN_WINDOW, (size_t)PREFETCH_MAX_WINDOW), std::memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef _QUERY_H_
+#define _QUERY_H_
+
+#include "parser.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class QueryOp : uint8_t {
+  ID,
+  NOT,
+  AND,
+  OR,
+};
+
+struct QueryNode {
+  QueryOp op;
+  // identifier index for ID, operand for NOT, left operand for AND and OR
+  uint32_t left;
+  // right operand for AND and OR
+  uint32_t right;
+};
+
+// Per thread state of an evaluation. Every thread searching with the same Query owns one.
+struct QueryScratch {
+  enum : unsigned char {
+    UNSEARCHED = 0,
+    FOUND,
+    MISSING,
+  };
+
+  // one entry per identifier of the query
+  std::vector<unsigned char> ids;
+};
+
+// The parsed expression flattened into an immutable array of nodes, so it can be shared by every
+// thread that searches. All mutable state of an evaluation lives in a QueryScratch.
+//
+// Identifiers are only searched for when the evaluation reaches them: in "cats and dogs" a line
+// without "cats" is never searched for "dogs".
+class Query {
+public:
+  // fails with EvalStatus::ERR on trees Parser::eval wouldn't know how to handle either
+  EvalStatus compile(Parser& parser);
+
+  QueryScratch scratch() const;
+
+  EvalStatus eval(std::string_view input, QueryScratch& scratch, bool* value) const;
+
+  // Streaming evaluation for input that is searched in pieces. Consecutive pieces passed to
+  // eval_feed must overlap by max_id_length() - 1 bytes so no identifier is split between them.
+  void eval_begin(QueryScratch& scratch) const;
+  void eval_feed(std::string_view piece, QueryScratch& scratch) const;
+  EvalStatus eval_end(QueryScratch& scratch, bool* value) const;
+
+  size_t max_id_length() const;
+  const std::vector<std::string>& get_ids() const { return ids; }
+  const std::vector<QueryNode>& get_nodes() const { return nodes; }
+  uint32_t get_root() const { return root; }
+
+private:
+  EvalStatus compile_node(const std::shared_ptr<Node>& node, uint32_t* index);
+  uint32_t add_id(std::string_view text);
+  uint32_t add_node(QueryOp op, uint32_t left, uint32_t right);
+  bool eval_node(uint32_t index, std::string_view input, QueryScratch& scratch) const;
+
+  std::vector<std::string> ids;
+  std::vector<QueryNode> nodes;
+  uint32_t root = 0;
+};
+
+EvalStatus Query::compile(Parser& parser) {
+  ids.clear();
+  nodes.clear();
+  return compile_node(parser.get_root(), &root);
+}
+
+uint32_t Query::add_id(std::string_view text) {
+  for (uint32_t i = 0; i < ids.size(); i++) {
+    if (ids[i] == text) return i;
+  }
+  ids.emplace_back(text);
+  return ids.size() - 1;
+}
+
+uint32_t Query::add_node(QueryOp op, uint32_t left, uint32_t right) {
+  nodes.push_back({op, left, right});
+  return nodes.size() - 1;
+}
+
+// mirrors the shapes Parser::eval_tree accepts, an EXPR chain "a op b op c" folds from the left
+EvalStatus Query::compile_node(const std::shared_ptr<Node>& node, uint32_t* index) {
+  if (!node) {
+    std::cerr << "node is null value\n";
+    return EvalStatus::ERR;
+  }
+
+  const std::vector<std::shared_ptr<Node>>& children = node->children;
+
+  if (children.size() == 1) {
+    return compile_node(children[0], index);
+  }
+
+  if (node->kind == NodeKind::ID) {
+    if (!node->token.has_value()) {
+      std::cerr << "token has no value\n";
+      return EvalStatus::ERR;
+    }
+    *index = add_node(QueryOp::ID, add_id(node->token.value().text), 0);
+    return EvalStatus::OK;
+  }
+
+  if (children.size() == 2 && children[0] && children[1]) {
+    if (children[0]->kind != NodeKind::NOT || (children[1]->kind != NodeKind::EXPR && children[1]->kind != NodeKind::ID)) {
+      std::cerr << "Don't know how to handle node\n";
+      return EvalStatus::ERR;
+    }
+
+    uint32_t operand;
+    if (compile_node(children[1], &operand) != EvalStatus::OK) return EvalStatus::ERR;
+    *index = add_node(QueryOp::NOT, operand, 0);
+    return EvalStatus::OK;
+  }
+
+  if (node->kind != NodeKind::EXPR || children.size() % 2 == 0 || children.size() < 3) {
+    std::cerr << "Don't know how to handle node\n";
+    return EvalStatus::ERR;
+  }
+
+  uint32_t result;
+  if (compile_node(children[0], &result) != EvalStatus::OK) return EvalStatus::ERR;
+
+  for (size_t i = 1; i < children.size(); i += 2) {
+    const std::shared_ptr<Node>& operator_node = children[i];
+    if (!operator_node || !operator_node->token.has_value()) {
+      std::cerr << "Don't know how to handle node\n";
+      return EvalStatus::ERR;
+    }
+
+    TokenKind kind = operator_node->token.value().kind;
+    if (kind != TokenKind::AND && kind != TokenKind::OR) {
+      std::cerr << "Don't know how to handle node\n";
+      return EvalStatus::ERR;
+    }
+
+    uint32_t operand;
+    if (compile_node(children[i + 1], &operand) != EvalStatus::OK) return EvalStatus::ERR;
+    result = add_node(kind == TokenKind::AND ? QueryOp::AND : QueryOp::OR, result, operand);
+  }
+
+  *index = result;
+  return EvalStatus::OK;
+}
+
+QueryScratch Query::scratch() const {
+  QueryScratch scratch;
+  scratch.ids.resize(ids.size(), QueryScratch::UNSEARCHED);
+  return scratch;
+}
+
+EvalStatus Query::eval(std::string_view input, QueryScratch& scratch, bool* value) const {
+  if (nodes.empty()) return EvalStatus::ERR;
+
+  std::fill(scratch.ids.begin(), scratch.ids.end(), QueryScratch::UNSEARCHED);
+  *value = eval_node(root, input, scratch);
+  return EvalStatus::OK;
+}
+
+bool Query::eval_node(uint32_t index, std::string_view input, QueryScratch& scratch) const {
+  const QueryNode& node = nodes[index];
+  switch (node.op) {
+    case QueryOp::ID: {
+      unsigned char& state = scratch.ids[node.left];
+      if (state == QueryScratch::UNSEARCHED) {
+        state = input.find(ids[node.left]) != std::string_view::npos ? QueryScratch::FOUND : QueryScratch::MISSING;
+      }
+      return state == QueryScratch::FOUND;
+    }
+    case QueryOp::NOT:
+      return !eval_node(node.left, input, scratch);
+    case QueryOp::AND:
+      return eval_node(node.left, input, scratch) && eval_node(node.right, input, scratch);
+    case QueryOp::OR:
+      return eval_node(node.left, input, scratch) || eval_node(node.right, input, scratch);
+  }
+  return false;
+}
+
+void Query::eval_begin(QueryScratch& scratch) const {
+  std::fill(scratch.ids.begin(), scratch.ids.end(), QueryScratch::MISSING);
+}
+
+void Query::eval_feed(std::string_view piece, QueryScratch& scratch) const {
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (scratch.ids[i] != QueryScratch::FOUND && piece.find(ids[i]) != std::string_view::npos) {
+      scratch.ids[i] = QueryScratch::FOUND;
+    }
+  }
+}
+
+EvalStatus Query::eval_end(QueryScratch& scratch, bool* value) const {
+  if (nodes.empty()) return EvalStatus::ERR;
+
+  // every identifier is FOUND or MISSING by now, so nothing gets searched
+  *value = eval_node(root, std::string_view(), scratch);
+  return EvalStatus::OK;
+}
+
+size_t Query::max_id_length() const {
+  size_t length = 0;
+  for (const std::string& id : ids) {
+    length = std::max(length, id.size());
+  }
+  return length;
+}
+
+#endif
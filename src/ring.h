@@ -0,0 +1,204 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+// a waiting thread yields this many times before it starts sleeping
+#define RING_YIELD_LIMIT 64
+// how long a waiting thread sleeps between checks once it stopped yielding
+#define RING_SLEEP_US 50
+
+// Waits a little longer every round: yields first, then sleeps, like the walker's idle loop.
+class Backoff {
+public:
+  void wait();
+  void reset() { rounds = 0; }
+
+private:
+  size_t rounds = 0;
+};
+
+void Backoff::wait() {
+  if (rounds++ < RING_YIELD_LIMIT) {
+    std::this_thread::yield();
+  } else {
+    std::this_thread::sleep_for(std::chrono::microseconds(RING_SLEEP_US));
+  }
+}
+
+// Counters for tuning the pipeline. Waits are always counted, they are on the slow path anyway;
+// the depth is only sampled on every push when sample_depth is set.
+struct RingStats {
+  std::atomic<size_t> pushes{0};
+  // sum of the depth seen by every push, divided by pushes it gives the average depth
+  std::atomic<size_t> depth_total{0};
+  std::atomic<size_t> max_depth{0};
+  // pushes that found the ring full and pops that found it empty
+  std::atomic<size_t> full_waits{0};
+  std::atomic<size_t> empty_waits{0};
+};
+
+// Bounded lock free multi producer, multi consumer queue (Dmitry Vyukov's array queue). Every cell
+// carries a sequence number that tells producers and consumers whether it is free or filled for the
+// lap they are in, so claiming a cell is a single compare and swap on the shared position.
+//
+// Values come out in the order their positions were claimed. push blocks while the ring is full, pop
+// blocks while it is empty and returns false once it is closed and drained; both back off instead of
+// sleeping on a lock.
+template <typename T>
+class RingBuffer {
+public:
+  // capacity is rounded up to a power of two
+  RingBuffer(size_t capacity);
+
+  RingBuffer(const RingBuffer&)            = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  // moves value in and returns true, or leaves it alone if the ring is full
+  bool try_push(T& value);
+  bool try_pop(T& value);
+
+  bool push(T value);
+  bool pop(T& value);
+  // called once every producer is done, consumers drain what is left and stop
+  void close();
+
+  // number of values waiting, only a snapshot while other threads are working
+  size_t depth() const;
+  size_t capacity() const { return mask + 1; }
+
+  void set_sample_depth(bool sample) { sample_depth = sample; }
+  const RingStats& stats() const { return counters; }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  std::unique_ptr<Cell[]> cells;
+  size_t mask;
+  bool sample_depth = false;
+  // producers and consumers each get their own cache line
+  alignas(64) std::atomic<size_t> enqueue_pos{0};
+  alignas(64) std::atomic<size_t> dequeue_pos{0};
+  alignas(64) std::atomic<bool> closed{false};
+  RingStats counters;
+};
+
+template <typename T>
+RingBuffer<T>::RingBuffer(size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) size *= 2;
+
+  cells = std::make_unique<Cell[]>(size);
+  mask  = size - 1;
+  for (size_t i = 0; i < size; i++) {
+    cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+template <typename T>
+bool RingBuffer<T>::try_push(T& value) {
+  size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell          = &cells[pos & mask];
+    size_t seq    = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      // the cell is free for this lap, claim it
+      if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      // still filled from the previous lap
+      return false;
+    } else {
+      pos = enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+
+  cell->value = std::move(value);
+  cell->sequence.store(pos + 1, std::memory_order_release);
+
+  if (sample_depth) {
+    // consumers may already be past this value, the depth is never taken below zero
+    size_t head  = dequeue_pos.load(std::memory_order_relaxed);
+    size_t depth = pos + 1 > head ? pos + 1 - head : 0;
+    counters.pushes.fetch_add(1, std::memory_order_relaxed);
+    counters.depth_total.fetch_add(depth, std::memory_order_relaxed);
+    size_t max = counters.max_depth.load(std::memory_order_relaxed);
+    while (depth > max && !counters.max_depth.compare_exchange_weak(max, depth, std::memory_order_relaxed)) {}
+  }
+  return true;
+}
+
+template <typename T>
+bool RingBuffer<T>::try_pop(T& value) {
+  size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell          = &cells[pos & mask];
+    size_t seq    = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      // nothing was published in this cell yet
+      return false;
+    } else {
+      pos = dequeue_pos.load(std::memory_order_relaxed);
+    }
+  }
+
+  value = std::move(cell->value);
+  // frees the cell for the producers of the next lap
+  cell->sequence.store(pos + mask + 1, std::memory_order_release);
+  return true;
+}
+
+template <typename T>
+bool RingBuffer<T>::push(T value) {
+  if (try_push(value)) return true;
+
+  counters.full_waits.fetch_add(1, std::memory_order_relaxed);
+  Backoff backoff;
+  while (!closed.load(std::memory_order_acquire)) {
+    backoff.wait();
+    if (try_push(value)) return true;
+  }
+  return false;
+}
+
+template <typename T>
+bool RingBuffer<T>::pop(T& value) {
+  if (try_pop(value)) return true;
+
+  counters.empty_waits.fetch_add(1, std::memory_order_relaxed);
+  Backoff backoff;
+  while (true) {
+    // checked before the last try, so nothing pushed before close is missed
+    bool done = closed.load(std::memory_order_acquire);
+    if (try_pop(value)) return true;
+    if (done) return false;
+    backoff.wait();
+  }
+}
+
+template <typename T>
+void RingBuffer<T>::close() {
+  closed.store(true, std::memory_order_release);
+}
+
+template <typename T>
+size_t RingBuffer<T>::depth() const {
+  size_t head = dequeue_pos.load(std::memory_order_relaxed);
+  size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+  return tail > head ? tail - head : 0;
+}
+
+#endif
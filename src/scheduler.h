@@ -0,0 +1,79 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+// a file waiting to be searched, seq is its position in the order the output is written in
+struct ScheduledFile {
+  size_t seq;
+  std::string path;
+  size_t size;
+};
+
+// Reorders the files of a walk so the biggest ones are searched first. A big file found last would
+// otherwise keep a single thread busy long after every other file is done.
+//
+// The reordering is bounded: a file is handed out at the latest once `window` files found after it
+// are waiting, so the output, which is written in seq order, never stalls for long. The window must
+// not be larger than the sequencer's, or a worker could wait for a file that is still held back here.
+//
+// At most `lead` files found after the oldest waiting one are handed out before it. With a lead below
+// the number of workers, taking files in the order they are handed out, one of them is always free to
+// take the file whose output is written next, so the others can wait for memory without stalling.
+class Scheduler {
+public:
+  Scheduler(size_t window, size_t lead) : window(window), lead(lead) {}
+
+  // files must be added in seq order
+  void add(ScheduledFile file);
+  // true once a file has to be handed out to make room
+  bool ready() const { return files.size() >= window; }
+  bool empty() const { return files.empty(); }
+  // the biggest waiting file, or the oldest once it reached the edge of the window
+  ScheduledFile take();
+
+private:
+  // orders (size, seq) pairs so the last one is the biggest file, the oldest of equally big ones
+  struct BySize {
+    bool operator()(const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b) const {
+      return a.first != b.first ? a.first < b.first : a.second > b.second;
+    }
+  };
+
+  size_t window;
+  size_t lead;
+  // waiting files by seq, and (size, seq) of the same files to find the biggest
+  std::map<size_t, ScheduledFile> files;
+  std::set<std::pair<size_t, size_t>, BySize> by_size;
+  // seqs of the files handed out ahead of the oldest waiting one
+  std::set<size_t> ahead;
+  size_t newest = 0;
+};
+
+void Scheduler::add(ScheduledFile file) {
+  newest = file.seq;
+  by_size.insert({file.size, file.seq});
+  files.emplace(file.seq, std::move(file));
+}
+
+ScheduledFile Scheduler::take() {
+  size_t oldest = files.begin()->first;
+  size_t seq    = newest - oldest >= window || ahead.size() >= lead ? oldest : std::prev(by_size.end())->second;
+
+  auto it            = files.find(seq);
+  ScheduledFile file = std::move(it->second);
+  files.erase(it);
+  by_size.erase({file.size, file.seq});
+
+  if (seq != oldest) ahead.insert(seq);
+  // files the oldest waiting one has caught up with are no longer ahead of it
+  size_t next_oldest = files.empty() ? SIZE_MAX : files.begin()->first;
+  ahead.erase(ahead.begin(), ahead.lower_bound(next_oldest));
+  return file;
+}
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef _SEQUENCER_H_
+#define _SEQUENCER_H_
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "output.h"
+#include "ring.h"
+
+// messages from the workers waiting for the writer
+#define SEQUENCE_RING_SIZE 4096
+
+// Puts the output of files searched in parallel back into the order they were handed out in.
+//
+// Every file gets a sequence number. Workers deposit the output of a file in pieces tagged with its
+// number and a single writer thread writes them strictly in order. The output of the file currently
+// at the head is written as soon as it arrives, everything behind it waits in memory.
+//
+// Memory is bounded in two ways: a worker may only start a file that is less than `window` files
+// ahead of the head, and a worker that is not at the head waits while more than `max_bytes` are
+// waiting. The head is never held back, so the writer can always make progress. Files may be started
+// out of order, but fewer of them may be handed out ahead of the head than there are workers (see
+// Scheduler), so while the others wait for memory one worker is always left to start the head.
+//
+// Workers talk to the writer through a lock free ring, the slots are only touched by the writer.
+class Sequencer {
+public:
+  Sequencer(size_t window, size_t max_bytes)
+      : messages(SEQUENCE_RING_SIZE), slots(window), window(window), max_bytes(max_bytes) {}
+
+  // blocks until seq is close enough to the head to be searched
+  void begin(size_t seq);
+  // hands over output of seq, pieces of one file are written in the order they are deposited
+  void deposit(size_t seq, OutputPiece piece);
+  // no more output follows for seq
+  void finish(size_t seq);
+  // called once every sequence number has been finished
+  void close();
+
+  // the writer loop, returns once everything up to close was written
+  void run(OutputBuffer& out);
+
+  const RingStats& stats() const { return messages.stats(); }
+  size_t ring_capacity() const { return messages.capacity(); }
+  void set_sample_depth(bool sample) { messages.set_sample_depth(sample); }
+
+private:
+  struct Message {
+    size_t seq;
+    OutputPiece piece;
+    bool finished;
+  };
+
+  struct Slot {
+    std::deque<OutputPiece> pieces;
+    bool finished = false;
+  };
+
+  RingBuffer<Message> messages;
+  // slot of seq is slots[seq % window], seq is always within window of next
+  std::vector<Slot> slots;
+  size_t window;
+  size_t max_bytes;
+  // sequence number of the head, the file whose output is written next; only the writer moves it
+  std::atomic<size_t> next{0};
+  // bytes deposited but not written yet
+  std::atomic<size_t> buffered{0};
+};
+
+void Sequencer::begin(size_t seq) {
+  Backoff backoff;
+  while (seq >= next.load(std::memory_order_acquire) + window) {
+    backoff.wait();
+  }
+}
+
+void Sequencer::deposit(size_t seq, OutputPiece piece) {
+  // Several workers may see room at the same time, so the limit can be overshot by one piece per
+  // worker. That is still bounded, and checking and adding in one step would need a lock.
+  Backoff backoff;
+  while (true) {
+    if (seq == next.load(std::memory_order_acquire)) break;
+    if (buffered.load(std::memory_order_relaxed) + piece.size <= max_bytes) break;
+    backoff.wait();
+  }
+
+  buffered.fetch_add(piece.size, std::memory_order_relaxed);
+  messages.push({seq, std::move(piece), false});
+}
+
+void Sequencer::finish(size_t seq) {
+  messages.push({seq, OutputPiece(), true});
+}
+
+void Sequencer::close() {
+  messages.close();
+}
+
+void Sequencer::run(OutputBuffer& out) {
+  size_t head_seq = 0;
+
+  Message message;
+  while (messages.pop(message)) {
+    Slot& slot = slots[message.seq % window];
+    if (message.finished) {
+      slot.finished = true;
+    } else {
+      slot.pieces.push_back(std::move(message.piece));
+    }
+
+    // write everything the head has, and move on while heads are complete
+    while (true) {
+      Slot& head = slots[head_seq % window];
+      while (!head.pieces.empty()) {
+        out.write(head.pieces.front());
+        buffered.fetch_sub(head.pieces.front().size, std::memory_order_relaxed);
+        head.pieces.pop_front();
+      }
+      if (!head.finished) break;
+
+      head.finished = false;
+      next.store(++head_seq, std::memory_order_release);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _THROTTLE_H_
+#define _THROTTLE_H_
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+// Keeps work that moves bytes below a rate, for background jobs that shouldn't starve searches of
+// disk bandwidth. Every consume adds to a budget that refills at bytes_per_second; once it is
+// overdrawn the caller sleeps until it isn't. A rate of 0 doesn't limit anything.
+class Throttle {
+public:
+  explicit Throttle(uint64_t bytes_per_second) : rate(bytes_per_second), start(std::chrono::steady_clock::now()) {}
+
+  void consume(uint64_t bytes);
+
+private:
+  uint64_t rate;
+  uint64_t consumed = 0;
+  std::chrono::steady_clock::time_point start;
+};
+
+void Throttle::consume(uint64_t bytes) {
+  if (rate == 0) return;
+  consumed += bytes;
+
+  // the time the bytes so far are allowed to take, ahead of the clock means wait
+  auto allowed = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((double)consumed / rate));
+  auto now     = std::chrono::steady_clock::now();
+  if (allowed > now) std::this_thread::sleep_for(allowed - now);
+}
+
+#endif
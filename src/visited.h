@@ -0,0 +1,49 @@
+#ifndef _VISITED_H_
+#define _VISITED_H_
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_set>
+
+#include <sys/types.h>
+
+// number of independently locked parts of the set
+#define VISITED_SHARDS 64
+
+// what identifies a file no matter how many paths lead to it
+struct FileId {
+  uint64_t dev;
+  uint64_t inode;
+
+  bool operator==(const FileId& other) const { return dev == other.dev && inode == other.inode; }
+};
+
+struct FileIdHash {
+  size_t operator()(const FileId& id) const { return std::hash<uint64_t>()(id.inode * 0x9e3779b97f4a7c15ull ^ id.dev); }
+};
+
+// Set of the (dev, inode) pairs a walk has seen, shared by all walker threads. It is split into
+// shards by hash, each with its own lock, so threads rarely contend.
+class VisitedSet {
+public:
+  // true the first time id is inserted
+  bool insert(FileId id);
+
+private:
+  struct alignas(64) Shard {
+    std::mutex lock;
+    std::unordered_set<FileId, FileIdHash> ids;
+  };
+
+  Shard shards[VISITED_SHARDS];
+};
+
+bool VisitedSet::insert(FileId id) {
+  size_t hash  = FileIdHash()(id);
+  Shard& shard = shards[(hash >> 7) % VISITED_SHARDS];
+  std::lock_guard<std::mutex> guard(shard.lock);
+  return shard.ids.insert(id).second;
+}
+
+#endif
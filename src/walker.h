@@ -0,0 +1,331 @@
+#ifndef _WALKER_H_
+#define _WALKER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "filter.h"
+#include "ignore.h"
+#include "visited.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+  #include <sys/syscall.h>
+#endif
+
+// size of the buffer getdents64 fills per call
+#define WALK_DIRENT_BUFFER_SIZE (1 << 15)
+
+// An open directory. Subdirectories waiting in a queue hold on to their parent so they can be
+// opened with openat relative to it; the descriptor is closed once the last of them got opened.
+struct DirectoryHandle {
+  DirectoryHandle(int fd) : fd(fd) {}
+  ~DirectoryHandle() { close(fd); }
+
+  int fd;
+};
+
+// what a walk skips and what it reports
+struct WalkOptions {
+  // stat the files that are handed out to report their size
+  bool sizes = false;
+  // honor .gitignore and .ignore files
+  bool ignore = false;
+  // files whose name it rejects are dropped, before they are opened or stat'ed when d_type allows
+  const NameFilter* filter = nullptr;
+  // descend into symlinked directories; every file and directory is then visited once, however many
+  // links lead to it, which also keeps symlink loops from running forever. Without it only files with
+  // several hard links are checked, they are visited under the first name found.
+  bool follow = false;
+  // don't descend into directories on another filesystem than the root
+  bool one_file_system = false;
+};
+
+// Parallel recursive directory walker. Every worker owns a deque of directories that still have to
+// be expanded; it takes new work from the back of its own deque and, when that runs dry, steals from
+// the front of the others. Regular files are handed to the visitor as soon as they are found, from
+// whichever worker found them, so the order is not deterministic with more than one thread.
+//
+// Directories are read with getdents64 and d_type is trusted whenever the filesystem fills it in, so
+// directories and the entries that are dropped cost no stat. A regular file is stat'ed once before
+// it is handed out, for its size and for its link count, so a hard linked file is only searched once.
+// Path strings are only built for directories and for the regular files that are handed out.
+//
+// With ignore files enabled every directory is checked for .gitignore and .ignore, and entries they
+// exclude are dropped before anything else happens, so ignored directories are never opened.
+class Walker {
+public:
+  // size is 0 unless the walker was asked for sizes
+  using Visitor = std::function<void(std::string path, size_t size)>;
+
+  Walker(size_t threads, WalkOptions options = {});
+
+  // blocks until the whole tree under root has been visited
+  void walk(const std::string& root, const Visitor& visit);
+
+private:
+  struct PendingDirectory {
+    std::shared_ptr<DirectoryHandle> parent;
+    // full path as it is printed, the last component is opened relative to parent
+    std::string path;
+    size_t name_offset;
+    // rules inherited from the directories above, nullptr if there are none
+    std::shared_ptr<const IgnoreList> ignore;
+  };
+
+  struct WorkQueue {
+    std::mutex lock;
+    std::deque<PendingDirectory> directories;
+  };
+
+  enum class EntryKind {
+    SKIP,
+    DIRECTORY,
+    FILE,
+  };
+
+  void work(size_t id, const Visitor& visit);
+  bool pop_local(size_t id, PendingDirectory& directory);
+  bool steal(size_t id, PendingDirectory& directory);
+  void expand(size_t id, PendingDirectory& directory, const Visitor& visit);
+  EntryKind classify(int dir_fd, const char* name, unsigned char type, size_t* size, FileId* id, uint64_t* links);
+
+  std::vector<WorkQueue> queues;
+  WalkOptions options;
+  VisitedSet visited;
+  uint64_t root_dev = 0;
+  // directories queued or being expanded, the walk is over when it drops to zero
+  std::atomic<size_t> outstanding{0};
+};
+
+std::string join_path(const std::string& directory, std::string_view name) {
+  std::string path;
+  path.reserve(directory.size() + name.size() + 1);
+  path.append(directory);
+  if (!path.empty() && path.back() != '/') path.push_back('/');
+  path.append(name);
+  return path;
+}
+
+Walker::Walker(size_t threads, WalkOptions options) : queues(std::max<size_t>(threads, 1)), options(options) {}
+
+void Walker::walk(const std::string& root, const Visitor& visit) {
+  struct stat st;
+  if (options.one_file_system && stat(root.c_str(), &st) == 0) root_dev = st.st_dev;
+
+  outstanding = 1;
+  queues[0].directories.push_back({nullptr, root, 0, nullptr});
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < queues.size(); i++) {
+    workers.emplace_back(&Walker::work, this, i, std::cref(visit));
+  }
+  work(0, visit);
+
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+}
+
+void Walker::work(size_t id, const Visitor& visit) {
+  size_t idle = 0;
+  while (outstanding.load(std::memory_order_acquire) > 0) {
+    PendingDirectory directory;
+    if (pop_local(id, directory) || steal(id, directory)) {
+      expand(id, directory, visit);
+      outstanding.fetch_sub(1, std::memory_order_acq_rel);
+      idle = 0;
+    } else if (++idle < 64) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+}
+
+bool Walker::pop_local(size_t id, PendingDirectory& directory) {
+  WorkQueue& queue = queues[id];
+  std::lock_guard<std::mutex> guard(queue.lock);
+  if (queue.directories.empty()) return false;
+
+  directory = std::move(queue.directories.back());
+  queue.directories.pop_back();
+  return true;
+}
+
+bool Walker::steal(size_t id, PendingDirectory& directory) {
+  for (size_t i = 1; i < queues.size(); i++) {
+    WorkQueue& victim = queues[(id + i) % queues.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (victim.directories.empty()) continue;
+
+    directory = std::move(victim.directories.front());
+    victim.directories.pop_front();
+    return true;
+  }
+  return false;
+}
+
+// size, id and links are only overwritten when the entry had to be stat'ed anyway, which a DT_REG or
+// DT_DIR entry never is
+Walker::EntryKind Walker::classify(int dir_fd, const char* name, unsigned char type, size_t* size, FileId* id, uint64_t* links) {
+  if (type == DT_DIR) return EntryKind::DIRECTORY;
+  if (type == DT_REG) return EntryKind::FILE;
+
+  // Symlinks are followed to see if they point at a regular file, like directory_entry::is_regular_file
+  // did; a symlink to a directory is only descended into with follow. Filesystems that don't fill in
+  // d_type report DT_UNKNOWN and always need the stat.
+  if (type != DT_LNK && type != DT_UNKNOWN) return EntryKind::SKIP;
+
+  struct stat st;
+  if (fstatat(dir_fd, name, &st, type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW) != 0) return EntryKind::SKIP;
+  *id = {(uint64_t)st.st_dev, (uint64_t)st.st_ino};
+  if (S_ISREG(st.st_mode)) {
+    *size  = st.st_size;
+    *links = st.st_nlink;
+    return EntryKind::FILE;
+  }
+  if (S_ISDIR(st.st_mode) && (type == DT_UNKNOWN || options.follow)) return EntryKind::DIRECTORY;
+  return EntryKind::SKIP;
+}
+
+void Walker::expand(size_t id, PendingDirectory& directory, const Visitor& visit) {
+  int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+  int fd;
+  if (directory.parent) {
+    fd = openat(directory.parent->fd, directory.path.c_str() + directory.name_offset, options.follow ? flags : flags | O_NOFOLLOW);
+  } else {
+    fd = open(directory.path.c_str(), flags);
+  }
+  // the parent is closed as soon as none of its subdirectories need it anymore
+  directory.parent.reset();
+
+  if (fd < 0) {
+    std::cerr << directory.path << ": " << std::strerror(errno) << '\n';
+    return;
+  }
+  auto handle = std::make_shared<DirectoryHandle>(fd);
+
+  // the device of the directory, which its files share
+  uint64_t dev = 0;
+  if (options.follow || options.one_file_system) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return;
+    dev = st.st_dev;
+    if (options.one_file_system && dev != root_dev) return;
+    // a directory reached through a second link, or a loop back to a directory above
+    if (options.follow && !visited.insert({dev, (uint64_t)st.st_ino})) return;
+  }
+
+  std::shared_ptr<const IgnoreList> rules = directory.ignore;
+  if (options.ignore) rules = IgnoreList::load(fd, directory.path, std::move(rules));
+
+  std::vector<PendingDirectory> subdirectories;
+  auto add_entry = [&](const char* name, unsigned char type, uint64_t inode) {
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) return;
+    // a regular file the filter rejects costs nothing but the name compare
+    const NameFilter* filter = options.filter;
+    if (filter && type == DT_REG && !filter->accepts(name)) return;
+
+    // when d_type tells files from directories the rules are checked before anything is stat'ed
+    bool known = type == DT_REG || type == DT_DIR;
+    std::string path;
+    if (rules && known) {
+      path = join_path(directory.path, name);
+      if (rules->ignored(path, name, type == DT_DIR)) return;
+    }
+
+    size_t size    = 0;
+    uint64_t links = 1;
+    FileId id{dev, inode};
+    EntryKind kind = classify(fd, name, type, &size, &id, &links);
+    if (kind == EntryKind::SKIP) return;
+    if (filter && kind == EntryKind::FILE && type != DT_REG && !filter->accepts(name)) return;
+    // the repository itself is never searched when ignore files are honored, like git never lists it
+    if (options.ignore && kind == EntryKind::DIRECTORY && std::strcmp(name, ".git") == 0) return;
+
+    if (path.empty()) path = join_path(directory.path, name);
+    if (rules && !known && rules->ignored(path, name, kind == EntryKind::DIRECTORY)) return;
+
+    if (kind == EntryKind::DIRECTORY) {
+      size_t offset = path.size() - std::strlen(name);
+      subdirectories.push_back({handle, std::move(path), offset, rules});
+    } else {
+      // the size and link count are all d_type can't tell, only the files that are handed out are
+      // stat'ed for them
+      if (type == DT_REG) {
+        struct stat st;
+        if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return;
+        size  = st.st_size;
+        links = st.st_nlink;
+        id    = {(uint64_t)st.st_dev, (uint64_t)st.st_ino};
+      }
+      if (options.one_file_system && id.dev != root_dev) return;
+      // hard links, and with follow symlinks to files that are visited anyway; directories are
+      // checked once opened
+      if ((options.follow || links > 1) && !visited.insert(id)) return;
+      visit(std::move(path), options.sizes ? size : 0);
+    }
+  };
+
+#ifdef __linux__
+  struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+  };
+
+  alignas(linux_dirent64) char buffer[WALK_DIRENT_BUFFER_SIZE];
+  while (true) {
+    long n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << directory.path << ": " << std::strerror(errno) << '\n';
+      break;
+    }
+    if (n == 0) break;
+
+    for (long offset = 0; offset < n;) {
+      auto* entry = reinterpret_cast<linux_dirent64*>(buffer + offset);
+      add_entry(entry->d_name, entry->d_type, entry->d_ino);
+      offset += entry->d_reclen;
+    }
+  }
+#else
+  // readdir owns the descriptor it is given, the handle keeps its own copy for openat
+  DIR* dir = fdopendir(dup(fd));
+  if (dir) {
+    while (dirent* entry = readdir(dir)) {
+      add_entry(entry->d_name, entry->d_type, entry->d_ino);
+    }
+    closedir(dir);
+  }
+#endif
+
+  if (subdirectories.empty()) return;
+
+  outstanding.fetch_add(subdirectories.size(), std::memory_order_acq_rel);
+  WorkQueue& queue = queues[id];
+  std::lock_guard<std::mutex> guard(queue.lock);
+  for (PendingDirectory& subdirectory : subdirectories) {
+    queue.directories.push_back(std::move(subdirectory));
+  }
+}
+
+#endif
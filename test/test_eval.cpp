@@ -1,6 +1,23 @@
 #include <gtest/gtest.h>
 
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+#include "bitmap.h"
+#include "bloom_cache.h"
+#include "chunks.h"
+#include "ignore.h"
+#include "intersect.h"
 #include "parser.h"
+#include "planner.h"
+#include "postings.h"
+#include "prefetch.h"
+#include "query.h"
+#include "ring.h"
+#include "scheduler.h"
+#include "sequencer.h"
+#include "walker.h"
 
 void parser_eval_test(std::string_view input, std::set<std::string_view> expected_id, std::string_view search, bool expected_result) {
   Parser p(input);
@@ -492,4 +509,1344 @@ TEST(ParserTest, ParserEvalTest) {
       "There is pizza burgers",
       false /**/
   );
-}
\ No newline at end of file
+}
+
+void parser_stream_eval_test(std::string_view input, std::string_view search, size_t piece_size, bool expected_result) {
+  Parser p(input);
+  ASSERT_EQ(p.parse(), ParseStatus::OK) << "Parse failed with input: " << input;
+
+  size_t overlap = std::max<size_t>(p.max_id_length(), 1) - 1;
+
+  p.eval_begin();
+  while (search.size() > piece_size) {
+    p.eval_feed(search.substr(0, piece_size));
+    search.remove_prefix(piece_size - overlap);
+  }
+  p.eval_feed(search);
+
+  bool actual_value;
+  ASSERT_EQ(p.eval_end(&actual_value), EvalStatus::OK) << "Eval failed with input: " << input;
+  ASSERT_EQ(expected_result, actual_value) << "Streaming eval expected value does not match with actual value. input: " << input;
+}
+
+TEST(ParserTest, ParserStreamEvalTest) {
+  // "camel" straddles the piece boundary and must still be found
+  parser_stream_eval_test("camel", "the cam" "els are here", 7, true);
+  parser_stream_eval_test("camel", "the cam" "els are here", 100, true);
+  parser_stream_eval_test("not camel", "the cam" "els are here", 7, false);
+  parser_stream_eval_test("dog and not cat", "a dog, a ca" "r and a bird", 11, true);
+  parser_stream_eval_test("dog and not cat", "a dog, a ca" "t and a bird", 11, false);
+  parser_stream_eval_test("( fish or dog ) and not cat", "fis" "hhhhhhhh", 5, true);
+}
+
+void query_eval_test(std::string_view input, std::string_view search) {
+  Parser p(input);
+  ASSERT_EQ(p.parse(), ParseStatus::OK) << "Parse failed with input: " << input;
+
+  Query query;
+  ASSERT_EQ(query.compile(p), EvalStatus::OK) << "Compile failed with input: " << input;
+  QueryScratch scratch = query.scratch();
+
+  bool expected_value;
+  bool actual_value;
+  ASSERT_EQ(p.eval(search, &expected_value), EvalStatus::OK) << "Eval failed with search: " << search;
+  ASSERT_EQ(query.eval(search, scratch, &actual_value), EvalStatus::OK) << "Query eval failed with search: " << search;
+  ASSERT_EQ(expected_value, actual_value) << "Compiled query disagrees with the parser. input: " << input << " search: " << search;
+}
+
+TEST(QueryTest, QueryMatchesParserTest) {
+  const char* inputs[] = {
+      "dog",
+      "not dog",
+      "dog or cat and pig",
+      "not not",
+      "not ( cats or dogs )",
+      "not cats and not dogs",
+      "cat and not dog or fish",
+      "( not cats ) and ( not dogs ) or giraffes",
+      "not ( not cats or ( dogs or camels ) ) or shark",
+      "main and not \\(",
+      "and and and or or or or",
+  };
+  const char* searches[] = {
+      "",
+      "cats",
+      "dogs and cats",
+      "a cat named pig",
+      "giraffes and shark",
+      "int main(",
+      "not a fish, or is it",
+  };
+
+  for (const char* input : inputs) {
+    for (const char* search : searches) {
+      query_eval_test(input, search);
+    }
+  }
+}
+
+TEST(WalkerTest, GlobMatchTest) {
+  struct {
+    const char* pattern;
+    const char* text;
+    bool expected = false;
+  } cases[] = {
+      {"*.o", "main.o", true},
+      {"*.o", "main.c", false},
+      {"*.o", "dir/main.o", false},
+      {"a*", "a", true},
+      {"?.c", "a.c", true},
+      {"?.c", "ab.c", false},
+      {"a?b", "a/b", false},
+      {"**/build", "build", true},
+      {"**/build", "x/y/build", true},
+      {"src/**", "src/a/b", true},
+      {"src/**", "lib/a", false},
+      {"a/**/b", "a/b", true},
+      {"a/**/b", "a/x/y/b", true},
+      {"a/**/b", "a/x/c", false},
+      {"[abc].txt", "b.txt", true},
+      {"[!abc].txt", "b.txt", false},
+      {"[!abc].txt", "d.txt", true},
+      {"[a-c]x", "cx", true},
+      {"[a-c]x", "dx", false},
+      {"[]]", "]", true},
+      {"a[/]b", "a/b", false},
+      {"\\*", "*", true},
+      {"\\*", "a", false},
+      {"[ab", "[ab", true},
+  };
+  for (const auto& c : cases) {
+    EXPECT_EQ(glob_match(c.pattern, c.text), c.expected) << "pattern: " << c.pattern << " text: " << c.text;
+  }
+}
+
+// an empty directory of its own for the running test, so tests writing the same names don't collide
+std::string test_directory() {
+  const testing::TestInfo* info = testing::UnitTest::GetInstance()->current_test_info();
+  std::string directory         = testing::TempDir() + info->test_suite_name() + "." + info->name();
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+  return directory;
+}
+
+// writes a file of a test tree, with the directories it is in
+void write_test_file(const std::string& path, const std::string& contents) {
+  std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+  std::ofstream(path) << contents;
+}
+
+// the files a walk of directory visits, relative to it and sorted
+std::vector<std::string> walked_files(const std::string& directory, WalkOptions options) {
+  std::mutex lock;
+  std::vector<std::string> files;
+  Walker walker(2, options);
+  walker.walk(directory, [&](std::string path, size_t) {
+    std::lock_guard<std::mutex> guard(lock);
+    files.push_back(path.substr(directory.size() + 1));
+  });
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+TEST(WalkerTest, IgnoreFilesTest) {
+  std::string directory = testing::TempDir() + "ignore_test";
+  std::filesystem::remove_all(directory);
+  write_test_file(directory + "/.gitignore", "# a comment\n*.log\n!keep.log\nbuild/\n/top.txt\ndocs/*.md\n");
+  // rules of a nested ignore file win over those of the directories above
+  write_test_file(directory + "/sub/.ignore", "!*.log\nx?.c\n");
+  for (const char* name : {"a.log", "keep.log", "top.txt", "c.txt", "build/x.c", "docs/a.md", "docs/sub/b.md", ".git/config",
+                           "sub/top.txt", "sub/build", "sub/a.log", "sub/x1.c", "sub/x12.c", "sub/deep/b.log"}) {
+    write_test_file(directory + "/" + name, "text\n");
+  }
+
+  std::vector<std::string> expected = {
+      ".gitignore",
+      // only a file in the directory of the ignore file is excluded by an anchored pattern
+      "c.txt",
+      // "*" doesn't match "/"
+      "docs/sub/b.md",
+      "keep.log",
+      "sub/.ignore",
+      "sub/a.log",
+      // "build/" only excludes directories
+      "sub/build",
+      "sub/deep/b.log",
+      "sub/top.txt",
+      "sub/x12.c",
+  };
+  for (bool sizes : {false, true}) {
+    WalkOptions options;
+    options.ignore = true;
+    options.sizes  = sizes;
+    EXPECT_EQ(walked_files(directory, options), expected) << "sizes: " << sizes;
+  }
+
+  EXPECT_EQ(walked_files(directory, {}).size(), 16u);
+  std::filesystem::remove_all(directory);
+}
+
+TEST(WalkerTest, NameFilterTest) {
+  NameFilter filter;
+  filter.add("*.c", NameFilter::INCLUDE);
+  filter.add("*.h", NameFilter::INCLUDE);
+  filter.add("Makefile", NameFilter::INCLUDE);
+  filter.add("test_*", NameFilter::EXCLUDE);
+  filter.add("[ab]?.h", NameFilter::EXCLUDE);
+  filter.compile();
+
+  // any include glob will do, and no exclude glob may match
+  for (const char* name : {"main.c", "main.h", "Makefile", "x.c", "abc.h", "c1.h"}) {
+    EXPECT_TRUE(filter.accepts(name)) << "name: " << name;
+  }
+  for (const char* name : {"main.cpp", "main.c.o", "makefile", "test_main.c", "a1.h", "bz.h", ".c.txt", ""}) {
+    EXPECT_FALSE(filter.accepts(name)) << "name: " << name;
+  }
+
+  // without include globs everything the excludes leave is accepted
+  NameFilter excludes;
+  excludes.add("*.o", NameFilter::EXCLUDE);
+  excludes.compile();
+  EXPECT_TRUE(excludes.accepts("main.c"));
+  EXPECT_FALSE(excludes.accepts("main.o"));
+
+  NameFilter types;
+  EXPECT_FALSE(types.add_type("cobol"));
+  ASSERT_TRUE(types.add_type("cmake"));
+  types.compile();
+  EXPECT_TRUE(types.accepts("CMakeLists.txt"));
+  EXPECT_TRUE(types.accepts("gtest.cmake"));
+  EXPECT_FALSE(types.accepts("notes.txt"));
+
+  // a walk only hands out the files the filter accepts, directories are descended into whatever their name
+  std::string directory = testing::TempDir() + "filter_test";
+  std::filesystem::remove_all(directory);
+  for (const char* name : {"main.c", "test_main.c", "src.c/util.h", "src.c/a1.h", "docs/Makefile", "docs/readme.md"}) {
+    write_test_file(directory + "/" + name, "text\n");
+  }
+  WalkOptions options;
+  options.filter = &filter;
+  EXPECT_EQ(walked_files(directory, options), std::vector<std::string>({"docs/Makefile", "main.c", "src.c/util.h"}));
+  std::filesystem::remove_all(directory);
+}
+
+TEST(WalkerTest, LinksTest) {
+  std::string directory = test_directory();
+  for (const char* name : {"a.txt", "sub/b.txt", "other/c.txt"}) {
+    write_test_file(directory + "/" + name, "text\n");
+  }
+  // a loop back to the root, a second link to a directory and a hard linked pair
+  std::filesystem::create_directory_symlink("..", directory + "/sub/up");
+  std::filesystem::create_directory_symlink("../other", directory + "/sub/again");
+  std::filesystem::create_hard_link(directory + "/a.txt", directory + "/sub/a-link.txt");
+
+  // without follow symlinked directories are left out, and a hard linked file is visited once
+  std::vector<std::string> files = walked_files(directory, {});
+  EXPECT_EQ(files.size(), 3u);
+  EXPECT_EQ(std::count(files.begin(), files.end(), "other/c.txt"), 1);
+  EXPECT_EQ(std::count(files.begin(), files.end(), "a.txt") + std::count(files.begin(), files.end(), "sub/a-link.txt"), 1);
+
+  // with follow the walk ends despite the loop, and every file is still visited once
+  WalkOptions options;
+  options.follow = true;
+  files          = walked_files(directory, options);
+  EXPECT_EQ(files.size(), 3u);
+  EXPECT_EQ(std::count(files.begin(), files.end(), "sub/b.txt"), 1);
+  EXPECT_EQ(std::count(files.begin(), files.end(), "other/c.txt") + std::count(files.begin(), files.end(), "sub/again/c.txt"), 1);
+  std::filesystem::remove_all(directory);
+}
+
+TEST(WalkerTest, OneFileSystemTest) {
+  // a directory on another filesystem than the test tree, linked into it
+  std::string mount = "/dev/shm";
+  struct stat tree;
+  struct stat other;
+  if (stat(testing::TempDir().c_str(), &tree) != 0 || stat(mount.c_str(), &other) != 0 || tree.st_dev == other.st_dev) {
+    GTEST_SKIP() << "no second filesystem at " << mount;
+  }
+  std::string directory = test_directory();
+  std::string outside   = mount + "/bool-search-" + std::to_string(getpid());
+  write_test_file(directory + "/inside.txt", "text\n");
+  write_test_file(outside + "/outside.txt", "text\n");
+  std::filesystem::create_directory_symlink(outside, directory + "/mounted");
+
+  WalkOptions options;
+  options.follow = true;
+  EXPECT_EQ(walked_files(directory, options), std::vector<std::string>({"inside.txt", "mounted/outside.txt"}));
+  options.one_file_system = true;
+  EXPECT_EQ(walked_files(directory, options), std::vector<std::string>({"inside.txt"}));
+
+  std::filesystem::remove_all(outside);
+  std::filesystem::remove_all(directory);
+}
+
+TEST(WalkerTest, ParallelWalkMatchesSerialIteratorTest) {
+  std::string directory = test_directory();
+  write_test_file(directory + "/.gitignore", "*.log\nskip/\n");
+  for (size_t i = 0; i < 400; i++) {
+    // a few levels deep, so many directories are expanded and stolen between threads
+    std::string path = directory + "/d" + std::to_string(i % 5) + "/e" + std::to_string(i % 11) + "/f" + std::to_string(i);
+    if (i % 9 == 0) path = directory + "/d" + std::to_string(i % 5) + "/skip/f" + std::to_string(i);
+    write_test_file(path + (i % 4 == 0 ? ".log" : ".txt"), "text\n");
+  }
+  write_test_file(directory + "/.git/config", "text\n");
+
+  std::vector<std::string> all;
+  std::vector<std::string> kept;
+  for (const auto& entry : std::filesystem::recursive_directory_iterator(directory)) {
+    if (!entry.is_regular_file()) continue;
+    std::string path = entry.path().string().substr(directory.size() + 1);
+    all.push_back(path);
+    bool ignored = path.size() > 4 && path.substr(path.size() - 4) == ".log";
+    if (!ignored && path.find("/skip/") == std::string::npos && path.substr(0, 5) != ".git/") kept.push_back(path);
+  }
+  std::sort(all.begin(), all.end());
+  std::sort(kept.begin(), kept.end());
+
+  for (size_t threads : {1, 2, 8}) {
+    std::mutex lock;
+    std::vector<std::string> files;
+    WalkOptions options;
+    Walker walker(threads, options);
+    walker.walk(directory, [&](std::string path, size_t) {
+      std::lock_guard<std::mutex> guard(lock);
+      files.push_back(path.substr(directory.size() + 1));
+    });
+    std::sort(files.begin(), files.end());
+    EXPECT_EQ(files, all) << "threads: " << threads;
+
+    options.ignore = true;
+    files.clear();
+    Walker ignoring(threads, options);
+    ignoring.walk(directory, [&](std::string path, size_t) {
+      std::lock_guard<std::mutex> guard(lock);
+      files.push_back(path.substr(directory.size() + 1));
+    });
+    std::sort(files.begin(), files.end());
+    EXPECT_EQ(files, kept) << "threads: " << threads;
+  }
+  std::filesystem::remove_all(directory);
+}
+
+TEST(WalkerTest, PrefetchWindowTest) {
+  PrefetchWindow window;
+  EXPECT_EQ(window.size(), (size_t)PREFETCH_MIN_WINDOW);
+
+  // files that are matched as fast as they were ever matched need nothing read ahead
+  for (int i = 0; i < 20; i++) window.report(1 << 20, 0.001);
+  EXPECT_EQ(window.size(), (size_t)PREFETCH_MIN_WINDOW);
+  // tiny files don't count
+  window.report(100, 10.0);
+  EXPECT_EQ(window.size(), (size_t)PREFETCH_MIN_WINDOW);
+
+  // cold files ten times slower than cached ones want more files in flight, but not more than ten
+  for (int i = 0; i < 10; i++) window.report(1 << 20, 0.01);
+  EXPECT_GT(window.size(), (size_t)PREFETCH_MIN_WINDOW);
+  EXPECT_LE(window.size(), 10u);
+  // a cached file now and then keeps the fast rate known, the window follows the share of cold ones
+  for (int i = 0; i < 100; i++) window.report(1 << 20, i % 10 == 0 ? 0.001 : 0.01);
+  size_t mostly_cold = window.size();
+  for (int i = 0; i < 100; i++) window.report(1 << 20, i % 2 == 0 ? 0.001 : 0.01);
+  EXPECT_GT(mostly_cold, window.size());
+  EXPECT_GT(window.size(), (size_t)PREFETCH_MIN_WINDOW);
+  // and never more than the limit, however slow it gets
+  for (int i = 0; i < 40; i++) window.report(1 << 20, 10.0);
+  EXPECT_EQ(window.size(), (size_t)PREFETCH_MAX_WINDOW);
+
+  // once files come from the cache again the window shrinks back
+  for (int i = 0; i < 60; i++) window.report(1 << 20, 0.001);
+  EXPECT_LE(window.size(), 2u);
+}
+
+TEST(RingTest, ManyProducersAndConsumersTest) {
+  const size_t producers    = 4;
+  const size_t consumers    = 4;
+  const size_t per_producer = 20000;
+  RingBuffer<size_t> ring(16);
+  ring.set_sample_depth(true);
+
+  std::vector<std::vector<size_t>> popped(consumers);
+  std::vector<std::thread> threads;
+  for (size_t c = 0; c < consumers; c++) {
+    threads.emplace_back([&ring, &popped, c]() {
+      size_t value;
+      while (ring.pop(value)) popped[c].push_back(value);
+    });
+  }
+  std::vector<std::thread> pushers;
+  for (size_t p = 0; p < producers; p++) {
+    pushers.emplace_back([&ring, p, per_producer]() {
+      for (size_t i = 0; i < per_producer; i++) ring.push(p * per_producer + i);
+    });
+  }
+  for (std::thread& pusher : pushers) pusher.join();
+  ring.close();
+  for (std::thread& thread : threads) thread.join();
+
+  // every value comes out once, and the values of a producer in the order it pushed them
+  std::vector<size_t> all;
+  for (const std::vector<size_t>& values : popped) {
+    for (size_t p = 0; p < producers; p++) {
+      std::vector<size_t> from_producer;
+      std::copy_if(values.begin(), values.end(), std::back_inserter(from_producer), [&](size_t value) { return value / per_producer == p; });
+      EXPECT_TRUE(std::is_sorted(from_producer.begin(), from_producer.end()));
+    }
+    all.insert(all.end(), values.begin(), values.end());
+  }
+  std::sort(all.begin(), all.end());
+  ASSERT_EQ(all.size(), producers * per_producer);
+  for (size_t i = 0; i < all.size(); i++) ASSERT_EQ(all[i], i);
+
+  // the depth a push sees is never more than the ring holds
+  const RingStats& stats = ring.stats();
+  EXPECT_EQ(stats.pushes.load(), producers * per_producer);
+  EXPECT_GE(stats.max_depth.load(), 1u);
+  EXPECT_LE(stats.max_depth.load(), ring.capacity());
+  EXPECT_LE(stats.depth_total.load(), stats.pushes.load() * ring.capacity());
+  EXPECT_EQ(ring.depth(), 0u);
+}
+
+std::vector<uint32_t> bitmap_test_ids(const Bitmap& bitmap, uint32_t universe) {
+  std::vector<uint32_t> ids;
+  for (uint32_t id = 0; id < universe; id++) {
+    if (bitmap.contains(id)) ids.push_back(id);
+  }
+  EXPECT_EQ(bitmap.ids(0, universe), ids);
+  EXPECT_EQ(bitmap.cardinality(), ids.size());
+  return ids;
+}
+
+TEST(IndexTest, BitmapMatchesSortedSetsTest) {
+  const uint32_t universe = 3 << 16;
+  // sparse, dense and run heavy sets, every kind of container meets every other
+  std::vector<std::vector<uint32_t>> sets(4);
+  for (uint32_t id = 0; id < universe; id++) {
+    if (id % 97 == 0) sets[0].push_back(id);
+    if (id % 3 != 0) sets[1].push_back(id);
+    if ((id / 1000) % 2 == 0) sets[2].push_back(id);
+    if (id >= 70000 && id < 140000 && id % 5 < 2) sets[3].push_back(id);
+  }
+
+  for (const auto& a : sets) {
+    Bitmap bitmap_a(a.data(), a.size());
+    ASSERT_EQ(bitmap_test_ids(bitmap_a, universe), a);
+
+    std::vector<uint32_t> all = Bitmap::range(0, universe).ids(0, universe);
+    ASSERT_EQ(all.size(), universe);
+    std::vector<uint32_t> flipped;
+    std::set_difference(all.begin(), all.end(), a.begin(), a.end(), std::back_inserter(flipped));
+    ASSERT_EQ(bitmap_test_ids(bitmap_a.flip(universe), universe), flipped);
+
+    for (const auto& b : sets) {
+      Bitmap bitmap_b(b.data(), b.size());
+      std::vector<uint32_t> expected;
+      std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+      ASSERT_EQ(bitmap_test_ids(bitmap_a & bitmap_b, universe), expected);
+
+      expected.clear();
+      std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+      ASSERT_EQ(bitmap_test_ids(bitmap_a | bitmap_b, universe), expected);
+      Bitmap accumulated = bitmap_a;
+      accumulated |= bitmap_b;
+      ASSERT_EQ(bitmap_test_ids(accumulated, universe), expected);
+
+      expected.clear();
+      std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+      ASSERT_EQ(bitmap_test_ids(bitmap_a - bitmap_b, universe), expected);
+    }
+  }
+}
+
+TEST(IndexTest, PostingsRoundTripTest) {
+  std::vector<uint32_t> ids;
+  uint32_t id = 0;
+  // gaps of every encoded length, and a list that doesn't end on a block boundary
+  for (size_t i = 0; i < 1000; i++) {
+    id += 1 + (i % 7 == 0 ? 1u << (8 * (i % 4)) : i % 3);
+    ids.push_back(id);
+  }
+
+  std::string encoded;
+  encode_postings(ids, encoded);
+  PostingList list(encoded.data(), ids.size());
+  ASSERT_EQ(list.encoded_size(), encoded.size());
+  ASSERT_EQ(list.block_count(), (ids.size() + POSTINGS_BLOCK_SIZE - 1) / POSTINGS_BLOCK_SIZE);
+
+  for (bool simd : {false, postings_simd_supported()}) {
+    std::vector<uint32_t> decoded(ids.size());
+    for (size_t block = 0; block < list.block_count(); block++) {
+      list.decode_block(block, decoded.data() + block * POSTINGS_BLOCK_SIZE, simd);
+      ASSERT_EQ(list.skip(block).last_id, ids[std::min(ids.size(), (block + 1) * POSTINGS_BLOCK_SIZE) - 1]);
+    }
+    ASSERT_EQ(decoded, ids) << "simd: " << simd;
+  }
+}
+
+TEST(IndexTest, PostingCursorSeekTest) {
+  std::vector<uint32_t> ids;
+  for (uint32_t id = 3; ids.size() < 3 * POSTINGS_BLOCK_SIZE + 10; id += 3) {
+    ids.push_back(id);
+  }
+  std::string encoded;
+  encode_postings(ids, encoded);
+  PostingList list(encoded.data(), ids.size());
+
+  // every id in turn, through the ends of the blocks
+  PostingCursor every(list);
+  for (uint32_t id = 0; id <= ids.back() + 3; id++) {
+    ASSERT_EQ(every.seek(id), id % 3 == 0 && id != 0 && id <= ids.back()) << "id: " << id;
+  }
+
+  // jumps over whole blocks, onto the first and the last id of one
+  PostingCursor jumps(list);
+  EXPECT_TRUE(jumps.seek(ids[0]));
+  EXPECT_TRUE(jumps.seek(ids[2 * POSTINGS_BLOCK_SIZE - 1]));
+  EXPECT_TRUE(jumps.seek(ids[2 * POSTINGS_BLOCK_SIZE]));
+  EXPECT_FALSE(jumps.seek(ids[3 * POSTINGS_BLOCK_SIZE] + 1));
+  EXPECT_TRUE(jumps.seek(ids.back()));
+  // past the end of the list, and asked again once there
+  EXPECT_FALSE(jumps.seek(ids.back() + 1));
+  EXPECT_FALSE(jumps.seek(UINT32_MAX));
+
+  PostingCursor empty(PostingList(nullptr, 0));
+  EXPECT_FALSE(empty.seek(0));
+}
+
+TEST(IndexTest, SetKernelsMatchSortedSetsTest) {
+  // lists of very different lengths, with the largest id and ids a list has on its own
+  std::vector<std::vector<uint32_t>> lists(5);
+  for (uint32_t id = 0; id < 20000; id++) {
+    if (id % 3 == 0) lists[0].push_back(id);
+    if (id % 5 < 3) lists[1].push_back(id);
+    if (id % 997 == 1) lists[2].push_back(id);
+    if (id / 64 % 2 == 0) lists[3].push_back(id);
+  }
+  lists[2].push_back(UINT32_MAX);
+  lists[3].push_back(UINT32_MAX);
+  // every id of the short list matches and the long list goes on after it
+  lists[4] = {1, 2};
+
+  for (const auto& a : lists) {
+    for (const auto& b : lists) {
+      std::vector<uint32_t> expected;
+      std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+      for (SetKernel kernel : {SetKernel::MERGE, SetKernel::SIMD, SetKernel::HASH, SetKernel::GALLOP}) {
+        // a guard past the room the kernels are given must stay as it is
+        std::vector<uint32_t> out(std::min(a.size(), b.size()) + 1, 7);
+        size_t count = intersect(a.data(), a.size(), b.data(), b.size(), out.data(), kernel);
+        ASSERT_EQ(out.back(), 7u) << "kernel: " << (int)kernel;
+        out.resize(count);
+        ASSERT_EQ(out, expected) << "kernel: " << (int)kernel;
+      }
+
+      expected.clear();
+      std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+      for (SetKernel kernel : {SetKernel::MERGE, SetKernel::GALLOP}) {
+        std::vector<uint32_t> out(a.size() + b.size());
+        out.resize(unite(a.data(), a.size(), b.data(), b.size(), out.data(), kernel));
+        ASSERT_EQ(out, expected) << "kernel: " << (int)kernel;
+      }
+    }
+  }
+}
+
+TEST(IndexTest, IndexMatchesQueryTest) {
+  const char* inputs[] = {
+      "dog",
+      "not dog",
+      "cat and not dog or fish",
+      "not ( not cats or ( dogs or camels ) ) or shark",
+      "main and not \\(",
+      "at",
+      "h,",
+      "main(",
+      "a,",
+      ",",
+      "not cat and not dog",
+      "cats and and and not giraffes and not ( not dogs )",
+      "not ( not ( not fish, ) ) or main(",
+  };
+  std::string contents =
+      "\n"
+      "cats\n"
+      "dogs and cats\n"
+      "a cat named pig\n"
+      "giraffes and shark\n"
+      "int main(\n"
+      "not a fish, or is it";
+
+  IndexBuilder builder;
+  ASSERT_TRUE(builder.add_file("animals", 0, contents.size(), contents));
+  std::string path = testing::TempDir() + "index_test.bsi";
+  ASSERT_EQ(builder.write(path), IndexStatus::OK);
+
+  IndexSegment segment;
+  ASSERT_EQ(segment.open(path), IndexStatus::OK);
+  ASSERT_EQ(segment.line_count(), 7);
+
+  for (const char* input : inputs) {
+    Parser p(input);
+    ASSERT_EQ(p.parse(), ParseStatus::OK);
+    Query query;
+    ASSERT_EQ(query.compile(p), EvalStatus::OK);
+    QueryScratch scratch = query.scratch();
+    LineMatch match      = match_lines(segment, query);
+    bool candidate       = candidate_files(segment, query).contains(0);
+
+    std::string_view rest = contents;
+    for (uint32_t id = 0; id < segment.line_count(); id++) {
+      std::string_view line = rest.substr(0, rest.find('\n'));
+      rest.remove_prefix(std::min(rest.size(), line.size() + 1));
+
+      bool expected = false;
+      ASSERT_EQ(query.eval(line, scratch, &expected), EvalStatus::OK);
+      EXPECT_TRUE(!match.yes.contains(id) || expected) << "input: " << input << " line: " << line;
+      EXPECT_TRUE(!expected || (match.maybe.contains(id) && candidate)) << "input: " << input << " line: " << line;
+    }
+  }
+  std::remove(path.c_str());
+}
+
+// a segment of one file whose lines have "common" every 2 lines, "mid" every 10 and "rare" every 400
+std::string planner_test_segment() {
+  std::string contents;
+  for (uint32_t line = 0; line < 4000; line++) {
+    if (line % 2 == 0) contents += "common ";
+    if (line % 10 == 0) contents += "mid ";
+    if (line % 400 == 0) contents += "rare ";
+    contents += "filler\n";
+  }
+  IndexBuilder builder;
+  builder.add_file("lines", 0, contents.size(), contents);
+  std::string path = testing::TempDir() + "planner_test.bsi";
+  builder.write(path);
+  return path;
+}
+
+TEST(IndexTest, QueryPlanRewritesTest) {
+  std::string path = planner_test_segment();
+  IndexSegment segment;
+  ASSERT_EQ(segment.open(path), IndexStatus::OK);
+
+  std::pair<const char*, const char*> cases[] = {
+      // the rarest operand first, whatever order they were written in
+      {"common and mid and rare",
+       "intersect, at most 10 lines\n"
+       "  lookup 'rare' 1 word, at most 10 lines\n"
+       "  lookup 'mid' 1 word, at most 400 lines\n"
+       "  lookup 'common' 1 word, at most 2000 lines\n"},
+      {"common or rare",
+       "union, at most 2010 lines\n"
+       "  lookup 'rare' 1 word, at most 10 lines\n"
+       "  lookup 'common' 1 word, at most 2000 lines\n"},
+      // a "not" under an "and" is taken away instead of complemented
+      {"mid and not common and not rare",
+       "difference, at most 400 lines\n"
+       "  lookup 'mid' 1 word, at most 400 lines\n"
+       "  lookup 'rare' 1 word, at most 10 lines\n"
+       "  lookup 'common' 1 word, at most 2000 lines\n"},
+      // "not not" cancels out, under an "and" too
+      {"not ( not rare )", "lookup 'rare' 1 word, at most 10 lines\n"},
+      {"mid and not ( not rare )",
+       "intersect, at most 10 lines\n"
+       "  lookup 'rare' 1 word, at most 10 lines\n"
+       "  lookup 'mid' 1 word, at most 400 lines\n"},
+      // only "not"s under an "and" are one complement of their union
+      {"not mid and not rare",
+       "complement, at most 3590 lines\n"
+       "  union, at most 410 lines\n"
+       "    lookup 'rare' 1 word, at most 10 lines\n"
+       "    lookup 'mid' 1 word, at most 400 lines\n"},
+      {"not common",
+       "complement, at most 2000 lines\n"
+       "  lookup 'common' 1 word, at most 2000 lines\n"},
+  };
+  for (const auto& [input, expected] : cases) {
+    Parser p(input);
+    ASSERT_EQ(p.parse(), ParseStatus::OK);
+    Query query;
+    ASSERT_EQ(query.compile(p), EvalStatus::OK);
+    EXPECT_EQ(QueryPlan(segment, query).explain(), expected) << "input: " << input;
+  }
+  std::remove(path.c_str());
+}
+
+TEST(IndexTest, ProbedLinesMatchQueryTest) {
+  std::string path = planner_test_segment();
+  IndexSegment segment;
+  ASSERT_EQ(segment.open(path), IndexStatus::OK);
+
+  // the lines of "rare" are few enough next to the postings of "common" to be probed one by one
+  IdLookup rare   = lookup_id(segment, "rare");
+  IdLookup common = lookup_id(segment, "common");
+  ASSERT_EQ(common.groups.size(), 1u);
+  ASSERT_LT(rare.estimate * common.groups[0].size() * INDEX_PROBE_COST, common.postings[0]);
+
+  for (const char* input : {"rare and common", "rare and not common", "rare and mid", "common and not rare"}) {
+    Parser p(input);
+    ASSERT_EQ(p.parse(), ParseStatus::OK);
+    Query query;
+    ASSERT_EQ(query.compile(p), EvalStatus::OK);
+    QueryScratch scratch = query.scratch();
+    LineMatch match      = match_lines(segment, query);
+
+    for (uint32_t line = 0; line < segment.line_count(); line++) {
+      std::string text;
+      if (line % 2 == 0) text += "common ";
+      if (line % 10 == 0) text += "mid ";
+      if (line % 400 == 0) text += "rare ";
+      text += "filler";
+
+      bool expected = false;
+      ASSERT_EQ(query.eval(text, scratch, &expected), EvalStatus::OK);
+      ASSERT_EQ(match.yes.contains(line), expected) << "input: " << input << " line: " << line;
+      ASSERT_EQ(match.maybe.contains(line), expected) << "input: " << input << " line: " << line;
+    }
+  }
+  std::remove(path.c_str());
+}
+
+TEST(IndexTest, CandidateFilesTest) {
+  IndexBuilder builder;
+  std::string a = "int func1() {\n  return ab_zzz;\n}\n";
+  std::string b = "void func2(void) {\n}\n";
+  ASSERT_TRUE(builder.add_file("a.c", 0, a.size(), a));
+  ASSERT_TRUE(builder.add_file("b.c", 0, b.size(), b));
+  // enough files with "zzz" that the files with "ab_" are looked up in its list one by one
+  for (int i = 0; i < 30; i++) {
+    ASSERT_TRUE(builder.add_file("filler-" + std::to_string(i), 0, 4, "zzz\n"));
+  }
+  std::string path = testing::TempDir() + "candidate_test.bsi";
+  ASSERT_EQ(builder.write(path), IndexStatus::OK);
+
+  IndexSegment segment;
+  ASSERT_EQ(segment.open(path), IndexStatus::OK);
+  ASSERT_TRUE(segment.has_trigrams());
+  uint32_t file_a = segment.find_file("a.c");
+  uint32_t file_b = segment.find_file("b.c");
+
+  std::pair<const char*, std::vector<uint32_t>> cases[] = {
+      {"func1()", {file_a}},
+      {"func2(", {file_b}},
+      {"func1() or func2(", {file_a, file_b}},
+      {"func1() and func2(", {}},
+      {"ab_zzz", {file_a}},
+      {"missing()", {}},
+  };
+  for (const auto& [input, expected] : cases) {
+    Parser p(input);
+    ASSERT_EQ(p.parse(), ParseStatus::OK);
+    Query query;
+    ASSERT_EQ(query.compile(p), EvalStatus::OK);
+    EXPECT_EQ(candidate_files(segment, query).ids(0, segment.file_count()), expected) << "input: " << input;
+  }
+
+  // short identifiers and anything under a "not" rule no file out
+  for (const char* input : {"fu", "not func1()"}) {
+    Parser p(input);
+    ASSERT_EQ(p.parse(), ParseStatus::OK);
+    Query query;
+    ASSERT_EQ(query.compile(p), EvalStatus::OK);
+    EXPECT_EQ(candidate_files(segment, query).cardinality(), segment.file_count()) << "input: " << input;
+  }
+  std::remove(path.c_str());
+}
+
+TEST(IndexTest, TermTrigramsMatchDictionaryScanTest) {
+  IndexBuilder builder;
+  std::string contents = "foo_bar barfoo foobar\nfoo bar.baz\nxfoo fo of oof\nbaz.foo_bar() bar_baz\n";
+  ASSERT_TRUE(builder.add_file("a.c", 0, contents.size(), contents));
+  std::string path = testing::TempDir() + "term_trigram_test.bsi";
+  ASSERT_EQ(builder.write(path), IndexStatus::OK);
+
+  IndexSegment segment;
+  ASSERT_EQ(segment.open(path), IndexStatus::OK);
+  ASSERT_TRUE(segment.has_term_trigrams());
+
+  auto scan = [&segment](auto accept) { return find_terms(segment, 0, segment.term_count(), accept); };
+  auto contains = [](std::string_view text) { return [text](std::string_view term) { return term.find(text) != std::string_view::npos; }; };
+  auto ends_with = [](std::string_view text) {
+    return [text](std::string_view term) { return term.size() >= text.size() && term.substr(term.size() - text.size()) == text; };
+  };
+
+  // exact identifiers, and short ones that still scan the dictionary
+  for (const char* id : {"foo", "oo_b", "bar", "baz", "fo", "o", "zzz"}) {
+    IdLookup lookup = lookup_id(segment, id);
+    ASSERT_TRUE(lookup.exact) << "id: " << id;
+    EXPECT_EQ(lookup.groups[0], scan(contains(id))) << "id: " << id;
+  }
+  // a run that ends a word and one that starts a word
+  IdLookup lookup = lookup_id(segment, "foo.ba");
+  ASSERT_EQ(lookup.groups.size(), 2u);
+  std::vector<std::vector<uint32_t>> groups   = lookup.groups;
+  std::vector<std::vector<uint32_t>> expected = {scan(ends_with("foo")), scan([](std::string_view term) { return term.substr(0, 2) == "ba"; })};
+  std::sort(groups.begin(), groups.end());
+  std::sort(expected.begin(), expected.end());
+  EXPECT_EQ(groups, expected);
+  std::remove(path.c_str());
+}
+
+TEST(IndexTest, DamagedSegmentsFailToOpenTest) {
+  std::string directory = test_directory();
+  IndexBuilder builder;
+  ASSERT_TRUE(builder.add_file("a", 1, 14, "cats and dogs\n"));
+  ASSERT_TRUE(builder.add_file("b", 1, 10, "func1() {\n"));
+  ASSERT_EQ(builder.write(directory + "/good.bsi"), IndexStatus::OK);
+
+  std::string contents;
+  {
+    std::ifstream stream(directory + "/good.bsi", std::ios::binary);
+    contents.assign(std::istreambuf_iterator<char>(stream), {});
+  }
+  auto open_changed = [&](const std::function<void(std::string&)>& change) {
+    std::string changed = contents;
+    change(changed);
+    std::ofstream(directory + "/bad.bsi", std::ios::binary | std::ios::trunc) << changed;
+    IndexSegment segment;
+    return segment.open(directory + "/bad.bsi");
+  };
+  // the entries of a section, by kind
+  auto entries = [](std::string& data, IndexSectionKind kind) {
+    const IndexHeader* header  = reinterpret_cast<const IndexHeader*>(data.data());
+    const IndexSection* table = reinterpret_cast<const IndexSection*>(header + 1);
+    for (uint32_t i = 0; i < header->section_count; i++) {
+      if (table[i].kind == (uint32_t)kind) return &data[table[i].offset];
+    }
+    return (char*)nullptr;
+  };
+
+  EXPECT_EQ(open_changed([](std::string&) {}), IndexStatus::OK);
+  EXPECT_EQ(open_changed([](std::string& data) { data.resize(data.size() / 2); }), IndexStatus::BAD_FORMAT);
+  EXPECT_EQ(open_changed([&](std::string& data) { reinterpret_cast<IndexTermEntry*>(entries(data, IndexSectionKind::TERMS))->posting_offset += 1 << 20; }), IndexStatus::BAD_FORMAT);
+  EXPECT_EQ(open_changed([&](std::string& data) { reinterpret_cast<IndexTermEntry*>(entries(data, IndexSectionKind::TERMS))->text_length = 1 << 20; }), IndexStatus::BAD_FORMAT);
+  EXPECT_EQ(open_changed([&](std::string& data) { reinterpret_cast<IndexFileEntry*>(entries(data, IndexSectionKind::FILES))->path_offset = 1 << 20; }), IndexStatus::BAD_FORMAT);
+  EXPECT_EQ(open_changed([&](std::string& data) { reinterpret_cast<IndexFileEntry*>(entries(data, IndexSectionKind::FILES))->line_count = 5; }), IndexStatus::BAD_FORMAT);
+  EXPECT_EQ(open_changed([&](std::string& data) { reinterpret_cast<IndexTrigramEntry*>(entries(data, IndexSectionKind::TRIGRAMS))->file_count = 1 << 24; }), IndexStatus::BAD_FORMAT);
+  std::filesystem::remove_all(directory);
+}
+
+TEST(IndexTest, LaterSegmentsOverrideFilesTest) {
+  std::string directory = test_directory();
+
+  IndexBuilder first;
+  ASSERT_TRUE(first.add_file("a", 1, 4, "cat\n"));
+  ASSERT_TRUE(first.add_file("b", 1, 4, "dog\n"));
+  ASSERT_TRUE(first.add_file("c", 1, 5, "fish\n"));
+  ASSERT_TRUE(first.add_file("d", 1, 5, "bird\n"));
+  ASSERT_EQ(first.write(directory + "/override-1.bsi"), IndexStatus::OK);
+
+  // a changed, b is gone and c was touched
+  IndexBuilder second;
+  ASSERT_TRUE(second.add_file("a", 2, 6, "camel\n"));
+  second.remove_file("b");
+  second.retime_file("c", 2);
+  ASSERT_EQ(second.write(directory + "/override-2.bsi"), IndexStatus::OK);
+  ASSERT_EQ(write_current(directory, {"override-1.bsi", "override-2.bsi"}), IndexStatus::OK);
+
+  Index index;
+  ASSERT_EQ(index.open(directory), IndexStatus::OK);
+  int64_t mtime;
+  EXPECT_FALSE(index.live_file(0, 0, &mtime));
+  EXPECT_FALSE(index.live_file(0, 1, &mtime));
+  ASSERT_TRUE(index.live_file(0, 2, &mtime));
+  EXPECT_EQ(mtime, 2);
+  ASSERT_TRUE(index.live_file(0, 3, &mtime));
+  EXPECT_EQ(mtime, 1);
+  ASSERT_TRUE(index.live_file(1, 0, &mtime));
+  EXPECT_EQ(mtime, 2);
+
+  const IndexSegment& segment = *index.get_segments()[0];
+  EXPECT_EQ(segment.find_file("c"), 2);
+  EXPECT_EQ(segment.find_file("e"), segment.file_count());
+  EXPECT_EQ(segment.file(2).hash, content_hash("fish\n"));
+  EXPECT_NE(segment.file(2).hash, content_hash("fish!"));
+
+  std::filesystem::remove_all(directory);
+}
+
+// the files the index has, by path, with their mtime
+std::map<std::string, int64_t> live_files(const Index& index) {
+  std::map<std::string, int64_t> files;
+  for (size_t s = 0; s < index.get_segments().size(); s++) {
+    const IndexSegment& segment = *index.get_segments()[s];
+    for (size_t f = 0; f < segment.file_count(); f++) {
+      int64_t mtime;
+      if (index.live_file(s, f, &mtime)) files[std::string(segment.file_path(f))] = mtime;
+    }
+  }
+  return files;
+}
+
+TEST(IndexTest, MergedSegmentsKeepLiveFilesTest) {
+  std::string directory = test_directory();
+
+  IndexBuilder first;
+  ASSERT_TRUE(first.add_file("a", 1, 4, "cat\n"));
+  ASSERT_TRUE(first.add_file("b", 1, 4, "dog\n"));
+  ASSERT_TRUE(first.add_file("c", 1, 5, "fish\n"));
+  ASSERT_TRUE(first.add_file("d", 1, 5, "bird\n"));
+  ASSERT_EQ(first.write(directory + "/merge-1.bsi"), IndexStatus::OK);
+
+  IndexBuilder second;
+  ASSERT_TRUE(second.add_file("a", 2, 6, "camel\n"));
+  second.remove_file("b");
+  second.retime_file("c", 2);
+  ASSERT_EQ(second.write(directory + "/merge-2.bsi"), IndexStatus::OK);
+
+  IndexBuilder third;
+  ASSERT_TRUE(third.add_file("e", 3, 11, "cat\ncamel\n"));
+  third.remove_file("d");
+  ASSERT_EQ(third.write(directory + "/merge-3.bsi"), IndexStatus::OK);
+  ASSERT_EQ(write_current(directory, {"merge-1.bsi", "merge-2.bsi", "merge-3.bsi"}), IndexStatus::OK);
+
+  Index index;
+  ASSERT_EQ(index.open(directory), IndexStatus::OK);
+  std::map<std::string, int64_t> expected = live_files(index);
+  ASSERT_EQ(expected, (std::map<std::string, int64_t>{{"a", 2}, {"c", 2}, {"e", 3}}));
+
+  // the newer two, whose overrides still apply to the first
+  Throttle throttle(0);
+  IndexBuilder newer;
+  ASSERT_TRUE(newer.merge(index, 1, 2, throttle));
+  ASSERT_EQ(newer.write(directory + "/merge-4.bsi"), IndexStatus::OK);
+  ASSERT_EQ(write_current(directory, {"merge-1.bsi", "merge-4.bsi"}), IndexStatus::OK);
+  ASSERT_EQ(index.open(directory), IndexStatus::OK);
+  EXPECT_EQ(live_files(index), expected);
+
+  // then everything into one segment without overrides
+  IndexBuilder all;
+  ASSERT_TRUE(all.merge(index, 0, 1, throttle));
+  ASSERT_EQ(all.write(directory + "/merge-5.bsi"), IndexStatus::OK);
+  ASSERT_EQ(write_current(directory, {"merge-5.bsi"}), IndexStatus::OK);
+  ASSERT_EQ(index.open(directory), IndexStatus::OK);
+  EXPECT_EQ(live_files(index), expected);
+
+  const IndexSegment& segment = *index.get_segments()[0];
+  EXPECT_EQ(segment.file_count(), 3);
+  EXPECT_EQ(segment.line_count(), 4);
+  EXPECT_TRUE(segment.removed_paths().empty());
+  EXPECT_TRUE(segment.retimed_paths().empty());
+
+  // lines are numbered a, c, e: "camel", "fish", "cat", "camel"
+  for (auto [input, lines] : {std::pair<const char*, std::vector<uint32_t>>{"camel", {0, 3}}, {"cat", {2}}, {"fish or dog", {1}}}) {
+    Parser p(input);
+    ASSERT_EQ(p.parse(), ParseStatus::OK);
+    Query query;
+    ASSERT_EQ(query.compile(p), EvalStatus::OK);
+    LineMatch match = match_lines(segment, query);
+    for (uint32_t id = 0; id < segment.line_count(); id++) {
+      bool expected_line = std::find(lines.begin(), lines.end(), id) != lines.end();
+      EXPECT_EQ(match.maybe.contains(id), expected_line) << "input: " << input << " line: " << id;
+    }
+  }
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST(IndexTest, PlanMergeTest) {
+  const uint64_t small  = 1000;
+  const uint64_t level1 = 2 * INDEX_MERGE_UNIT;
+  const uint64_t level2 = 8 * INDEX_MERGE_UNIT;
+
+  std::pair<std::vector<uint64_t>, size_t> cases[] = {
+      {{}, 0},
+      {{small, small, small}, 3},
+      {{small, small, small, small}, 0},
+      // a big old segment is left alone, the small ones after it are merged among themselves
+      {{level2, small, small, small, small}, 1},
+      {{level2, small, small, small}, 4},
+      // the smaller segments newer than those of a level go along in its merge without counting
+      {{level1, level1, level1, small, level1}, 0},
+      {{level1, level1, level1, small, small, small}, 6},
+      {{level2, level1, level1, level1, small, small, small, small}, 4},
+  };
+  for (const auto& [sizes, expected] : cases) {
+    EXPECT_EQ(plan_merge(sizes), expected) << "segments: " << sizes.size();
+  }
+}
+
+TEST(IndexTest, ThrottleTest) {
+  // no limit doesn't wait
+  auto start = std::chrono::steady_clock::now();
+  Throttle unlimited(0);
+  unlimited.consume(1ull << 40);
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(50));
+
+  // 1 MB at 10 MB/s takes about a tenth of a second
+  start = std::chrono::steady_clock::now();
+  Throttle throttle(10 << 20);
+  for (int i = 0; i < 16; i++) {
+    throttle.consume(1 << 16);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_GE(elapsed, std::chrono::milliseconds(90));
+  EXPECT_LT(elapsed, std::chrono::seconds(2));
+}
+
+TEST(IndexTest, MergedRunsMatchOneBuilderTest) {
+  std::string directory = test_directory();
+  std::vector<std::pair<std::string, std::string>> files = {
+    {"a", "cat dog\nfish\n"}, {"b", "dog\n\ncamel"}, {"c", "bird cat cat\n"}, {"d", "func1() and func2()\n"}, {"e", "fish\ndog\ncat\n"},
+  };
+  // a word too long for the dictionary
+  files[4].second += std::string(INDEX_MAX_TERM_LENGTH + 1, 'x') + "\n";
+
+  IndexBuilder whole;
+  for (const auto& [path, contents] : files) {
+    ASSERT_TRUE(whole.add_file(path, 1, contents.size(), contents));
+  }
+  ASSERT_EQ(whole.write(directory + "/runs-whole.bsi"), IndexStatus::OK);
+
+  // runs of one, three and one file
+  std::vector<std::unique_ptr<IndexSegment>> runs;
+  std::vector<const IndexSegment*> merged;
+  for (auto [begin, end] : {std::pair<size_t, size_t>{0, 1}, {1, 4}, {4, 5}}) {
+    IndexBuilder run;
+    for (size_t i = begin; i < end; i++) {
+      ASSERT_TRUE(run.add_file(files[i].first, 1, files[i].second.size(), files[i].second));
+    }
+    std::string path = directory + "/runs-" + std::to_string(begin) + ".bsi";
+    ASSERT_EQ(run.write(path), IndexStatus::OK);
+    runs.push_back(std::make_unique<IndexSegment>());
+    ASSERT_EQ(runs.back()->open(path), IndexStatus::OK);
+    merged.push_back(runs.back().get());
+    std::remove(path.c_str());
+  }
+  uint64_t terms;
+  ASSERT_EQ(merge_runs(merged, directory + "/runs-merged.bsi", &terms), IndexStatus::OK);
+
+  IndexSegment expected;
+  IndexSegment segment;
+  ASSERT_EQ(expected.open(directory + "/runs-whole.bsi"), IndexStatus::OK);
+  ASSERT_EQ(segment.open(directory + "/runs-merged.bsi"), IndexStatus::OK);
+  ASSERT_EQ(segment.file_count(), expected.file_count());
+  ASSERT_EQ(segment.line_count(), expected.line_count());
+  ASSERT_EQ(segment.term_count(), expected.term_count());
+  EXPECT_EQ(terms, expected.term_count());
+
+  for (size_t f = 0; f < expected.file_count(); f++) {
+    EXPECT_EQ(segment.file_path(f), expected.file_path(f));
+    EXPECT_EQ(segment.file(f).first_line, expected.file(f).first_line);
+    EXPECT_EQ(segment.file(f).hash, expected.file(f).hash);
+  }
+  for (size_t t = 0; t < expected.term_count(); t++) {
+    EXPECT_EQ(segment.term(t), expected.term(t));
+    EXPECT_EQ(segment.posting_list(t).decode(), expected.posting_list(t).decode()) << "term: " << expected.term(t);
+  }
+  EXPECT_EQ(segment.long_words(), expected.long_words());
+  ASSERT_EQ(segment.trigram_count(), expected.trigram_count());
+  for (size_t t = 0; t < expected.trigram_count(); t++) {
+    EXPECT_EQ(segment.trigram(t), expected.trigram(t));
+    EXPECT_EQ(segment.trigram_list_at(t).decode(), expected.trigram_list_at(t).decode());
+  }
+  ASSERT_TRUE(segment.has_term_trigrams());
+  for (size_t t = 0; t < expected.term_count(); t++) {
+    std::string_view term = expected.term(t);
+    for (size_t i = 0; i + 2 < term.size(); i++) {
+      uint32_t trigram = make_trigram(term.data() + i);
+      EXPECT_EQ(segment.term_trigram_list(trigram).decode(), expected.term_trigram_list(trigram).decode()) << "term: " << term;
+    }
+  }
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST(BloomCacheTest, FiltersRuleOutFilesTest) {
+  std::string path = testing::TempDir() + "bloom_test.cache";
+  std::remove(path.c_str());
+
+  {
+    BloomCache cache;
+    cache.open(path);
+    cache.update("animals", 1, 30, "cats and dogs\na giraffe\n");
+    cache.update("code", 1, 20, "int main() {\n}\n");
+    ASSERT_TRUE(cache.save());
+  }
+
+  BloomCache cache;
+  cache.open(path);
+  EXPECT_TRUE(cache.fresh("animals", 1, 30));
+  EXPECT_FALSE(cache.fresh("animals", 2, 30));
+  EXPECT_FALSE(cache.fresh("plants", 1, 30));
+
+  auto may_match = [&cache](const char* input, const char* file, int64_t mtime) {
+    Parser p(input);
+    EXPECT_EQ(p.parse(), ParseStatus::OK);
+    Query query;
+    EXPECT_EQ(query.compile(p), EvalStatus::OK);
+    return cache.may_match(file, mtime, file == std::string("animals") ? 30 : 20, query);
+  };
+  EXPECT_TRUE(may_match("giraffe", "animals", 1));
+  EXPECT_TRUE(may_match("cats and dogs", "animals", 1));
+  EXPECT_FALSE(may_match("main()", "animals", 1));
+  EXPECT_TRUE(may_match("main()", "code", 1));
+  EXPECT_TRUE(may_match("shark or giraffe", "animals", 1));
+  // short identifiers and "not" don't rule anything out
+  EXPECT_TRUE(may_match("in", "animals", 1));
+  EXPECT_TRUE(may_match("not cats", "animals", 1));
+  EXPECT_TRUE(may_match("not giraffe and not x", "code", 1));
+  // a stale entry never rules out
+  EXPECT_TRUE(may_match("main()", "animals", 2));
+
+  // updated entries replace old ones, the others are kept
+  cache.update("animals", 2, 30, "sharks\n");
+  cache.update("birds", 2, 20, "crows\n");
+  cache.update_unfiltered("binary", 2, 20);
+  ASSERT_TRUE(cache.save());
+  BloomCache reopened;
+  reopened.open(path);
+  EXPECT_TRUE(reopened.fresh("animals", 2, 30));
+  EXPECT_TRUE(reopened.fresh("birds", 2, 20));
+  EXPECT_TRUE(reopened.fresh("code", 1, 20));
+  // an entry without a filter is up to date but never rules its file out
+  EXPECT_TRUE(reopened.fresh("binary", 2, 20));
+  Parser p("main()");
+  ASSERT_EQ(p.parse(), ParseStatus::OK);
+  Query query;
+  ASSERT_EQ(query.compile(p), EvalStatus::OK);
+  EXPECT_TRUE(reopened.may_match("binary", 2, 20, query));
+  std::remove(path.c_str());
+}
+
+// the standard output of a shell command
+std::string run_command(const std::string& command) {
+  std::string output;
+  FILE* pipe = popen(command.c_str(), "r");
+  if (!pipe) return output;
+  char buffer[4096];
+  for (size_t n; (n = fread(buffer, 1, sizeof(buffer), pipe)) > 0;) {
+    output.append(buffer, n);
+  }
+  pclose(pipe);
+  return output;
+}
+
+TEST(IndexTest, IndexSearchMatchesRecursiveSearchTest) {
+  std::string directory = testing::TempDir() + "index_search_test";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+  std::ofstream(directory + "/blank.txt") << "a\n\nb)\n\nc\n";
+  std::ofstream(directory + "/words.txt") << "cat dog\n\nfunc1() dog\nbird\n";
+  ASSERT_EQ(std::system((std::string(BOOL_SEARCH_BINARY) + " index build " + directory + " > /dev/null").c_str()), 0);
+
+  for (const char* input : {"not \\)", "not b", "not dog", "not ( cat or bird )", "dog and not cat", "not func1()"}) {
+    std::string query    = std::string(" '") + input + "' " + directory;
+    std::string expected = run_command(BOOL_SEARCH_BINARY " -r --sort" + query);
+    EXPECT_NE(expected, "") << "input: " << input;
+    EXPECT_EQ(run_command(BOOL_SEARCH_BINARY " --index" + query), expected) << "input: " << input;
+  }
+  std::filesystem::remove_all(directory);
+}
+
+TEST(SearchTest, BinaryFilesTest) {
+  std::string directory = test_directory();
+  std::ofstream(directory + "/text.txt") << "needle\n";
+  // a NUL byte in the first block makes a file binary, however many lines of it match
+  std::ofstream(directory + "/data.bin", std::ios::binary) << std::string("needle\0\nneedle\nneedle again\n", 28);
+
+  std::string text = directory + "/text.txt:1: needle\n";
+  EXPECT_EQ(run_command(BOOL_SEARCH_BINARY " -r --sort needle " + directory), text);
+  EXPECT_EQ(run_command(BOOL_SEARCH_BINARY " needle " + directory + "/data.bin"), "");
+
+  // reported once, at the first match, instead of skipped
+  std::string report = "Binary file " + directory + "/data.bin matches\n";
+  EXPECT_EQ(run_command(BOOL_SEARCH_BINARY " -r --sort --binary needle " + directory), report + text);
+  EXPECT_EQ(run_command(BOOL_SEARCH_BINARY " --binary needle " + directory + "/data.bin"), report);
+  EXPECT_EQ(run_command(BOOL_SEARCH_BINARY " --binary missing " + directory + "/data.bin"), "");
+  std::filesystem::remove_all(directory);
+}
+
+TEST(SearchTest, ParallelOutputKeepsWalkOrderTest) {
+  std::string directory = test_directory();
+  // sizes all over the place, so the biggest files are searched first and finish out of order
+  for (size_t i = 0; i < 300; i++) {
+    std::string contents;
+    for (size_t line = 0; line < (i * 37) % 500 + 1; line++) {
+      contents += line % 3 == 0 ? "match " + std::to_string(i) + "\n" : "other\n";
+    }
+    write_test_file(directory + "/d" + std::to_string(i % 7) + "/f" + std::to_string(i), contents);
+  }
+
+  // one walker thread finds files in the same order every run, --sort in path order
+  for (const char* options : {" -r --walk-threads=1", " -r --sort"}) {
+    std::string serial = run_command(BOOL_SEARCH_BINARY + std::string(options) + " -j 1 match " + directory);
+    EXPECT_NE(serial, "");
+    for (const char* threads : {" -j 2", " -j 4", " -j 8"}) {
+      EXPECT_EQ(run_command(BOOL_SEARCH_BINARY + std::string(options) + threads + " match " + directory), serial) << "options:" << options << threads;
+    }
+  }
+  std::filesystem::remove_all(directory);
+}
+
+TEST(SearchTest, ChunkedFileMatchesWholeFileTest) {
+  std::string path = testing::TempDir() + "chunked_test.txt";
+  std::string expected;
+  {
+    // about 4 MB, so 1 MB chunks split it in several places
+    std::ofstream stream(path);
+    for (size_t i = 0; i < 300000; i++) {
+      if (i % 7 == 0) {
+        stream << "match " << i << '\n';
+        expected += path + ":" + std::to_string(i + 1) + ": match " + std::to_string(i) + "\n";
+      } else {
+        stream << "other line " << i << '\n';
+      }
+    }
+  }
+
+  std::string whole   = run_command(BOOL_SEARCH_BINARY " -j 1 match " + path);
+  std::string chunked = run_command(BOOL_SEARCH_BINARY " -j 4 --chunk-size=1 match " + path);
+  EXPECT_EQ(whole, expected);
+  EXPECT_EQ(chunked, expected);
+  std::remove(path.c_str());
+}
+
+TEST(SearchTest, ChunkPoolOnlyUsesIdleHelpersTest) {
+  ChunkPool pool(1);
+  std::mutex lock;
+  std::condition_variable changed;
+  bool started  = false;
+  bool released = false;
+
+  // wait until the helper is idle, then keep it busy
+  while (!pool.try_run([&]() {
+    std::unique_lock<std::mutex> guard(lock);
+    started = true;
+    changed.notify_all();
+    changed.wait(guard, [&released] { return released; });
+  })) {
+    std::this_thread::yield();
+  }
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [&started] { return started; });
+  }
+  EXPECT_FALSE(pool.try_run([]() {}));
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    released = true;
+  }
+  changed.notify_all();
+  std::atomic<bool> ran{false};
+  while (!pool.try_run([&ran]() { ran = true; })) {
+    std::this_thread::yield();
+  }
+  while (!ran) {
+    std::this_thread::yield();
+  }
+
+  ChunkPool none(0);
+  EXPECT_FALSE(none.try_run([]() {}));
+}
+
+// the order a scheduler hands out files of the sizes in, seq 0 is the smallest so it is overtaken
+std::vector<size_t> scheduled_order(size_t count, size_t window, size_t lead) {
+  Scheduler scheduler(window, lead);
+  std::vector<size_t> order;
+  for (size_t seq = 0; seq < count; seq++) {
+    scheduler.add({seq, "file-" + std::to_string(seq), seq * 7 % 13 + (seq == 0 ? 0 : 1)});
+    while (scheduler.ready()) order.push_back(scheduler.take().seq);
+  }
+  while (!scheduler.empty()) order.push_back(scheduler.take().seq);
+  return order;
+}
+
+TEST(SearchTest, SchedulerLeadTest) {
+  for (size_t lead : {0, 1, 3}) {
+    std::vector<size_t> order = scheduled_order(100, 8, lead);
+    ASSERT_EQ(order.size(), 100u);
+
+    // never more than lead files ahead of the oldest one still waiting
+    std::set<size_t> handed_out;
+    for (size_t seq : order) {
+      handed_out.insert(seq);
+      size_t oldest = 0;
+      while (handed_out.count(oldest)) oldest++;
+      size_t ahead = std::count_if(handed_out.begin(), handed_out.end(), [oldest](size_t s) { return s > oldest; });
+      EXPECT_LE(ahead, lead) << "lead: " << lead;
+    }
+    if (lead == 0) {
+      EXPECT_TRUE(std::is_sorted(order.begin(), order.end()));
+    } else {
+      EXPECT_NE(order[0], 0u) << "lead: " << lead;
+    }
+  }
+}
+
+TEST(SearchTest, SequencerSlowHeadTest) {
+  const size_t WORKERS   = 4;
+  const size_t FILES     = 40;
+  const size_t PIECES    = 3;
+  const size_t PIECE     = 100;
+  const size_t MAX_BYTES = 1000;
+
+  // the head is handed out behind files ahead of it, and its worker is slow to start it
+  std::vector<size_t> order = scheduled_order(FILES, 8, WORKERS - 1);
+  ASSERT_NE(order[0], 0u);
+
+  Sequencer sequencer(64, MAX_BYTES);
+  std::FILE* file = std::tmpfile();
+  ASSERT_NE(file, nullptr);
+  OutputBuffer out(fileno(file), false);
+  std::thread writer([&]() { sequencer.run(out); });
+
+  std::atomic<size_t> taken{0};
+  std::atomic<size_t> deposited{0};
+  std::atomic<size_t> most_before_head{0};
+  std::atomic<bool> head_started{false};
+  std::vector<std::thread> workers;
+  for (size_t w = 0; w < WORKERS; w++) {
+    workers.emplace_back([&]() {
+      for (size_t i = taken++; i < order.size(); i = taken++) {
+        size_t seq = order[i];
+        if (seq == 0) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(50));
+          head_started = true;
+        }
+        sequencer.begin(seq);
+        for (size_t p = 0; p < PIECES; p++) {
+          std::string line = std::to_string(seq) + " " + std::to_string(p) + " ";
+          line.resize(PIECE - 1, '.');
+          line += '\n';
+          OutputPiece piece;
+          piece.buffer   = line;
+          piece.segments = {{nullptr, 0, line.size()}};
+          piece.size     = line.size();
+          sequencer.deposit(seq, std::move(piece));
+
+          // nothing is written before the head, so everything deposited so far is waiting
+          size_t total = deposited += PIECE;
+          if (!head_started) {
+            size_t most = most_before_head;
+            while (total > most && !most_before_head.compare_exchange_weak(most, total)) {}
+          }
+        }
+        sequencer.finish(seq);
+      }
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  sequencer.close();
+  writer.join();
+  out.flush();
+
+  // one piece per worker may slip past the limit
+  EXPECT_LE(most_before_head.load(), MAX_BYTES + WORKERS * PIECE);
+
+  std::string expected;
+  for (size_t seq = 0; seq < FILES; seq++) {
+    for (size_t p = 0; p < PIECES; p++) {
+      std::string line = std::to_string(seq) + " " + std::to_string(p) + " ";
+      line.resize(PIECE - 1, '.');
+      expected += line + '\n';
+    }
+  }
+  std::string written(expected.size() + 1, '\0');
+  std::rewind(file);
+  written.resize(std::fread(written.data(), 1, written.size(), file));
+  std::fclose(file);
+  EXPECT_EQ(written, expected);
+}